@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Time vfat_init on a directory tree, such as one made by gen-tree,
+ * and report what the image costs: the stat calls the scanner made,
+ * the peak RSS of the process before and after, and the bytes of
+ * FAT, directory and filemap bookkeeping per file. The files and
+ * directories are counted by reading them back from the image.
+ *
+ * With THREADS set to 0 the tree is walked with fts, and the stat
+ * calls aren't counted.
+ *
+ * The result is one line of key=value pairs.
+ *
+ * Usage: bench-init [-j THREADS] DIR
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+
+#include <vector>
+
+#include "vfat.h"
+#include "fat.h"
+#include "dir.h"
+#include "filemap.h"
+#include "scan.h"
+
+static uint32_t bytes_per_cluster;
+static uint64_t fat_start, fat_size, data_start;
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long peak_rss_kib()
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+static uint32_t get_le(const uint8_t *p, int bytes)
+{
+	uint32_t val = 0;
+
+	while (bytes--)
+		val = val << 8 | p[bytes];
+	return val;
+}
+
+static void read_image(void *buf, uint64_t from, uint32_t len)
+{
+	if (vfat_fill(buf, from, len)) {
+		fprintf(stderr, "read of %u bytes at %llu failed\n",
+			len, (unsigned long long) from);
+		exit(1);
+	}
+}
+
+static uint32_t next_cluster(uint32_t clust)
+{
+	uint8_t entry[4];
+
+	read_image(entry, fat_start + clust * 4, 4);
+	return get_le(entry, 4) & 0x0fffffff;
+}
+
+static void read_dir(std::vector<uint8_t> &dir, uint32_t clust)
+{
+	while (clust >= 2 && clust < 0x0ffffff0) {
+		dir.resize(dir.size() + bytes_per_cluster);
+		read_image(&dir[dir.size() - bytes_per_cluster], data_start
+			+ (uint64_t) (clust - 2) * bytes_per_cluster,
+			bytes_per_cluster);
+		clust = next_cluster(clust);
+	}
+}
+
+/* Count the files and directories under the directory at 'clust' */
+static void count_entries(uint32_t clust, uint64_t *files, uint64_t *dirs)
+{
+	std::vector<uint8_t> dir;
+
+	read_dir(dir, clust);
+	for (size_t pos = 0; pos + 32 <= dir.size(); pos += 32) {
+		const uint8_t *entry = &dir[pos];
+		if (entry[0] == 0)
+			break;
+		if (entry[0] == 0xe5 || entry[0] == '.'
+				|| (entry[11] & 0x0f) == 0x0f)
+			continue;
+		if (entry[11] & 0x10) {
+			++*dirs;
+			count_entries(get_le(entry + 20, 2) << 16
+				| get_le(entry + 26, 2), files, dirs);
+		} else {
+			++*files;
+		}
+	}
+}
+
+/* Read the boot sector. Result: the root directory's cluster */
+static uint32_t read_boot()
+{
+	uint8_t boot[512];
+
+	read_image(boot, 0, sizeof(boot));
+	bytes_per_cluster = get_le(boot + 11, 2) * boot[13];
+	fat_start = (uint64_t) get_le(boot + 14, 2) * get_le(boot + 11, 2);
+	fat_size = (uint64_t) get_le(boot + 36, 4) * get_le(boot + 11, 2);
+	data_start = fat_start + boot[16] * fat_size;
+	return get_le(boot + 44, 4);
+}
+
+int main(int argc, char **argv)
+{
+	const char *program = argv[0];
+	int threads = -1;
+	uint64_t files = 0, dirs = 0;
+	uint64_t stat_calls;
+	size_t metadata;
+	long base_rss, peak_rss;
+	double elapsed;
+	int c;
+
+	while ((c = getopt(argc, argv, "j:")) >= 0) {
+		if (c != 'j')
+			return 2;
+		threads = atoi(optarg);
+	}
+	if (optind + 1 != argc) {
+		fprintf(stderr, "Usage: %s [-j THREADS] DIR\n", program);
+		return 2;
+	}
+	if (threads >= 0)
+		vfat_set_scan_threads(threads);
+
+	vfat_adjust_size(64 * 1024 * 1024, 512);  /* 32 GiB */
+	base_rss = peak_rss_kib();
+	elapsed = now();
+	vfat_init(argv[optind], 0, NULL);
+	elapsed = now() - elapsed;
+	peak_rss = peak_rss_kib();
+	stat_calls = threads == 0 ? 0 : scan_stat_calls();
+	metadata = fat_mem_usage() + dir_mem_usage() + filemap_mem_usage();
+
+	count_entries(read_boot(), &files, &dirs);
+	printf("bench=vfat_init dirs=%llu files=%llu wall_ms=%.1f "
+		"stat_calls=%llu base_rss_kib=%ld peak_rss_kib=%ld "
+		"metadata_bytes=%llu metadata_per_file=%.1f\n",
+		(unsigned long long) dirs, (unsigned long long) files,
+		elapsed * 1e3, (unsigned long long) stat_calls, base_rss,
+		peak_rss, (unsigned long long) metadata,
+		files ? (double) metadata / files : 0.0);
+	return 0;
+}
@@ -0,0 +1,557 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Microbenchmarks for the code that builds and serves the image.
+ *
+ * For each extent count, a synthetic image is built with fat.cpp,
+ * dir.cpp and filemap.cpp directly: a tenth of the extents are
+ * directories, the rest files of 1 to 64 clusters that all map to the
+ * same data file, and there is free space between them. The hot paths
+ * are timed on it with requests of each size:
+ *
+ *   find_extent        fat_filemap_index() of random clusters
+ *   fat_fill_chain     FAT sectors in the files' chains
+ *   fat_fill_literal   FAT sectors in the free space
+ *   data_fill_dir      data_fill() of directory clusters
+ *   data_fill_literal  data_fill() of free clusters
+ *   data_fill_filemap  data_fill() of file clusters
+ *   dir_fill           reads of the root directory, which is large
+ *   dir_add_entry      adding the entries of all the files
+ *
+ * find_extent() itself is static, so it is timed through
+ * fat_filemap_index(), which does little else after fat_finalize().
+ *
+ * Then dir_convert_name() is timed with names of a few lengths, and
+ * localtime(), which is where encode_datetime() spends its time; it
+ * runs twice for every entry that is added.
+ *
+ * Finally a tree of up to 20000 small files is made in a temporary
+ * directory, and vfat_fill() is timed on requests that straddle the
+ * boundaries between the regions of the image built from it.
+ *
+ * Each result is printed as one line of key=value pairs. Requests
+ * that don't depend on the extent count or size have them as 0.
+ *
+ * Usage: bench-micro [-t SECONDS] [EXTENTS,... [SIZES,...]]
+ */
+
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <vector>
+
+#include "vfat.h"
+#include "fat.h"
+#include "dir.h"
+#include "filemap.h"
+#include "stats.h"
+
+#define PICKS 4096  /* random numbers used over and over */
+#define MAX_FILE_CLUSTERS 64
+#define FREE_CLUSTERS (1 << 20)
+#define MAX_TREE_FILES 20000
+
+static double min_time = 0.2;
+static uint32_t picks[PICKS];
+static char *buf;
+static volatile uint32_t sink;  /* keeps results from being optimized out */
+
+/* The regions of the synthetic image, as first cluster and count */
+static uint32_t dir_first, dir_clusters;
+static uint32_t free_first, free_clusters;
+static uint32_t file_first, file_clusters;
+
+static uint64_t vfat_from;
+
+typedef uint64_t (*bench_fn)(uint32_t i, uint32_t size);
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_picks()
+{
+	uint32_t seed = 1;
+
+	for (int i = 0; i < PICKS; i++) {
+		seed = seed * 1103515245 + 12345;
+		picks[i] = seed >> 1;
+	}
+}
+
+static void report(const char *name, uint64_t extents, uint32_t size,
+	uint64_t ops, uint64_t bytes, double elapsed)
+{
+	printf("bench=%s extents=%llu size=%u ops=%llu ns_per_op=%.1f "
+		"mib_per_s=%.1f\n", name, (unsigned long long) extents, size,
+		(unsigned long long) ops, elapsed * 1e9 / ops,
+		bytes / elapsed / (1 << 20));
+	fflush(stdout);
+}
+
+/* Call 'fn' in ever larger batches until it ran for min_time seconds.
+ * 'fn' returns the number of bytes it produced. */
+static void run(const char *name, uint64_t extents, uint32_t size,
+	bench_fn fn)
+{
+	uint64_t ops = 0, bytes = 0;
+	uint32_t batch = 16;
+	double start = now();
+	double elapsed;
+
+	do {
+		for (uint32_t i = 0; i < batch; i++)
+			bytes += fn(ops + i, size);
+		ops += batch;
+		if (batch < (1 << 20))
+			batch *= 2;
+		elapsed = now() - start;
+	} while (elapsed < min_time);
+	report(name, extents, size, ops, bytes, elapsed);
+}
+
+/* Order of the regions in the data area */
+static int data_rank(uint32_t clust)
+{
+	switch (data_region(clust)) {
+	case STATS_DIR:
+		return 0;
+	case STATS_LITERAL:
+		return 1;
+	default:
+		return 2;
+	}
+}
+
+/* Result: the first cluster in [lo, hi) with at least rank 'rank' */
+static uint32_t find_data_rank(uint32_t lo, uint32_t hi, int rank)
+{
+	uint32_t mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (data_rank(mid) >= rank)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/* Build the synthetic image. 'data_file' has MAX_FILE_CLUSTERS clusters
+ * and lives in 'data_dir'. The dir_add_entry result is reported from
+ * here, because every entry can only be added once. */
+static void build_image(const char *data_dir, uint32_t extents)
+{
+	uint32_t dirs = extents / 10 ? extents / 10 : 1;
+	uint32_t files = extents - dirs;
+	uint32_t data_clusters;
+	std::vector<uint32_t> clusters(files);
+	std::vector<uint32_t> starts(files);
+	std::vector<filename_t> names(files);
+	uint32_t total = 0;
+	char name[64];
+	double start;
+	int dir;
+
+	for (uint32_t i = 0; i < files; i++) {
+		clusters[i] = 1 + picks[i % PICKS] % MAX_FILE_CLUSTERS;
+		total += clusters[i];
+		snprintf(name, sizeof(name), "Photo from holiday %08u.jpg", i);
+		dir_convert_name(name, strlen(name), names[i]);
+	}
+	/* the root directory gets a quarter of the entries */
+	data_clusters = dirs + files / 32 + total + 2 * FREE_CLUSTERS;
+
+	fat_init(data_clusters);
+	filemap_init();
+	dir_init(data_dir);
+	for (uint32_t i = 1; i < dirs; i++) {
+		snprintf(name, sizeof(name), "Camera %u", i);
+		dir_alloc_new((i - 1) / 8, name);
+	}
+	for (uint32_t i = 0; i < files; i++)
+		starts[i] = filemap_add(0, "data", clusters[i] * CLUSTER_SIZE,
+			NULL);
+
+	start = now();
+	for (uint32_t i = 0; i < files; i++) {
+		dir = i % 4 == 0 ? 0 : i % dirs;
+		if (!dir_add_entry(dir_cluster(dir), starts[i], names[i],
+				clusters[i] * CLUSTER_SIZE, FAT_ATTR_NONE,
+				1400000000 + i, 1400000000 + i)) {
+			fprintf(stderr, "dir_add_entry failed\n");
+			exit(1);
+		}
+	}
+	report("dir_add_entry", extents, 0, files, 0, now() - start);
+
+	fat_finalize(FREE_CLUSTERS);
+
+	dir_first = ROOT_DIR_CLUSTER;
+	free_first = find_data_rank(dir_first, data_clusters + 2, 1);
+	file_first = find_data_rank(free_first, data_clusters + 2, 2);
+	dir_clusters = free_first - dir_first;
+	free_clusters = file_first - free_first;
+	file_clusters = data_clusters + 2 - file_first;
+}
+
+static uint64_t bench_find_extent(uint32_t i, uint32_t)
+{
+	uint32_t clusters = dir_clusters + free_clusters + file_clusters;
+
+	sink += fat_filemap_index(dir_first + picks[i % PICKS] % clusters);
+	return 0;
+}
+
+static uint64_t fill_fat(uint32_t first, uint32_t count, uint32_t i,
+	uint32_t size)
+{
+	uint32_t entries = size / 4;
+
+	if (entries > count)
+		entries = count;
+	fat_fill(buf, first + picks[i % PICKS] % (count - entries + 1),
+		entries);
+	return entries * 4;
+}
+
+static uint64_t bench_fat_fill_chain(uint32_t i, uint32_t size)
+{
+	return fill_fat(file_first, file_clusters, i, size);
+}
+
+static uint64_t bench_fat_fill_literal(uint32_t i, uint32_t size)
+{
+	return fill_fat(free_first, free_clusters, i, size);
+}
+
+static uint64_t fill_data(uint32_t first, uint32_t count, uint32_t i,
+	uint32_t size)
+{
+	uint32_t filled;
+
+	if (data_fill(buf, size, first + picks[i % PICKS] % count, 0,
+			&filled)) {
+		fprintf(stderr, "data_fill failed\n");
+		exit(1);
+	}
+	return filled;
+}
+
+static uint64_t bench_data_fill_dir(uint32_t i, uint32_t size)
+{
+	return fill_data(dir_first, dir_clusters, i, size);
+}
+
+static uint64_t bench_data_fill_literal(uint32_t i, uint32_t size)
+{
+	return fill_data(free_first, free_clusters, i, size);
+}
+
+static uint64_t bench_data_fill_filemap(uint32_t i, uint32_t size)
+{
+	return fill_data(file_first, file_clusters, i, size);
+}
+
+static uint64_t bench_dir_fill(uint32_t i, uint32_t size)
+{
+	uint32_t dir_len = dir_size(0);
+	uint32_t len = size < dir_len ? size : dir_len;
+	uint32_t offset = picks[i % PICKS] % (dir_len - len + 1);
+
+	dir_fill(buf, len, 0, offset & ~31);
+	return len;
+}
+
+static std::vector<char> conv_names;  /* nul-terminated, all one length */
+static uint32_t conv_name_len;
+
+static uint64_t bench_convert_name(uint32_t i, uint32_t)
+{
+	static filename_t name16;
+	uint32_t n = conv_names.size() / (conv_name_len + 1);
+
+	sink += dir_convert_name(&conv_names[i % n * (conv_name_len + 1)],
+		conv_name_len, name16);
+	return conv_name_len;
+}
+
+/* Make names of 'len' bytes. With 'utf8', every fourth character
+ * is a two-byte one. */
+static void make_conv_names(uint32_t len, bool utf8)
+{
+	static const char ascii[] = "Photo_from_holiday-";
+	uint32_t pos;
+
+	conv_names.clear();
+	conv_name_len = len;
+	for (int n = 0; n < 1000; n++) {
+		for (pos = 0; pos < len; pos++) {
+			if (utf8 && pos % 4 == 3 && pos + 1 < len) {
+				conv_names.push_back('\xc3');
+				conv_names.push_back('\xa9');
+				pos++;
+			} else {
+				conv_names.push_back(ascii[(n + pos)
+					% (sizeof(ascii) - 1)]);
+			}
+		}
+		conv_names.push_back(0);
+	}
+}
+
+static uint64_t bench_localtime(uint32_t i, uint32_t)
+{
+	time_t stamp = 1400000000 + picks[i % PICKS] % 300000000;
+
+	sink += localtime(&stamp)->tm_min;
+	return 0;
+}
+
+static uint64_t bench_vfat_fill(uint32_t, uint32_t size)
+{
+	if (vfat_fill(buf, vfat_from, size)) {
+		fprintf(stderr, "vfat_fill failed\n");
+		exit(1);
+	}
+	return size;
+}
+
+static void make_tree(const char *dirname, int files)
+{
+	char path[4096];
+	int fd;
+
+	for (int i = 0; i < files; i++) {
+		if (i % 100 == 0) {
+			snprintf(path, sizeof(path), "%s/%04d", dirname,
+				i / 100);
+			mkdir(path, 0777);
+		}
+		snprintf(path, sizeof(path), "%s/%04d/IMG_%08d.jpg",
+			dirname, i / 100, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0 || write(fd, path, 100) < 0) {
+			perror(path);
+			exit(1);
+		}
+		close(fd);
+	}
+}
+
+static int remove_entry(const char *path, const struct stat *, int,
+	struct FTW *)
+{
+	return remove(path);
+}
+
+static uint32_t get_le(const uint8_t *p, int bytes)
+{
+	uint32_t val = 0;
+
+	while (bytes--)
+		val = val << 8 | p[bytes];
+	return val;
+}
+
+/* Order of the regions in the image */
+static int image_rank(uint64_t from)
+{
+	switch (vfat_region(from)) {
+	case STATS_RESERVED:
+		return 0;
+	case STATS_FAT:
+		return 1;
+	case STATS_DIR:
+		return 2;
+	case STATS_LITERAL:
+		return 3;
+	default:
+		return 4;
+	}
+}
+
+/* Result: the first sector offset in [lo, hi) with at least 'rank' */
+static uint64_t find_image_rank(uint64_t lo, uint64_t hi, int rank)
+{
+	uint64_t mid;
+
+	lo /= SECTOR_SIZE;
+	hi /= SECTOR_SIZE;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (image_rank(mid * SECTOR_SIZE) >= rank)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo * SECTOR_SIZE;
+}
+
+static void bench_boundaries(const char *tmpdir, int files,
+	const std::vector<uint32_t> &sizes)
+{
+	static const char *names[] = {
+		"vfat_fill_reserved_fat", "vfat_fill_fat_dir",
+		"vfat_fill_dir_free", "vfat_fill_free_file",
+	};
+	char dirname[256];
+	uint8_t boot[SECTOR_SIZE];
+	uint64_t image_size;
+	uint64_t boundary;
+
+	snprintf(dirname, sizeof(dirname), "%s/tree-%d", tmpdir, files);
+	mkdir(dirname, 0777);
+	make_tree(dirname, files);
+	vfat_adjust_size(64 * 1024 * 1024, SECTOR_SIZE);  /* 32 GiB */
+	vfat_init(dirname, 64 * 1024 * 1024, NULL);
+
+	vfat_fill(boot, 0, sizeof(boot));
+	image_size = (uint64_t) get_le(boot + 32, 4) * SECTOR_SIZE;
+	boundary = 0;
+	for (int rank = 1; rank <= 4; rank++) {
+		boundary = find_image_rank(boundary, image_size, rank);
+		for (size_t s = 0; s < sizes.size(); s++) {
+			vfat_from = boundary > sizes[s] / 2
+				? boundary - sizes[s] / 2 : 0;
+			vfat_from &= ~(uint64_t) (SECTOR_SIZE - 1);
+			run(names[rank - 1], files, sizes[s],
+				bench_vfat_fill);
+		}
+	}
+}
+
+static void parse_list(const char *arg, std::vector<uint32_t> &list)
+{
+	char *end;
+
+	list.clear();
+	do {
+		list.push_back(strtoul(arg, &end, 0));
+		arg = end + 1;
+	} while (*end == ',');
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<uint32_t> extents, sizes;
+	std::vector<int> tree_files;
+	char tmpdir[] = "/tmp/bench-micro.XXXXXX";
+	char path[4096];
+	uint32_t max_size = 0;
+	int c;
+	int fd;
+
+	while ((c = getopt(argc, argv, "t:")) >= 0) {
+		if (c != 't') {
+			fprintf(stderr, "Usage: %s [-t SECONDS] "
+				"[EXTENTS,... [SIZES,...]]\n", argv[0]);
+			return 2;
+		}
+		min_time = atof(optarg);
+	}
+	parse_list(optind < argc ? argv[optind] : "1000,100000,1000000",
+		extents);
+	parse_list(optind + 1 < argc ? argv[optind + 1] : "4096,65536,1048576",
+		sizes);
+	for (size_t s = 0; s < sizes.size(); s++) {
+		if (sizes[s] == 0 || sizes[s] % SECTOR_SIZE) {
+			fprintf(stderr, "sizes must be multiples of %d\n",
+				SECTOR_SIZE);
+			return 2;
+		}
+		if (sizes[s] > max_size)
+			max_size = sizes[s];
+	}
+	for (size_t e = 0; e < extents.size(); e++) {
+		if (extents[e] < 10) {
+			fprintf(stderr, "at least 10 extents are needed\n");
+			return 2;
+		}
+	}
+
+	buf = (char *) malloc(max_size);
+	if (!buf || !mkdtemp(tmpdir)) {
+		perror("bench-micro");
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/data", tmpdir);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	memset(buf, 'x', max_size);
+	for (int i = 0; fd >= 0 && i < MAX_FILE_CLUSTERS; i++) {
+		if (write(fd, buf, CLUSTER_SIZE) != CLUSTER_SIZE) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+	close(fd);
+	make_picks();
+
+	for (size_t e = 0; e < extents.size(); e++) {
+		build_image(tmpdir, extents[e]);
+		run("find_extent", extents[e], 0, bench_find_extent);
+		for (size_t s = 0; s < sizes.size(); s++) {
+			run("fat_fill_chain", extents[e], sizes[s],
+				bench_fat_fill_chain);
+			run("fat_fill_literal", extents[e], sizes[s],
+				bench_fat_fill_literal);
+			run("data_fill_dir", extents[e], sizes[s],
+				bench_data_fill_dir);
+			run("data_fill_literal", extents[e], sizes[s],
+				bench_data_fill_literal);
+			run("data_fill_filemap", extents[e], sizes[s],
+				bench_data_fill_filemap);
+			run("dir_fill", extents[e], sizes[s], bench_dir_fill);
+		}
+	}
+
+	for (uint32_t len = 12; len <= 192; len *= 4) {
+		make_conv_names(len, false);
+		run("convert_name_ascii", 0, len, bench_convert_name);
+		make_conv_names(len, true);
+		run("convert_name_utf8", 0, len, bench_convert_name);
+	}
+	run("localtime", 0, 0, bench_localtime);
+
+	for (size_t e = 0; e < extents.size(); e++) {
+		c = extents[e] < MAX_TREE_FILES ? extents[e] : MAX_TREE_FILES;
+		if (tree_files.empty() || tree_files.back() != c) {
+			tree_files.push_back(c);
+			bench_boundaries(tmpdir, c, sizes);
+		}
+	}
+
+	nftw(tmpdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Time the conversion of NAMES filenames from UTF-8 to UTF-16LE with
+ * dir_convert_name(), which widens ASCII runs many bytes at a time,
+ * and with ConvertUTF alone, the way it was done before. One name in
+ * ten has non-ASCII characters in it. Both must give the same result
+ * for every name, and for a corpus of random mixes of ASCII, valid
+ * multibyte sequences and invalid bytes.
+ *
+ * Usage: bench-names [NAMES]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+
+#include <vector>
+
+#include "ConvertUTF.h"
+
+#include "dir.h"
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The conversion as it was before the ASCII fast path */
+static int convert_slow(const char *name8, int namelen, filename_t &name16)
+{
+	const UTF8 *inp = (const UTF8 *) name8;
+	UTF16 *bufp;
+
+	name16.clear();
+	name16.resize(namelen + 1);
+	bufp = &name16[0];
+	if (ConvertUTF8toUTF16LE(&inp, inp + namelen, &bufp, bufp + namelen,
+			strictConversion) != conversionOK)
+		return -1;
+	*bufp++ = 0;
+	name16.resize(bufp - &name16[0]);
+	return 0;
+}
+
+/* Names are stored one after another, each nul-terminated */
+static void make_names(std::vector<char> &names, int count)
+{
+	char name[100];
+
+	for (int i = 0; i < count; i++) {
+		if (i % 10 == 9)
+			snprintf(name, sizeof(name),
+				"Caf\xc3\xa9 M\xc3\xbcnchen %06d.jpg", i);
+		else if (i % 3)
+			snprintf(name, sizeof(name), "IMG_%08d.jpg", i);
+		else
+			snprintf(name, sizeof(name),
+				"Photo from holiday %06d.jpg", i);
+		names.insert(names.end(), name, name + strlen(name) + 1);
+	}
+}
+
+static void make_corpus(std::vector<char> &names, int count)
+{
+	static const char *pieces[] = {
+		"a", "Z", "0", ".", " ", "-", "photo_", "IMG_0001.jpg",
+		"\xc3\xa9", "\xe6\x97\xa5", "\xf0\x9f\x98\x80",
+		"\xff", "\xc3", "\x80", "\xed\xa0\x80",
+	};
+	const int npieces = sizeof(pieces) / sizeof(pieces[0]);
+	uint32_t seed = 1;
+	int len, piece;
+
+	for (int i = 0; i < count; i++) {
+		len = 0;
+		do {
+			seed = seed * 1103515245 + 12345;
+			piece = (seed >> 16) % (npieces * 4);
+			if (piece >= npieces)
+				piece %= 8;  /* mostly ASCII */
+			names.insert(names.end(), pieces[piece],
+				pieces[piece] + strlen(pieces[piece]));
+			len += strlen(pieces[piece]);
+		} while (len < 200 && (seed >> 8) % 23);
+		names.push_back(0);
+	}
+}
+
+/* Result: the number of names on which the two conversions differ */
+static int compare(const std::vector<char> &names)
+{
+	filename_t fast, slow;
+	int differ = 0;
+	int fast_ret, slow_ret;
+	size_t len;
+
+	for (size_t pos = 0; pos < names.size(); pos += len + 1) {
+		len = strlen(&names[pos]);
+		fast_ret = dir_convert_name(&names[pos], len, fast);
+		slow_ret = convert_slow(&names[pos], len, slow);
+		if (fast_ret != slow_ret || (fast_ret == 0 && fast != slow))
+			differ++;
+	}
+	return differ;
+}
+
+static double time_conversion(const std::vector<char> &names,
+	int (*convert)(const char *, int, filename_t &))
+{
+	filename_t name16;
+	double start = now();
+	size_t len;
+
+	for (size_t pos = 0; pos < names.size(); pos += len + 1) {
+		len = strlen(&names[pos]);
+		convert(&names[pos], len, name16);
+	}
+	return now() - start;
+}
+
+int main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 1000000;
+	std::vector<char> names, corpus;
+	double fast, slow;
+	int differ;
+
+	make_names(names, count);
+	make_corpus(corpus, 100000);
+
+	slow = time_conversion(names, convert_slow);
+	fast = time_conversion(names, dir_convert_name);
+	printf("%d names: ConvertUTF %.1f ms, fast path %.1f ms (%.1fx)\n",
+		count, slow * 1e3, fast * 1e3, slow / fast);
+
+	differ = compare(names) + compare(corpus);
+	printf("%d names differ\n", differ);
+	return differ != 0;
+}
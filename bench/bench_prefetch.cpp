@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Replay the requests of a host that opens a folder of photos in its
+ * file manager: read the folder's directory clusters, then the first
+ * HEAD_KIB of every file in it, spending DECODE_US on each thumbnail.
+ * The files are dropped from the page cache before each run, and the
+ * time until the last thumbnail is reported with and without prefetch.
+ *
+ * Usage: bench-prefetch DIR [HEAD_KIB [DECODE_US [BUDGET_MIB]]]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "vfat.h"
+#include "filemap.h"
+
+static uint32_t bytes_per_cluster;
+static uint64_t fat_start, data_start;
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t get_le(const uint8_t *p, int bytes)
+{
+	uint32_t val = 0;
+
+	while (bytes--)
+		val = val << 8 | p[bytes];
+	return val;
+}
+
+static void read_image(void *buf, uint64_t from, uint32_t len)
+{
+	if (vfat_fill(buf, from, len)) {
+		fprintf(stderr, "read of %u bytes at %llu failed\n",
+			len, (unsigned long long) from);
+		exit(1);
+	}
+}
+
+static uint32_t next_cluster(uint32_t clust)
+{
+	uint8_t entry[4];
+
+	read_image(entry, fat_start + clust * 4, 4);
+	return get_le(entry, 4) & 0x0fffffff;
+}
+
+static uint64_t cluster_pos(uint32_t clust)
+{
+	return data_start + (uint64_t) (clust - 2) * bytes_per_cluster;
+}
+
+/* Read the first 'len' bytes of the chain starting at 'clust' */
+static void read_chain(std::vector<uint8_t> &buf, uint32_t clust, uint32_t len)
+{
+	uint32_t n;
+
+	buf.clear();
+	while (len > 0 && clust >= 2 && clust < 0x0ffffff0) {
+		n = len < bytes_per_cluster ? len : bytes_per_cluster;
+		buf.resize(buf.size() + n);
+		read_image(&buf[buf.size() - n], cluster_pos(clust), n);
+		len -= n;
+		clust = next_cluster(clust);
+	}
+}
+
+static double browse(uint32_t head, int decode_us)
+{
+	std::vector<uint8_t> dir, data;
+	uint8_t boot[512];
+	uint32_t clust, size;
+	double start = now();
+
+	read_image(boot, 0, sizeof(boot));
+	bytes_per_cluster = get_le(boot + 11, 2) * boot[13];
+	fat_start = (uint64_t) get_le(boot + 14, 2) * get_le(boot + 11, 2);
+	data_start = fat_start + (uint64_t) boot[16] * get_le(boot + 36, 4)
+		* get_le(boot + 11, 2);
+
+	/* whole root directory; it's small compared to the files */
+	read_chain(dir, get_le(boot + 44, 4), 0xffffffff);
+	for (size_t pos = 0; pos + 32 <= dir.size(); pos += 32) {
+		const uint8_t *entry = &dir[pos];
+		if (entry[0] == 0)
+			break;
+		if (entry[0] == 0xe5 || (entry[11] & 0x18))
+			continue;
+		clust = get_le(entry + 20, 2) << 16 | get_le(entry + 26, 2);
+		size = get_le(entry + 28, 4);
+		read_chain(data, clust, size < head ? size : head);
+		usleep(decode_us);
+	}
+	return now() - start;
+}
+
+static void drop_cache(const char *dirname)
+{
+	char path[4096];
+	struct dirent *de;
+	DIR *d = opendir(dirname);
+	int fd;
+
+	while (d && (de = readdir(d))) {
+		snprintf(path, sizeof(path), "%s/%s", dirname, de->d_name);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+	if (d)
+		closedir(d);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t head = 16;
+	int decode_us = 2000;
+	uint32_t budget = 64;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s DIR [HEAD_KIB [DECODE_US "
+			"[BUDGET_MIB]]]\n", argv[0]);
+		return 2;
+	}
+	if (argc > 2)
+		head = atoi(argv[2]);
+	if (argc > 3)
+		decode_us = atoi(argv[3]);
+	if (argc > 4)
+		budget = atoi(argv[4]);
+
+	vfat_adjust_size(64 * 1024 * 1024, 512);  /* 32 GiB */
+	for (int prefetch = 0; prefetch < 2; prefetch++) {
+		filemap_set_prefetch(prefetch ? head << 10 : 0, budget << 20);
+		vfat_init(argv[1], 0, NULL);
+		drop_cache(argv[1]);
+		printf("prefetch %s: last thumbnail after %.1f ms\n",
+			prefetch ? "on " : "off", browse(head << 10, decode_us) * 1e3);
+	}
+	return 0;
+}
@@ -0,0 +1,451 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Time vfat_init on a directory tree with the fts walk and with
+ * the getdents/statx scanner at various thread counts, looking up
+ * entries one at a time and in io_uring batches of BATCH, and check
+ * that they all build the same image by hashing the FAT and every
+ * directory in it.
+ *
+ * Finally the scan cache is checked: a scan that fills it, one that
+ * reuses it, and one after a file was added, which must build the same
+ * image as a full scan of the changed tree.
+ *
+ * Then the image is rebuilt with vfat_rescan(), and a lazy scan is
+ * timed: until serving starts, until the first
+ * cluster of the root directory can be read, and until the whole FAT
+ * can be read. It lays out the image differently, so only the number
+ * and total size of the files in it are compared.
+ *
+ * With -c, the page cache is dropped before each run (this needs
+ * root), and the scanner also runs with lookups in readdir order to
+ * compare against inode order.
+ *
+ * If DIR doesn't exist, a synthetic tree of FILES photos is created
+ * there first: a few camera folders, each with subfolders of up to
+ * 100 files with long names.
+ *
+ * Usage: bench-scan [-c] DIR [FILES [BATCH [THREADS...]]]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <vector>
+
+#include "vfat.h"
+#include "scan.h"
+
+static uint32_t bytes_per_cluster;
+static uint64_t fat_start, fat_size, data_start;
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t get_le(const uint8_t *p, int bytes)
+{
+	uint32_t val = 0;
+
+	while (bytes--)
+		val = val << 8 | p[bytes];
+	return val;
+}
+
+static void read_image(void *buf, uint64_t from, uint32_t len)
+{
+	if (vfat_fill(buf, from, len)) {
+		fprintf(stderr, "read of %u bytes at %llu failed\n",
+			len, (unsigned long long) from);
+		exit(1);
+	}
+}
+
+/* FNV-1a */
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *p, size_t len)
+{
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static uint32_t next_cluster(uint32_t clust)
+{
+	uint8_t entry[4];
+
+	read_image(entry, fat_start + clust * 4, 4);
+	return get_le(entry, 4) & 0x0fffffff;
+}
+
+static void read_cluster(uint8_t *buf, uint32_t clust)
+{
+	read_image(buf, data_start + (uint64_t) (clust - 2) * bytes_per_cluster,
+		bytes_per_cluster);
+}
+
+static void read_dir(std::vector<uint8_t> &dir, uint32_t clust)
+{
+	while (clust >= 2 && clust < 0x0ffffff0) {
+		dir.resize(dir.size() + bytes_per_cluster);
+		read_cluster(&dir[dir.size() - bytes_per_cluster], clust);
+		clust = next_cluster(clust);
+	}
+}
+
+static uint64_t hash_dir(uint64_t hash, uint32_t clust)
+{
+	std::vector<uint8_t> dir;
+	uint32_t sub;
+
+	read_dir(dir, clust);
+	hash = hash_bytes(hash, dir.data(), dir.size());
+
+	for (size_t pos = 0; pos + 32 <= dir.size(); pos += 32) {
+		const uint8_t *entry = &dir[pos];
+		if (entry[0] == 0)
+			break;
+		if (entry[0] == 0xe5 || entry[0] == '.'
+				|| (entry[11] & 0x0f) == 0x0f
+				|| !(entry[11] & 0x10))
+			continue;
+		sub = get_le(entry + 20, 2) << 16 | get_le(entry + 26, 2);
+		hash = hash_dir(hash, sub);
+	}
+	return hash;
+}
+
+/* Count the files under the directory at 'clust' and add up their
+ * sizes. This doesn't depend on where things are in the image. */
+static void count_files(uint32_t clust, uint64_t *files, uint64_t *bytes)
+{
+	std::vector<uint8_t> dir;
+
+	read_dir(dir, clust);
+	for (size_t pos = 0; pos + 32 <= dir.size(); pos += 32) {
+		const uint8_t *entry = &dir[pos];
+		if (entry[0] == 0)
+			break;
+		if (entry[0] == 0xe5 || entry[0] == '.'
+				|| (entry[11] & 0x0f) == 0x0f)
+			continue;
+		if (entry[11] & 0x10) {
+			count_files(get_le(entry + 20, 2) << 16
+				| get_le(entry + 26, 2), files, bytes);
+		} else {
+			++*files;
+			*bytes += get_le(entry + 28, 4);
+		}
+	}
+}
+
+/* Read the boot sector. Result: the root directory's cluster */
+static uint32_t read_boot()
+{
+	uint8_t boot[512];
+
+	read_image(boot, 0, sizeof(boot));
+	bytes_per_cluster = get_le(boot + 11, 2) * boot[13];
+	fat_start = (uint64_t) get_le(boot + 14, 2) * get_le(boot + 11, 2);
+	fat_size = (uint64_t) get_le(boot + 36, 4) * get_le(boot + 11, 2);
+	data_start = fat_start + boot[16] * fat_size;
+	return get_le(boot + 44, 4);
+}
+
+static uint64_t hash_image()
+{
+	std::vector<uint8_t> fat(1 << 20);
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint32_t root = read_boot();
+	uint32_t n;
+
+	for (uint64_t pos = 0; pos < fat_size; pos += n) {
+		n = fat_size - pos < fat.size() ? fat_size - pos : fat.size();
+		read_image(fat.data(), fat_start + pos, n);
+		hash = hash_bytes(hash, fat.data(), n);
+	}
+	return hash_dir(hash, root);
+}
+
+static void make_tree(const char *dirname, int files)
+{
+	char path[4096];
+	int fd;
+
+	if (mkdir(dirname, 0777) < 0) {
+		perror(dirname);
+		exit(1);
+	}
+	for (int i = 0; i < files; i++) {
+		if (i % 10000 == 0) {
+			snprintf(path, sizeof(path), "%s/Camera %d",
+				dirname, i / 10000);
+			mkdir(path, 0777);
+		}
+		if (i % 100 == 0) {
+			snprintf(path, sizeof(path), "%s/Camera %d/%04d-%02d",
+				dirname, i / 10000, 2000 + i / 1200,
+				i / 100 % 12 + 1);
+			mkdir(path, 0777);
+		}
+		snprintf(path, sizeof(path),
+			"%s/Camera %d/%04d-%02d/Photo from holiday %06d.jpg",
+			dirname, i / 10000, 2000 + i / 1200, i / 100 % 12 + 1, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0 || write(fd, path, i % 3) < 0) {
+			perror(path);
+			exit(1);
+		}
+		close(fd);
+	}
+}
+
+/* Needs root. Result: false if the caches couldn't be dropped. */
+static bool drop_caches()
+{
+	int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	bool ok;
+
+	sync();
+	ok = fd >= 0 && write(fd, "3", 1) == 1;
+	if (fd >= 0)
+		close(fd);
+	return ok;
+}
+
+struct run {
+	int threads;  /* 0 for the fts walk */
+	int batch;
+	bool inode_order;
+	const char *cache;  /* scan cache file, or NULL */
+};
+
+static bool cold;
+
+/* Build the image of 'dir' as 'r' says.
+ * Result: the hash of the image, with *elapsed set to the time
+ * vfat_init took. */
+static uint64_t timed_scan(const char *dir, const struct run *r,
+	double *elapsed)
+{
+	vfat_set_scan_threads(r->threads);
+	vfat_set_scan_batch(r->batch);
+	vfat_set_scan_cache(r->cache);
+	scan_set_inode_order(r->inode_order);
+	if (cold && !drop_caches()) {
+		perror("/proc/sys/vm/drop_caches");
+		exit(1);
+	}
+	*elapsed = now();
+	vfat_init(dir, 0, NULL);
+	*elapsed = now() - *elapsed;
+	return hash_image();
+}
+
+static void report(const char *label, double elapsed, uint64_t hash,
+	uint64_t expected)
+{
+	printf("%-36s scan %.1f ms, image %016llx%s\n", label,
+		elapsed * 1e3, (unsigned long long) hash,
+		hash == expected ? "" : " DIFFERENT");
+}
+
+int main(int argc, char **argv)
+{
+	int files = 20000;
+	int batch = 32;
+	std::vector<int> threads;
+	std::vector<struct run> runs;
+	struct run r;
+	struct stat st;
+	uint64_t first_hash = 0, hash;
+	double elapsed;
+	const char *program = argv[0];
+	char label[100];
+	char cache[] = "/tmp/bench-scan-cache.XXXXXX";
+	char extra[4096];
+	int ret = 0;
+	int c;
+	int fd;
+
+	while ((c = getopt(argc, argv, "c")) >= 0) {
+		if (c != 'c')
+			return 2;
+		cold = true;
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s [-c] DIR [FILES [BATCH "
+			"[THREADS...]]]\n", program);
+		return 2;
+	}
+	if (argc > 2)
+		files = atoi(argv[2]);
+	if (argc > 3)
+		batch = atoi(argv[3]);
+	for (int i = 4; i < argc; i++)
+		threads.push_back(atoi(argv[i]));
+	if (threads.empty()) {
+		threads.push_back(1);
+		threads.push_back(4);
+		threads.push_back(8);
+	}
+
+	r.threads = 0;
+	r.batch = 0;
+	r.inode_order = false;
+	r.cache = NULL;
+	runs.push_back(r);
+	for (size_t i = 0; i < threads.size(); i++) {
+		r.threads = threads[i];
+		for (int b = 0; b < 2; b++) {
+			r.batch = b ? batch : 0;
+			/* inode order only matters when the inode
+			 * table has to come from the storage */
+			for (int o = cold ? 0 : 1; o < 2; o++) {
+				r.inode_order = o;
+				runs.push_back(r);
+			}
+		}
+	}
+
+	if (stat(argv[1], &st) < 0) {
+		make_tree(argv[1], files);
+		/* the scan cache doesn't trust directories that
+		 * changed in the last two seconds */
+		sleep(3);
+	}
+
+	vfat_adjust_size(8 * 1024 * 1024, 512);  /* 4 GiB */
+	if (!cold) {
+		vfat_set_scan_threads(0);
+		vfat_init(argv[1], 0, NULL);  /* warm the dentry cache */
+	}
+	for (size_t i = 0; i < runs.size(); i++) {
+		hash = timed_scan(argv[1], &runs[i], &elapsed);
+		if (i == 0)
+			first_hash = hash;
+		else if (hash != first_hash)
+			ret = 1;
+		if (runs[i].threads == 0)
+			snprintf(label, sizeof(label), "fts walk:");
+		else
+			snprintf(label, sizeof(label),
+				"threads %2d, batch %2d, %s order:",
+				runs[i].threads, runs[i].batch,
+				runs[i].inode_order ? "inode  " : "readdir");
+		report(label, elapsed, hash, first_hash);
+	}
+
+	/* Rescan while serving, with the last settings: it has to
+	 * build the same image, and it logs how long the old one was
+	 * locked. */
+	vfat_enable_updates();
+	elapsed = now();
+	vfat_rescan(0);
+	elapsed = now() - elapsed;
+	hash = hash_image();
+	report("rescan:", elapsed, hash, first_hash);
+	if (hash != first_hash)
+		ret = 1;
+
+	/* Lazy scan, with the last settings */
+	{
+		uint64_t files = 0, bytes = 0, lazy_files = 0, lazy_bytes = 0;
+		std::vector<uint8_t> buf;
+		double t[3];
+		uint32_t root;
+
+		count_files(read_boot(), &files, &bytes);
+		vfat_set_lazy(true);
+		timed_scan(argv[1], &r, &elapsed);  /* warm up */
+		if (cold && !drop_caches()) {
+			perror("/proc/sys/vm/drop_caches");
+			exit(1);
+		}
+		t[0] = now();
+		vfat_init(argv[1], 0, NULL);
+		t[1] = now();
+		root = read_boot();
+		buf.resize(bytes_per_cluster);
+		read_cluster(buf.data(), root);
+		t[2] = now();
+		hash_image();
+		elapsed = now();
+		vfat_set_lazy(false);
+		count_files(root, &lazy_files, &lazy_bytes);
+		printf("%-36s serve %.1f ms, root %.1f ms, all %.1f ms, "
+			"%llu files %llu bytes%s\n", "lazy scan:",
+			(t[1] - t[0]) * 1e3, (t[2] - t[0]) * 1e3,
+			(elapsed - t[0]) * 1e3, (unsigned long long) lazy_files,
+			(unsigned long long) lazy_bytes,
+			files == lazy_files && bytes == lazy_bytes
+				? "" : " DIFFERENT");
+		if (files != lazy_files || bytes != lazy_bytes)
+			ret = 1;
+	}
+
+	/* The scan cache, with the last settings: first filled, then
+	 * used as is, then used after a directory changed, which has
+	 * to give the same image as a full scan of the changed tree. */
+	fd = mkstemp(cache);
+	if (fd < 0) {
+		perror(cache);
+		return 1;
+	}
+	close(fd);
+	r.cache = cache;
+	hash = timed_scan(argv[1], &r, &elapsed);
+	report("scan cache, empty:", elapsed, hash, first_hash);
+	if (hash != first_hash)
+		ret = 1;
+	hash = timed_scan(argv[1], &r, &elapsed);
+	report("scan cache, unchanged tree:", elapsed, hash, first_hash);
+	if (hash != first_hash)
+		ret = 1;
+
+	snprintf(extra, sizeof(extra), "%s/bench-scan extra file", argv[1]);
+	fd = open(extra, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0 || write(fd, "x", 1) != 1) {
+		perror(extra);
+		return 1;
+	}
+	close(fd);
+	r.cache = NULL;
+	first_hash = timed_scan(argv[1], &r, &elapsed);
+	r.cache = cache;
+	hash = timed_scan(argv[1], &r, &elapsed);
+	report("scan cache, changed tree:", elapsed, hash, first_hash);
+	if (hash != first_hash)
+		ret = 1;
+	unlink(extra);
+	unlink(cache);
+	return ret;
+}
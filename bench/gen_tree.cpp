@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Make a synthetic directory tree with the shape of a real one, so
+ * that scans of trees like a user's can be timed without the user's
+ * files. The shape comes from a profile:
+ *
+ *   camera  a few flat folders of numbered photos
+ *   source  a deep tree of small files, some of them empty
+ *   music   artist and album folders with a million tracks,
+ *           many of them with non-ASCII names
+ *
+ * Any of the profile's settings can be changed with KEY=VALUE
+ * arguments; ranges are given as MIN-MAX:
+ *
+ *   top=N         directories in DIR itself
+ *   depth=N       levels of directories, counting those
+ *   fanout=RANGE  subdirectories of each deeper directory
+ *   files=RANGE   files in each directory
+ *   skew=X        more than 1 makes most directories have few files
+ *   names=RANGE   characters in file names, without the extension
+ *   non_ascii=X   fraction of names with non-ASCII characters
+ *   empty=X       fraction of files that are empty
+ *   sparse=X      fraction of the other files that have no data
+ *   sizes=RANGE   file sizes, spread evenly over the powers of two
+ *   max_files=N   stop after this many files, or 0 for no limit
+ *   seed=N
+ *
+ * Files are only made sparse with ftruncate, and the others are
+ * written, so the tree should go on tmpfs to keep the page cache out
+ * of the timings. There is a warning if it doesn't. The music profile
+ * needs a tmpfs with room for a million inodes (nr_inodes=0 lifts the
+ * limit).
+ *
+ * Usage: gen-tree PROFILE DIR [KEY=VALUE...]
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <linux/magic.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+struct profile {
+	const char *name;
+	int top;
+	int depth;
+	int fanout_min, fanout_max;
+	int files_min, files_max;
+	double skew;
+	bool leaves_only;  /* files only in the deepest directories */
+	int names_min, names_max;
+	double non_ascii;
+	double empty;
+	double sparse;
+	uint32_t size_min, size_max;
+	uint32_t max_files;
+	const char *dir_format;  /* printf of the number, or NULL for random */
+	const char *prefix;  /* start of file names */
+	int digits;  /* file number after the prefix, 0 for none */
+	const char *alphabet;  /* for the random part of names */
+	const char *ext;
+};
+
+static struct profile profiles[] = {
+	{ "camera", 20, 1, 0, 0, 500, 999, 1.0, true, 8, 8, 0, 0, 1.0,
+		2 << 20, 8 << 20, 0, "%03dCANON", "IMG_", 4, "", ".JPG" },
+	{ "source", 12, 7, 0, 5, 0, 40, 2.0, false, 3, 24, 0.01, 0.05,
+		0.5, 32, 32 << 10, 200000, NULL, "", 0,
+		"abcdefghijklmnopqrstuvwxyz_", ".c" },
+	{ "music", 10000, 2, 1, 12, 8, 20, 1.0, true, 10, 60, 0.15, 0,
+		1.0, 3 << 20, 40 << 20, 1000000, NULL, "", 2,
+		"abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ",
+		".flac" },
+};
+
+/* Two and three byte characters, which are one UTF-16 unit each */
+static const char *wide_chars[] = {
+	"\xc3\xa9", "\xc3\xbc", "\xc3\xb8", "\xc3\xb1", "\xc3\x9f",
+	"\xd0\xaf", "\xd0\xbb", "\xe6\x97\xa5", "\xe6\x9c\xac", "\xe9\x9f\xb3",
+};
+
+static struct profile prof;
+static uint64_t seed = 1;
+static char data[65536];
+
+/* What was made */
+static uint32_t nr_dirs, nr_files, nr_empty, nr_sparse, nr_non_ascii;
+static uint64_t nr_bytes;
+
+/* Result: a random number in [0, 1) */
+static double rnd()
+{
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (seed >> 11) * (1.0 / (1ULL << 53));
+}
+
+static int rnd_range(int min, int max)
+{
+	return min + (int) (rnd() * (max - min + 1));
+}
+
+/* Write a name of 'len' characters from the profile's alphabet to
+ * 'buf', after 'buf' already has 'pos' bytes. The first and last
+ * character are never spaces, which FAT can't have there.
+ * Result: the new length in bytes. */
+static int random_name(char *buf, int pos, int len, bool non_ascii)
+{
+	int alen = strlen(prof.alphabet);
+	const char *wc;
+	char c;
+
+	for (int i = 0; i < len; i++) {
+		if (non_ascii && rnd() < 0.3) {
+			wc = wide_chars[rnd_range(0, sizeof(wide_chars)
+				/ sizeof(wide_chars[0]) - 1)];
+			memcpy(buf + pos, wc, strlen(wc));
+			pos += strlen(wc);
+			continue;
+		}
+		c = alen ? prof.alphabet[rnd_range(0, alen - 1)] : 'x';
+		if (c == ' ' && (i == 0 || i == len - 1))
+			c = 'x';
+		buf[pos++] = c;
+	}
+	buf[pos] = 0;
+	return pos;
+}
+
+static uint32_t file_size()
+{
+	double lo = log2(prof.size_min ? prof.size_min : 1);
+	double hi = log2(prof.size_max ? prof.size_max : 1);
+
+	return (uint32_t) exp2(lo + rnd() * (hi - lo));
+}
+
+static void make_file(const char *dir, int number)
+{
+	char path[4096];
+	int len = snprintf(path, sizeof(path), "%s/%s", dir, prof.prefix);
+	int chars = rnd_range(prof.names_min, prof.names_max);
+	bool non_ascii = rnd() < prof.non_ascii;
+	uint32_t size, n;
+	int fd;
+
+	if (prof.digits) {
+		len += snprintf(path + len, sizeof(path) - len, "%0*d",
+			prof.digits, number);
+		chars -= strlen(prof.prefix) + prof.digits;
+	}
+	len = random_name(path, len, chars > 0 ? chars : 0, non_ascii);
+	snprintf(path + len, sizeof(path) - len, "%s", prof.ext);
+
+	/* random names can come out the same */
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (fd < 0 && errno == EEXIST)
+		return;
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+
+	size = rnd() < prof.empty ? 0 : file_size();
+	if (size == 0) {
+		nr_empty++;
+	} else if (rnd() < prof.sparse) {
+		if (ftruncate(fd, size) < 0) {
+			perror(path);
+			exit(1);
+		}
+		nr_sparse++;
+	} else {
+		for (uint32_t done = 0; done < size; done += n) {
+			n = size - done < sizeof(data)
+				? size - done : sizeof(data);
+			if (write(fd, data, n) != (ssize_t) n) {
+				perror(path);
+				exit(1);
+			}
+		}
+	}
+	close(fd);
+	nr_files++;
+	nr_bytes += size;
+	if (non_ascii)
+		nr_non_ascii++;
+}
+
+static bool full()
+{
+	return prof.max_files && nr_files >= prof.max_files;
+}
+
+static void make_dir(const char *path, int level)
+{
+	char sub[4096];
+	int subdirs, files, len;
+	bool non_ascii;
+
+	if (level == 0)
+		subdirs = prof.top;
+	else if (level < prof.depth)
+		subdirs = rnd_range(prof.fanout_min, prof.fanout_max);
+	else
+		subdirs = 0;
+
+	if (!prof.leaves_only || level == prof.depth) {
+		files = prof.files_min + (int) ((prof.files_max
+			- prof.files_min + 1) * pow(rnd(), prof.skew));
+		for (int i = 0; i < files && !full(); i++)
+			make_file(path, i + 1);
+	}
+
+	for (int i = 0; i < subdirs && !full(); i++) {
+		len = snprintf(sub, sizeof(sub), "%s/", path);
+		if (prof.dir_format) {
+			snprintf(sub + len, sizeof(sub) - len,
+				prof.dir_format, 100 + i);
+		} else {
+			non_ascii = rnd() < prof.non_ascii;
+			random_name(sub, len, rnd_range(3, 16), non_ascii);
+		}
+		if (mkdir(sub, 0777) < 0) {
+			if (errno == EEXIST)
+				continue;
+			perror(sub);
+			exit(1);
+		}
+		nr_dirs++;
+		make_dir(sub, level + 1);
+	}
+}
+
+static bool parse_range(const char *val, int *min, int *max)
+{
+	return sscanf(val, "%d-%d", min, max) == 2
+		|| (sscanf(val, "%d", min) == 1 && (*max = *min, true));
+}
+
+static bool is_key(const char *arg, int len, const char *key)
+{
+	return len == (int) strlen(key) && !strncmp(arg, key, len);
+}
+
+static bool set_option(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	const char *val = eq + 1;
+	int len = eq - arg;
+	int lo, hi;
+
+	if (!eq)
+		return false;
+	if (is_key(arg, len, "top"))
+		prof.top = atoi(val);
+	else if (is_key(arg, len, "depth"))
+		prof.depth = atoi(val);
+	else if (is_key(arg, len, "fanout"))
+		return parse_range(val, &prof.fanout_min, &prof.fanout_max);
+	else if (is_key(arg, len, "files"))
+		return parse_range(val, &prof.files_min, &prof.files_max);
+	else if (is_key(arg, len, "skew"))
+		prof.skew = atof(val);
+	else if (is_key(arg, len, "names"))
+		return parse_range(val, &prof.names_min, &prof.names_max);
+	else if (is_key(arg, len, "non_ascii"))
+		prof.non_ascii = atof(val);
+	else if (is_key(arg, len, "empty"))
+		prof.empty = atof(val);
+	else if (is_key(arg, len, "sparse"))
+		prof.sparse = atof(val);
+	else if (is_key(arg, len, "sizes")) {
+		if (!parse_range(val, &lo, &hi))
+			return false;
+		prof.size_min = lo;
+		prof.size_max = hi;
+	} else if (is_key(arg, len, "max_files"))
+		prof.max_files = strtoul(val, NULL, 0);
+	else if (is_key(arg, len, "seed"))
+		seed = strtoull(val, NULL, 0);
+	else
+		return false;
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	struct statfs fs;
+	size_t i;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s PROFILE DIR [KEY=VALUE...]\n",
+			argv[0]);
+		return 2;
+	}
+	for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+		if (!strcmp(argv[1], profiles[i].name))
+			break;
+	}
+	if (i == sizeof(profiles) / sizeof(profiles[0])) {
+		fprintf(stderr, "Unknown profile %s; there are", argv[1]);
+		for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+			fprintf(stderr, " %s", profiles[i].name);
+		fprintf(stderr, "\n");
+		return 2;
+	}
+	prof = profiles[i];
+	for (int arg = 3; arg < argc; arg++) {
+		if (!set_option(argv[arg])) {
+			fprintf(stderr, "Bad setting %s\n", argv[arg]);
+			return 2;
+		}
+	}
+
+	if (mkdir(argv[2], 0777) < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	if (statfs(argv[2], &fs) == 0 && fs.f_type != TMPFS_MAGIC)
+		fprintf(stderr, "Warning: %s is not on tmpfs\n", argv[2]);
+	memset(data, 'x', sizeof(data));
+
+	make_dir(argv[2], 0);
+	printf("profile=%s dirs=%u files=%u empty=%u sparse=%u "
+		"non_ascii=%u bytes=%llu\n", prof.name, nr_dirs, nr_files,
+		nr_empty, nr_sparse, nr_non_ascii,
+		(unsigned long long) nr_bytes);
+	return 0;
+}
@@ -16,15 +16,32 @@
 #include "dir.h"
 
 #include <string.h>
+#include <endian.h>
 #include <errno.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && __BYTE_ORDER == __LITTLE_ENDIAN
+#include <arm_neon.h>
+#endif
 
 #include <algorithm>
+#include <set>
+
+#include "ConvertUTF.h"
 
 #include "vfat.h"
 #include "fat.h"
 
 #define DIR_ENTRY_SIZE 32
 #define CHARS_PER_DIR_ENTRY 13
+#define DELETED_ENTRY 0xe5  /* first byte of a deleted entry */
+
+/* Case flags for short entries, in the reserved byte at offset 12.
+ * Windows NT introduced these and other hosts honor them too. */
+#define SHORT_NAME_LOWER_BASE 0x08
+#define SHORT_NAME_LOWER_EXT  0x10
 
 /*
  * Information about allocated directories.
@@ -36,18 +53,42 @@ struct dir_info {
 	uint32_t starting_cluster; /* number of first cluster of this dir */
 	uint32_t allocated; /* number of allocated clusters */
 	std::vector<char> data;
-	const char *path; /* path in real filesystem */
+	int parent; /* dir index of parent, or -1 for the root */
+	uint32_t name_offset; /* name in real filesystem, in dir_names */
+	/* Hashes of the valid short names handed out in this directory.
+	 * A name whose hash is already in here gets the long name
+	 * treatment instead, which is always safe, so hash collisions
+	 * don't matter. */
+	std::set<uint64_t> short_names;
 };
 
 static std::vector<struct dir_info> dir_infos;
 
+/*
+ * The names of all the directories, as nul-terminated strings.
+ * Together with the parent indexes they make up the paths, which
+ * saves storing the leading directories again for every path.
+ * The root's name is the full path to the target directory.
+ */
+static std::vector<char> dir_names;
+
+/*
+ * Guards dir_infos and dir_names themselves, not the directories in
+ * them, for dir_path(). That is called by the prefetch thread, which
+ * doesn't hold the image lock that the callers of dir_init() and
+ * dir_alloc_new() do.
+ */
+static pthread_rwlock_t dirs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 static uint32_t unique_name_counter = 1;
 
+/* Where the name characters are in an LFN entry */
+static const int char_offsets[CHARS_PER_DIR_ENTRY] =
+	{ 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
 static void fill_filename_part(char *data, int seq_nr, bool is_last,
 	const filename_t &filename, uint8_t checksum)
 {
-	static const int char_offsets[CHARS_PER_DIR_ENTRY] =
-		{ 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
 	int i;
 	int fn_offset;
 	const uint16_t *fn_data;
@@ -114,6 +155,100 @@ static void prep_short_entry(uint8_t *entry)  /* at least 11-byte buffer */
 	entry[10] = 0;
 }
 
+/* Characters other than letters and digits that are valid in short names */
+static const char short_name_specials[] = "!#$%&'()-@^_`{}~";
+
+/*
+ * Check if the filename can be stored as a plain 8.3 short entry
+ * without any LFN entries. That's the case if it has a basename of
+ * 1 to 8 characters and an optional extension of 1 to 3 characters,
+ * uses only characters that are valid in short names, and each part
+ * is either all uppercase or all lowercase so that the case flags
+ * can express it. The "." and ".." names are also accepted.
+ * If it can, fill in the 11-byte shortname buffer and the case flags.
+ */
+static bool make_short_name(const filename_t &filename, uint8_t *entry,
+	uint8_t *case_flags)
+{
+	int len = filename.size() - 1;  /* leave out the terminator */
+	int part = 0;  /* 0 for the basename, 1 for the extension */
+	int part_len = 0;
+	bool seen_upper[2] = { false, false };
+	bool seen_lower[2] = { false, false };
+	int i;
+
+	memset(entry, ' ', 11);
+	*case_flags = 0;
+
+	if (len == 1 && filename[0] == '.') {
+		entry[0] = '.';
+		return true;
+	}
+	if (len == 2 && filename[0] == '.' && filename[1] == '.') {
+		entry[0] = '.';
+		entry[1] = '.';
+		return true;
+	}
+
+	for (i = 0; i < len; i++) {
+		uint16_t c = filename[i];
+		if (c == '.') {
+			if (part == 1 || part_len == 0)
+				return false;
+			part = 1;
+			part_len = 0;
+			continue;
+		}
+		if (part_len == (part ? 3 : 8))
+			return false;
+		if (c >= 'a' && c <= 'z') {
+			seen_lower[part] = true;
+			c -= 'a' - 'A';
+		} else if (c >= 'A' && c <= 'Z') {
+			seen_upper[part] = true;
+		} else if (!(c >= '0' && c <= '9')
+			   && (c == 0 || c > 0x7f
+			       || !strchr(short_name_specials, c))) {
+			return false;
+		}
+		entry[part * 8 + part_len++] = c;
+	}
+
+	/* catches both an empty name and a trailing dot */
+	if (part_len == 0)
+		return false;
+
+	for (part = 0; part < 2; part++) {
+		if (seen_upper[part] && seen_lower[part])
+			return false;
+	}
+	if (seen_lower[0])
+		*case_flags |= SHORT_NAME_LOWER_BASE;
+	if (seen_lower[1])
+		*case_flags |= SHORT_NAME_LOWER_EXT;
+	return true;
+}
+
+static uint64_t short_name_hash(const uint8_t *entry)
+{
+	uint64_t hash = 14695981039346656037ULL;  /* FNV-1a */
+
+	for (int i = 0; i < 11; i++) {
+		hash ^= entry[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/*
+ * Record that a valid short name is used in the given directory.
+ * Return false if it (or something with the same hash) already was.
+ */
+static bool claim_short_name(struct dir_info *di, const uint8_t *entry)
+{
+	return di->short_names.insert(short_name_hash(entry)).second;
+}
+
 static void encode_datetime(uint8_t *buf, time_t stamp)  /* 4-byte buffer */
 {
 	struct tm *t = localtime(&stamp);
@@ -144,24 +279,120 @@ static void encode_date(uint8_t *buf, time_t stamp)  /* 2-byte buffer */
 	buf[1] = (date_part >> 8) & 0xff;
 }
 
-void dir_init()
+/*
+ * Widen the leading ASCII bytes of 'in' to UTF-16LE in 'out'.
+ * Most names are all ASCII, and this does them 16 or 8 bytes at
+ * a time instead of one code point at a time: with SSE2 or NEON, or
+ * else by spreading the bytes of a 64-bit word with shifts and masks.
+ * Result: the number of bytes that were ASCII.
+ */
+static int widen_ascii(const uint8_t *in, int len, uint16_t *out)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (in + i));
+		if (_mm_movemask_epi8(v))
+			break;  /* a byte has its top bit set */
+		/* x86 is little-endian, so this is UTF-16LE */
+		_mm_storeu_si128((__m128i *) (out + i),
+			_mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128((__m128i *) (out + i + 8),
+			_mm_unpackhi_epi8(v, zero));
+	}
+#elif defined(__ARM_NEON) && __BYTE_ORDER == __LITTLE_ENDIAN
+	uint8x8_t v;
+
+	for (; i + 8 <= len; i += 8) {
+		v = vld1_u8(in + i);
+		if (vget_lane_u64(vreinterpret_u64_u8(v), 0)
+				& 0x8080808080808080ULL)
+			break;
+		vst1q_u16(out + i, vmovl_u8(v));
+	}
+#else
+	uint64_t word, lo, hi;
+
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&word, in + i, 8);
+		if (word & 0x8080808080808080ULL)
+			break;
+		/* byte n of each half goes to 16-bit lane n */
+		word = le64toh(word);
+		lo = word & 0xffffffff;
+		hi = word >> 32;
+		lo = (lo | lo << 16) & 0x0000ffff0000ffffULL;
+		lo = (lo | lo << 8) & 0x00ff00ff00ff00ffULL;
+		hi = (hi | hi << 16) & 0x0000ffff0000ffffULL;
+		hi = (hi | hi << 8) & 0x00ff00ff00ff00ffULL;
+		lo = htole64(lo);
+		hi = htole64(hi);
+		memcpy(out + i, &lo, 8);
+		memcpy(out + i + 4, &hi, 8);
+	}
+#endif
+	for (; i < len && in[i] < 0x80; i++)
+		out[i] = htole16(in[i]);
+	return i;
+}
+
+int dir_convert_name(const char *name8, int namelen, filename_t &name16)
+{
+	ConversionResult result;
+	const uint8_t *inp = (const uint8_t *) name8;
+	uint16_t *bufp;
+	int ascii;
+
+	/* VFAT filenames have to be in UTF-16. Linux filenames
+	 * aren't in any particular encoding, but nearly all
+	 * systems use UTF-8 these days. */
+
+	/* The worst case is that name8 is pure ASCII so each byte
+	 * expands to one 16-bit element, so make enough space for that
+	 * plus a terminating NUL */
+	name16.resize(namelen + 1);
+	bufp = &name16[0];
+
+	ascii = widen_ascii(inp, namelen, bufp);
+	if (ascii == namelen) {
+		bufp[namelen] = 0;
+		return 0;
+	}
+
+	/* The rest goes through the full converter */
+	inp += ascii;
+	bufp += ascii;
+	result = ConvertUTF8toUTF16LE(&inp, (const uint8_t *) name8 + namelen,
+		&bufp, &name16[0] + namelen, strictConversion);
+	if (result != conversionOK)
+		return -1;
+
+	/* The conversion routine will have set bufp to point just
+	 * past the end of the converted data. Anything past that
+	 * will be junk, so shrink the name to leave that out. */
+	*bufp++ = 0;
+	name16.resize(bufp - &name16[0]);
+	return 0;
+}
+
+void dir_init(const char *root_path)
 {
 	unique_name_counter = 1;
+	pthread_rwlock_wrlock(&dirs_lock);
 	dir_infos.clear();
-	dir_alloc_new("."); /* create empty root directory */
+	dir_names.clear();
+	pthread_rwlock_unlock(&dirs_lock);
+	dir_alloc_new(-1, root_path); /* create empty root directory */
 }
 
 bool dir_add_entry(uint32_t parent_clust, uint32_t entry_clust,
 	const filename_t &filename, uint32_t file_size, uint8_t attrs,
 	time_t mtime, time_t atime)
 {
-	struct dir_info *parent;
-	int num_entries;
-	uint32_t clusters_needed;
-	int seq_nr;
-	int data_offset;
-	uint8_t checksum;
-	uint8_t short_entry[DIR_ENTRY_SIZE];
 	int dir_index;
 
 	/* special case for the root directory, which is found in cluster 2
@@ -171,20 +402,50 @@ bool dir_add_entry(uint32_t parent_clust, uint32_t entry_clust,
 	if (parent_clust == 0)
 		parent_clust = ROOT_DIR_CLUSTER;
 
+	dir_index = fat_dir_index(parent_clust);
+	if (dir_index < 0)
+		return false;
+
+	return dir_add_entry_at(dir_index, entry_clust, filename, file_size,
+		attrs, mtime, atime);
+}
+
+bool dir_add_entry_at(int dir_index, uint32_t entry_clust,
+	const filename_t &filename, uint32_t file_size, uint8_t attrs,
+	time_t mtime, time_t atime)
+{
+	struct dir_info *parent;
+	int num_entries;
+	uint32_t clusters_needed;
+	int seq_nr;
+	int data_offset;
+	uint8_t checksum;
+	uint8_t short_entry[DIR_ENTRY_SIZE];
+	uint8_t case_flags;
+
         /* filesystem spec limitation: 255 characters plus terminator */
         if (filename.size() > 256)
 		return false;
 
-	dir_index = fat_dir_index(parent_clust);
-	if (dir_index < 0)
+	if (dir_index < 0 || dir_index >= (int) dir_infos.size())
 		return false;
 
 	parent = &dir_infos[dir_index];
 
+	/* Names that fit in 8.3 only need the short entry. Everything
+	 * else gets LFN entries plus a deliberately invalid short name. */
+	if (make_short_name(filename, short_entry, &case_flags)
+	    && claim_short_name(parent, short_entry)) {
+		num_entries = 1;
+	} else {
+		prep_short_entry(short_entry);
+		case_flags = 0;
+		/* add one entry for the shortname */
+		num_entries = 1 + (filename.size() + CHARS_PER_DIR_ENTRY - 1)
+					/ CHARS_PER_DIR_ENTRY;
+	}
+
 	/* Check if the result will fit in the allocated space */
-	/* add one entry for the shortname */
-	num_entries = 1 + (filename.size() + CHARS_PER_DIR_ENTRY - 1)
-				/ CHARS_PER_DIR_ENTRY;
 	clusters_needed = ALIGN(parent->data.size()
 		+ num_entries * DIR_ENTRY_SIZE, CLUSTER_SIZE) / CLUSTER_SIZE;
 	if (clusters_needed > parent->allocated) {
@@ -196,12 +457,11 @@ bool dir_add_entry(uint32_t parent_clust, uint32_t entry_clust,
 		}
 	}
 
-	prep_short_entry(short_entry);
 	attrs |= FAT_ATTR_READ_ONLY;  /* always read-only */
 	if (attrs & FAT_ATTR_DIRECTORY)
 		file_size = 0;
 	short_entry[11] = attrs;
-	short_entry[12] = 0;
+	short_entry[12] = case_flags;
 	/* Slightly higher resolution creation time.
 	 * The normal time format only encodes down to 2-second precision. */
 	short_entry[13] = (mtime & 1) * 100;
@@ -234,17 +494,222 @@ bool dir_add_entry(uint32_t parent_clust, uint32_t entry_clust,
 	return true;
 }
 
-uint32_t dir_alloc_new(const char *path)
+int dir_alloc_new(int parent_index, const char *name)
 {
 	struct dir_info new_dir;
 
 	new_dir.starting_cluster = fat_alloc_dir(dir_infos.size());
+	if (!new_dir.starting_cluster)
+		return -1;
 	new_dir.allocated = 1;
-	new_dir.path = strdup(path);
-
+	new_dir.parent = parent_index;
+	pthread_rwlock_wrlock(&dirs_lock);
+	new_dir.name_offset = dir_names.size();
+	dir_names.insert(dir_names.end(), name, name + strlen(name) + 1);
 	dir_infos.push_back(new_dir);
+	pthread_rwlock_unlock(&dirs_lock);
+
+	return dir_infos.size() - 1;
+}
 
-	return new_dir.starting_cluster;
+bool dir_reserve(int dir_index, uint32_t bytes)
+{
+	struct dir_info *di = &dir_infos[dir_index];
+	uint32_t clusters_needed = ALIGN(bytes, CLUSTER_SIZE) / CLUSTER_SIZE;
+
+	if (clusters_needed <= di->allocated)
+		return true;
+	if (!fat_extend(di->starting_cluster,
+			clusters_needed - di->allocated))
+		return false;
+	di->allocated = clusters_needed;
+	return true;
+}
+
+/* Return true if the LFN entry 'data' holds its part of 'filename' */
+static bool filename_part_matches(const uint8_t *data,
+	const filename_t &filename)
+{
+	int fn_offset = ((data[0] & 0x1f) - 1) * CHARS_PER_DIR_ENTRY;
+	uint16_t expected;
+	int i;
+
+	for (i = 0; i < CHARS_PER_DIR_ENTRY; i++, fn_offset++) {
+		if (fn_offset < (int) filename.size())
+			expected = filename[fn_offset];
+		else
+			expected = 0xffff;
+		if (data[char_offsets[i]] != (expected & 0xff)
+				|| data[char_offsets[i] + 1] != expected >> 8)
+			return false;
+	}
+	return true;
+}
+
+int dir_find_entry(int dir_index, const filename_t &filename,
+	uint8_t *attrs, uint32_t *entry_clust, uint32_t *file_size)
+{
+	const std::vector<char> &data = dir_infos[dir_index].data;
+	const uint8_t *entry;
+	uint8_t short_name[11];
+	uint8_t case_flags;
+	bool can_be_short = make_short_name(filename, short_name, &case_flags);
+	bool lfn_matches = false;
+	int first = -1;  /* first LFN entry of the current name */
+	bool matches;
+
+	for (size_t pos = 0; pos + DIR_ENTRY_SIZE <= data.size();
+			pos += DIR_ENTRY_SIZE) {
+		entry = (const uint8_t *) &data[pos];
+		if (entry[0] == DELETED_ENTRY) {
+			first = -1;
+			continue;
+		}
+		if (entry[11] == FAT_ATTR_LFN) {
+			if (entry[0] & 0x40) {
+				first = pos;
+				lfn_matches = true;
+			}
+			lfn_matches = lfn_matches
+				&& filename_part_matches(entry, filename);
+			continue;
+		}
+
+		if (first >= 0)
+			matches = lfn_matches;
+		else
+			matches = can_be_short
+				&& !memcmp(entry, short_name, 11)
+				&& entry[12] == case_flags;
+		if (matches) {
+			*attrs = entry[11];
+			*entry_clust = entry[26] | entry[27] << 8
+				| entry[20] << 16 | entry[21] << 24;
+			*file_size = entry[28] | entry[29] << 8
+				| entry[30] << 16 | (uint32_t) entry[31] << 24;
+			return first >= 0 ? first : (int) pos;
+		}
+		first = -1;
+	}
+	return -1;
+}
+
+void dir_delete_entry(int dir_index, int offset)
+{
+	std::vector<char> &data = dir_infos[dir_index].data;
+	const uint8_t *entry = (const uint8_t *) &data[offset];
+	uint8_t attrs;
+
+	/* A short entry on its own has a valid name, which can be
+	 * handed out again */
+	if (entry[11] != FAT_ATTR_LFN)
+		dir_infos[dir_index].short_names.erase(short_name_hash(entry));
+
+	/* the LFN entries come first, then the short entry */
+	do {
+		attrs = data[offset + 11];
+		data[offset] = DELETED_ENTRY;
+		offset += DIR_ENTRY_SIZE;
+	} while (attrs == FAT_ATTR_LFN);
+}
+
+void dir_free_tree(int dir_index)
+{
+	std::vector<char> data;
+	const uint8_t *entry;
+	uint32_t clust;
+	int sub;
+
+	/* swapped out so that the memory goes too */
+	data.swap(dir_infos[dir_index].data);
+	std::set<uint64_t>().swap(dir_infos[dir_index].short_names);
+	for (size_t pos = 0; pos + DIR_ENTRY_SIZE <= data.size();
+			pos += DIR_ENTRY_SIZE) {
+		entry = (const uint8_t *) &data[pos];
+		/* short names can't start with a dot, only . and .. do */
+		if (entry[0] == DELETED_ENTRY || entry[0] == '.'
+				|| entry[11] == FAT_ATTR_LFN)
+			continue;
+		clust = entry[26] | entry[27] << 8
+			| entry[20] << 16 | entry[21] << 24;
+		if (!clust)
+			continue;
+		sub = (entry[11] & FAT_ATTR_DIRECTORY)
+			? fat_dir_index(clust) : -1;
+		if (sub > 0)
+			dir_free_tree(sub);
+		else
+			fat_free(clust);
+	}
+	fat_free(dir_infos[dir_index].starting_cluster);
+	dir_infos[dir_index].starting_cluster = 0;
+	dir_infos[dir_index].allocated = 0;
+}
+
+int dir_count()
+{
+	return dir_infos.size();
+}
+
+uint32_t dir_entries_size(const filename_t &filename)
+{
+	/* one entry for the short name, plus the long name parts */
+	return (1 + (filename.size() + CHARS_PER_DIR_ENTRY - 1)
+		/ CHARS_PER_DIR_ENTRY) * DIR_ENTRY_SIZE;
+}
+
+uint32_t dir_size(int dir_index)
+{
+	return dir_infos[dir_index].data.size();
+}
+
+uint32_t dir_cluster(int dir_index)
+{
+	return dir_infos[dir_index].starting_cluster;
+}
+
+static int build_path(int dir_index, char *buf, int size)
+{
+	const struct dir_info *di = &dir_infos[dir_index];
+	const char *name = &dir_names[di->name_offset];
+	int namelen = strlen(name);
+	int len = 0;
+
+	if (di->parent >= 0) {
+		len = build_path(di->parent, buf, size);
+		if (len < 0 || len + 1 >= size)
+			return -1;
+		buf[len++] = '/';
+	}
+	if (len + namelen >= size)
+		return -1;
+	memcpy(buf + len, name, namelen + 1);
+	return len + namelen;
+}
+
+int dir_path(int dir_index, char *buf, int size)
+{
+	int len = -1;
+
+	pthread_rwlock_rdlock(&dirs_lock);
+	/* an index from before a rescan may be gone */
+	if (dir_index >= 0 && dir_index < (int) dir_infos.size())
+		len = build_path(dir_index, buf, size);
+	pthread_rwlock_unlock(&dirs_lock);
+	return len;
+}
+
+size_t dir_mem_usage()
+{
+	size_t total = dir_infos.capacity() * sizeof(struct dir_info);
+	for (size_t i = 0; i < dir_infos.size(); i++) {
+		total += dir_infos[i].data.capacity();
+		/* rough estimate of the tree node size */
+		total += dir_infos[i].short_names.size()
+			* (sizeof(uint64_t) + 32);
+	}
+	total += dir_names.capacity();
+	return total;
 }
 
 int dir_fill(char *buf, uint32_t len, int dir_index, uint32_t offset)
@@ -40,8 +40,9 @@
  * with a terminating 0 value which is included. */
 typedef std::vector<uint16_t> filename_t;
 
-/* Call this after fat_init() to create the root directory */
-void dir_init();
+/* Call this after fat_init() to create the root directory.
+ * 'root_path' is where the root is found in the real filesystem. */
+void dir_init(const char *root_path);
 
 /* Extend the dir at parent_clust to include the new entry described
  * by the other parameters. Return true for success. */
@@ -49,8 +50,63 @@ bool dir_add_entry(uint32_t parent_clust, uint32_t entry_clust,
 	const filename_t &filename, uint32_t file_size, uint8_t attrs,
 	time_t mtime, time_t atime);
 
-/* Register a new directory and return its starting cluster number */
-uint32_t dir_alloc_new(const char *path);
+/* Same as dir_add_entry, but the parent is given by its dir index.
+ * This saves looking up the cluster in the FAT, which adds up
+ * when scanning large trees. */
+bool dir_add_entry_at(int dir_index, uint32_t entry_clust,
+	const filename_t &filename, uint32_t file_size, uint8_t attrs,
+	time_t mtime, time_t atime);
+
+/* Register a new directory called 'name' inside the directory with
+ * index 'parent_index', and return the new dir index, or -1 if there
+ * is no room left for it in a live update.
+ * The root directory always has index 0. */
+int dir_alloc_new(int parent_index, const char *name);
+
+/* Make sure the dir with this index has clusters for 'bytes' bytes
+ * of entries, so that adding entries up to that size won't have to
+ * extend it. Return true for success. */
+bool dir_reserve(int dir_index, uint32_t bytes);
+
+/* Convert the UTF-8 name 'name8' of 'namelen' bytes to a filename
+ * in 'name16'. Result: 0 for success, or -1 if it isn't valid UTF-8. */
+int dir_convert_name(const char *name8, int namelen, filename_t &name16);
+
+/* Return the most bytes that an entry called 'filename' can take */
+uint32_t dir_entries_size(const filename_t &filename);
+
+/* Return the number of bytes of entries in the dir with this index */
+uint32_t dir_size(int dir_index);
+
+/* Look for the entry called 'filename' in the dir with this index.
+ * If it's there, fill in its attributes, cluster and size and return
+ * its offset, which can be passed to dir_delete_entry(). Otherwise
+ * return -1. */
+int dir_find_entry(int dir_index, const filename_t &filename,
+	uint8_t *attrs, uint32_t *entry_clust, uint32_t *file_size);
+
+/* Mark the entry at 'offset' in the dir with this index as deleted */
+void dir_delete_entry(int dir_index, int offset);
+
+/* Free the clusters of the dir with this index and of everything
+ * under it, for a directory that was removed from its parent. The dir
+ * keeps its index, with cluster 0. */
+void dir_free_tree(int dir_index);
+
+/* Return the number of dirs. Their indexes go from 0 to this - 1. */
+int dir_count();
+
+/* Return the starting cluster number of the dir with this index */
+uint32_t dir_cluster(int dir_index);
+
+/* Write the path of the dir with this index in the real filesystem
+ * to 'buf', which has room for 'size' bytes.
+ * Result: the length of the path, or -1 if it doesn't fit or there is
+ * no such directory (any more). */
+int dir_path(int dir_index, char *buf, int size);
+
+/* Return the number of bytes used for directory bookkeeping */
+size_t dir_mem_usage();
 
 /* Fill all or part of 'buf' with data from the directory, starting from
  * byte 'offset'. The function will fill the whole length, with 0-padding
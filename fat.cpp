@@ -23,6 +23,7 @@
 #include "vfat.h"
 #include "dir.h"
 #include "filemap.h"
+#include "stats.h"
 
 /*
  * A fat_extent is a contiguous section of the FAT where the values
@@ -69,6 +70,32 @@ static std::vector<struct fat_extent> extents_from_end;
 
 static uint32_t g_data_clusters;
 
+/* Set by fat_close_dirs() until fat_finalize() */
+static bool dirs_closed;
+static bool finalized;
+/* The free space that fat_close_dirs() set aside at the start of
+ * the gap, as the last of 'extents'. 0 if none. */
+static uint32_t reserved_free;
+
+/* Unallocated clusters after fat_close_dirs() or fat_finalize(),
+ * or FAT_FREE_UNKNOWN before */
+static uint32_t free_clusters;
+
+/*
+ * After finalization: the space that was left between the directories
+ * and the filemaps. Its first gap_free clusters are unallocated and the
+ * rest is marked bad. Clusters allocated after finalization are taken
+ * from either end of it. It's empty when gap_first > gap_last.
+ */
+static uint32_t gap_first;
+static uint32_t gap_last;
+static uint32_t gap_free;
+
+/* FAT entries per sector. The host reads the FAT a sector at a time,
+ * so that's the unit in which entries become final after
+ * fat_close_dirs(). */
+#define ENTRIES_PER_SECTOR (SECTOR_SIZE / 4)
+
 void fat_init(uint32_t data_clusters)
 {
 	g_data_clusters = data_clusters;
@@ -76,6 +103,10 @@ void fat_init(uint32_t data_clusters)
 	extents.push_back(entry_0);
 	extents.push_back(entry_1);
 	extents_from_end.clear();
+	dirs_closed = false;
+	finalized = false;
+	reserved_free = 0;
+	free_clusters = FAT_FREE_UNKNOWN;
 }
 
 /* This function is only valid during construction stage */
@@ -114,25 +145,138 @@ static int find_extent(uint32_t cluster_nr)
 	return -1; /* not found */
 }
 
-int fat_dir_index(uint32_t cluster_nr)
+static bool extent_after(const struct fat_extent &fe, uint32_t cluster_nr)
 {
-	struct fat_extent *fe;
+	return fe.starting_cluster > cluster_nr;
+}
+
+static bool starts_after(uint32_t cluster_nr, const struct fat_extent &fe)
+{
+	return cluster_nr < fe.starting_cluster;
+}
+
+/* Return the extent containing the given cluster number, or NULL.
+ * Unlike find_extent() this also looks at the filemaps that are
+ * still in extents_from_end. */
+static struct fat_extent *get_extent(uint32_t cluster_nr)
+{
+	std::vector<struct fat_extent>::iterator it;
 	int extent_nr = find_extent(cluster_nr);
 
-	if (extent_nr < 0)
+	if (extent_nr >= 0)
+		return &extents[extent_nr];
+	if (finalized)
+		return NULL;
+
+	/* extents_from_end is sorted from high to low */
+	it = std::lower_bound(extents_from_end.begin(), extents_from_end.end(),
+		cluster_nr, extent_after);
+	if (it == extents_from_end.end() || it->ending_cluster < cluster_nr)
+		return NULL;
+	return &*it;
+}
+
+int fat_dir_index(uint32_t cluster_nr)
+{
+	struct fat_extent *fe = get_extent(cluster_nr);
+
+	if (!fe || fe->extent_type != EXTENT_DIR)
 		return -1;
 
-	fe = &extents[extent_nr];
-	if (fe->extent_type != EXTENT_DIR)
+	return fe->index;
+}
+
+int fat_filemap_index(uint32_t cluster_nr)
+{
+	struct fat_extent *fe = get_extent(cluster_nr);
+
+	if (!fe || fe->extent_type != EXTENT_FILEMAP)
 		return -1;
 
 	return fe->index;
 }
 
+/* Append the extents that make up the gap to 'out' */
+static void gap_extents(std::vector<struct fat_extent> &out)
+{
+	struct fat_extent fe;
+
+	fe.starting_cluster = gap_first;
+	fe.ending_cluster = gap_first + gap_free - 1;
+	fe.index = FAT_UNALLOCATED;
+	fe.offset = 0;
+	fe.next = fe.index;
+	fe.extent_type = EXTENT_LITERAL;
+	if (gap_free)
+		out.push_back(fe);
+
+	fe.starting_cluster = gap_first + gap_free;
+	fe.ending_cluster = gap_last;
+	fe.index = FAT_BAD_CLUSTER;
+	fe.next = fe.index;
+	if (fe.ending_cluster >= fe.starting_cluster)
+		out.push_back(fe);
+}
+
+/*
+ * After finalization: take 'clusters' clusters from the start or the
+ * end of the gap and give them to a new extent like 'fe'. The free part
+ * of the gap only shrinks once the bad part is used up, so the host
+ * doesn't see free space disappear.
+ * Result: the new extent's starting cluster, or 0 if there's no room.
+ */
+static uint32_t alloc_from_gap(uint32_t clusters, bool from_end,
+	struct fat_extent fe)
+{
+	std::vector<struct fat_extent> fes;
+	std::vector<struct fat_extent>::iterator l, h;
+	uint32_t first = gap_first;
+	uint32_t last = gap_last;
+
+	if (clusters == 0 || gap_first > gap_last
+			|| gap_last - gap_first + 1 < clusters)
+		return 0;
+
+	if (from_end) {
+		fe.starting_cluster = gap_last - clusters + 1;
+		gap_last -= clusters;
+	} else {
+		fe.starting_cluster = gap_first;
+		gap_first += clusters;
+	}
+	fe.ending_cluster = fe.starting_cluster + clusters - 1;
+	free_clusters -= gap_free;
+	gap_free = std::min(gap_free, gap_last + 1 - gap_first);
+	free_clusters += gap_free;
+
+	if (!from_end)
+		fes.push_back(fe);
+	gap_extents(fes);
+	if (from_end)
+		fes.push_back(fe);
+
+	/* replace the old gap extents */
+	l = std::upper_bound(extents.begin(), extents.end(), first - 1,
+		starts_after);
+	for (h = l; h != extents.end() && h->starting_cluster <= last; ++h)
+		;
+	l = extents.erase(l, h);
+	extents.insert(l, fes.begin(), fes.end());
+	return fe.starting_cluster;
+}
+
 uint32_t fat_alloc_dir(int dir_nr)
 {
 	struct fat_extent new_extent;
 
+	if (finalized) {
+		new_extent.index = dir_nr;
+		new_extent.offset = 0;
+		new_extent.next = FAT_END_OF_CHAIN;
+		new_extent.extent_type = EXTENT_DIR;
+		return alloc_from_gap(1, false, new_extent);
+	}
+
 	new_extent.starting_cluster = first_free_cluster();
 	new_extent.ending_cluster = new_extent.starting_cluster;
 	new_extent.index = dir_nr;
@@ -149,6 +293,20 @@ uint32_t fat_alloc_filemap(int filemap_nr, uint32_t clusters)
 {
 	struct fat_extent new_extent;
 
+	if (finalized) {
+		new_extent.index = filemap_nr;
+		new_extent.offset = 0;
+		new_extent.next = FAT_END_OF_CHAIN;
+		new_extent.extent_type = EXTENT_FILEMAP;
+		return alloc_from_gap(clusters, true, new_extent);
+	}
+
+	/* it mustn't take the free space set aside by fat_close_dirs() */
+	if (dirs_closed && (last_free_cluster() < first_free_cluster()
+			|| last_free_cluster() - first_free_cluster() + 1
+				< clusters))
+		return 0;
+
 	new_extent.ending_cluster = last_free_cluster();
 	new_extent.starting_cluster = new_extent.ending_cluster - clusters + 1;
 	new_extent.index = filemap_nr;
@@ -166,6 +324,9 @@ bool fat_extend(uint32_t cluster_nr, uint32_t clusters)
 	struct fat_extent *fe;
 	int extent_nr = find_extent(cluster_nr);
 
+	if (dirs_closed && !finalized)
+		return false;
+
 	/* Search for last extent of this file or dir */
 	while (extent_nr >= 0 && extents[extent_nr].next != FAT_END_OF_CHAIN) {
 		/* EXTENT_LITERAL extents are not chained */
@@ -177,6 +338,25 @@ bool fat_extend(uint32_t cluster_nr, uint32_t clusters)
 	if (extent_nr < 0)
 		return false;
 
+	if (finalized) {
+		fe = &extents[extent_nr];
+		new_extent.index = fe->index;
+		new_extent.offset = fe->offset +
+			(fe->ending_cluster - fe->starting_cluster + 1)
+			* CLUSTER_SIZE;
+		new_extent.next = FAT_END_OF_CHAIN;
+		new_extent.extent_type = fe->extent_type;
+		cluster_nr = fe->starting_cluster;
+		new_extent.starting_cluster = alloc_from_gap(clusters, false,
+			new_extent);
+		if (!new_extent.starting_cluster)
+			return false;
+		/* the extents moved around */
+		extents[find_extent(cluster_nr)].next =
+			new_extent.starting_cluster;
+		return true;
+	}
+
 	if (extent_nr == (int) extents.size() - 1) {
 		/* yay, shortcut: just extend this extent */
 		extents[extent_nr].ending_cluster += clusters;
@@ -198,11 +378,88 @@ bool fat_extend(uint32_t cluster_nr, uint32_t clusters)
 	return true;
 }
 
-void fat_finalize(uint32_t max_free_clusters)
+void fat_free(uint32_t cluster_nr)
 {
-	struct fat_extent fe_free;
-	struct fat_extent fe_bad;
+	struct fat_extent *fe;
+	uint32_t next;
+	int extent_nr = finalized ? find_extent(cluster_nr) : -1;
+
+	while (extent_nr >= 0
+			&& extents[extent_nr].extent_type != EXTENT_LITERAL) {
+		fe = &extents[extent_nr];
+		next = fe->next;
+		free_clusters += fe->ending_cluster - fe->starting_cluster + 1;
+		fe->index = FAT_UNALLOCATED;
+		fe->offset = 0;
+		fe->next = fe->index;
+		fe->extent_type = EXTENT_LITERAL;
+		if (next == FAT_END_OF_CHAIN)
+			break;
+		extent_nr = find_extent(next);
+	}
+}
+
+/* Mark the clusters 'first' to 'last' as bad, so that their
+ * FAT entries never change */
+static struct fat_extent padding(uint32_t first, uint32_t last)
+{
+	struct fat_extent fe;
+
+	fe.starting_cluster = first;
+	fe.ending_cluster = last;
+	fe.index = FAT_BAD_CLUSTER;
+	fe.offset = 0;
+	fe.next = fe.index;
+	fe.extent_type = EXTENT_LITERAL;
+	return fe;
+}
 
+void fat_close_dirs(uint32_t max_free_clusters)
+{
+	uint32_t first = first_free_cluster();
+	uint32_t end = ALIGN(first, ENTRIES_PER_SECTOR);
+	struct fat_extent fe;
+
+	if (end > first && end - 1 <= last_free_cluster())
+		extents.push_back(padding(first, end - 1));
+	dirs_closed = true;
+	fat_pad_filemaps();
+
+	first = first_free_cluster();
+	if (first <= last_free_cluster())
+		reserved_free = std::min(max_free_clusters,
+			last_free_cluster() - first + 1);
+	if (reserved_free) {
+		fe.starting_cluster = first;
+		fe.ending_cluster = first + reserved_free - 1;
+		fe.index = FAT_UNALLOCATED;
+		fe.offset = 0;
+		fe.next = fe.index;
+		fe.extent_type = EXTENT_LITERAL;
+		extents.push_back(fe);
+	}
+	free_clusters = reserved_free;
+}
+
+void fat_pad_filemaps()
+{
+	uint32_t last = last_free_cluster();
+	uint32_t start = (last + 1) / ENTRIES_PER_SECTOR * ENTRIES_PER_SECTOR;
+
+	if (start <= last && start >= first_free_cluster())
+		extents_from_end.push_back(padding(start, last));
+}
+
+bool fat_pending(uint32_t entry_nr, uint32_t entries)
+{
+	if (!dirs_closed || finalized || entries == 0)
+		return false;
+	return entry_nr <= last_free_cluster()
+		&& entry_nr + entries - 1 >= first_free_cluster();
+}
+
+void fat_finalize(uint32_t max_free_clusters)
+{
 	/*
 	 * The unused space between the directories and the files is
 	 * divided into an unallocated part and a marked-unusable part.
@@ -210,33 +467,87 @@ void fat_finalize(uint32_t max_free_clusters)
 	 * host filesystem actually has.
 	 */
 
-	fe_free.starting_cluster = first_free_cluster();
-	fe_free.ending_cluster = std::min(last_free_cluster(),
-		first_free_cluster() + max_free_clusters - 1);
-	fe_free.index = FAT_UNALLOCATED;
-	fe_free.offset = 0;
-	fe_free.next = fe_free.index;
-	fe_free.extent_type = EXTENT_LITERAL;
-
-	if (fe_free.ending_cluster >= fe_free.starting_cluster)
-		extents.push_back(fe_free);
-
-	fe_bad.starting_cluster = fe_free.ending_cluster + 1;
-	fe_bad.ending_cluster = last_free_cluster();
-	fe_bad.index = FAT_BAD_CLUSTER;
-	fe_bad.offset = 0;
-	fe_bad.next = fe_bad.index;
-	fe_bad.extent_type = EXTENT_LITERAL;
-
-	if (fe_bad.ending_cluster >= fe_bad.starting_cluster)
-		extents.push_back(fe_bad);
+	/* the free space set aside by fat_close_dirs() is part of it */
+	if (reserved_free)
+		extents.pop_back();
+	gap_first = first_free_cluster();
+	gap_last = last_free_cluster();
+	gap_free = std::min(max_free_clusters, gap_last + 1 - gap_first);
+	gap_extents(extents);
+	free_clusters = gap_free;
+	reserved_free = 0;
 
 	int pos = extents.size();
 	extents.resize(pos + extents_from_end.size());
 	for (int i = (int) extents_from_end.size() - 1; i >= 0; i--, pos++)
 		extents[pos] = extents_from_end[i];
 
-	extents_from_end.clear();
+	/* clear() would keep the memory allocated */
+	std::vector<struct fat_extent>().swap(extents_from_end);
+	finalized = true;
+}
+
+uint32_t fat_free_clusters()
+{
+	return free_clusters;
+}
+
+size_t fat_mem_usage()
+{
+	return (extents.capacity() + extents_from_end.capacity())
+		* sizeof(struct fat_extent);
+}
+
+/* Write the FAT entries of one extent, from 'entry_nr' on.
+ * Result: the number of entries written. */
+static uint32_t fill_extent(uint32_t *buf, const struct fat_extent *fe,
+	uint32_t entry_nr, uint32_t entries)
+{
+	uint32_t i = 0;
+
+	if (fe->extent_type == EXTENT_LITERAL) {
+		while (entry_nr + i <= fe->ending_cluster && i < entries)
+			buf[i++] = htole32(fe->index);
+	} else {
+		while (entry_nr + i < fe->ending_cluster && i < entries) {
+			buf[i] = htole32(entry_nr + i + 1);
+			i++;
+		}
+		if (i < entries)
+			buf[i++] = htole32(fe->next);
+	}
+	return i;
+}
+
+/*
+ * fat_fill() for when the image is served before fat_finalize(), with
+ * the filemaps still in extents_from_end. The space between the dirs
+ * and the filemaps isn't decided yet, so it's filled with zeroes; the
+ * caller should check fat_pending() first.
+ */
+static void fill_unfinalized(uint32_t *buf, uint32_t entry_nr,
+	uint32_t entries)
+{
+	const struct fat_extent *fe;
+	uint32_t i = 0;
+	uint32_t n;
+
+	while (i < entries) {
+		fe = get_extent(entry_nr + i);
+		if (fe) {
+			i += fill_extent(buf + i, fe, entry_nr + i,
+				entries - i);
+		} else if (entry_nr + i > g_data_clusters
+				+ RESERVED_FAT_ENTRIES - 1) {
+			buf[i++] = htole32(FAT_BAD_CLUSTER);
+		} else {
+			/* skip to the filemaps */
+			n = std::min(entries - i,
+				last_free_cluster() + 1 - (entry_nr + i));
+			memset(buf + i, 0, n * 4);
+			i += n;
+		}
+	}
 }
 
 void fat_fill(void *vbuf, uint32_t entry_nr, uint32_t entries)
@@ -244,22 +555,15 @@ void fat_fill(void *vbuf, uint32_t entry_nr, uint32_t entries)
 	uint32_t *buf = (uint32_t *)vbuf;
 	uint32_t i = 0;
 
+	if (!finalized) {
+		fill_unfinalized(buf, entry_nr, entries);
+		return;
+	}
+
 	int extent_nr = find_extent(entry_nr);
 	while (extent_nr >= 0) {
 		struct fat_extent *fe = &extents[extent_nr];
-		if (fe->extent_type == EXTENT_LITERAL) {
-			while (entry_nr + i <= fe->ending_cluster
-			       && i < entries)
-				buf[i++] = htole32(fe->index);
-		} else {
-			while (entry_nr + i < fe->ending_cluster
-			       && i < entries) {
-				buf[i] = htole32(entry_nr + i + 1);
-				i++;
-			}
-			if (i < entries)
-				buf[i++] = htole32(fe->next);
-		}
+		i += fill_extent(buf + i, fe, entry_nr + i, entries - i);
 		if (i == entries)
 			return;
 		// This is a fast version of calling find_extent(entry_nr + i)
@@ -285,16 +589,26 @@ void fat_fill(void *vbuf, uint32_t entry_nr, uint32_t entries)
 int data_fill(char *buf, uint32_t len, uint32_t start_clust, uint32_t offset,
 	uint32_t *filled)
 {
-	int extent_nr = find_extent(start_clust);
-	struct fat_extent *fe;
+	struct fat_extent *fe = get_extent(start_clust);
+	uint64_t start = stats_region_start();
+	enum stats_region region = STATS_LITERAL;
 	uint32_t src_offset;
 	int ret = 0;
 
-	if (extent_nr < 0)
+	if (!fe && dirs_closed && !finalized
+			&& start_clust >= first_free_cluster()
+			&& start_clust <= last_free_cluster()) {
+		/* not given out yet; it's free space for now */
+		len = std::min(len, (last_free_cluster() - start_clust + 1)
+			* CLUSTER_SIZE - offset);
+		memset(buf, 0, len);
+		*filled = len;
+		stats_region_done(STATS_LITERAL, start, len);
+		return 0;
+	}
+	if (!fe)
 		return EINVAL;
 
-	fe = &extents[extent_nr];
-
 	// Clip len if the current extent does not go that far
 	uint32_t end_clust = start_clust + (offset + len - 1) / CLUSTER_SIZE;
 	if (end_clust > fe->ending_cluster)
@@ -310,13 +624,31 @@ int data_fill(char *buf, uint32_t len, uint32_t start_clust, uint32_t offset,
 			memset(buf, 0, len);
 			break;
 		case EXTENT_DIR:
+			region = STATS_DIR;
 			ret = dir_fill(buf, len, fe->index, src_offset);
+			if (!ret)
+				filemap_prefetch_dir(buf, len);
 			break;
 		case EXTENT_FILEMAP:
+			region = STATS_FILEMAP;
 			ret = filemap_fill(buf, len, fe->index, src_offset);
 			break;
 	}
 
+	/* a read that would block is counted when a worker retries it */
+	if (ret != EAGAIN)
+		stats_region_done(region, start, len);
 	*filled = len;
 	return ret;
 }
+
+int data_region(uint32_t clust)
+{
+	struct fat_extent *fe = get_extent(clust);
+
+	if (fe && fe->extent_type == EXTENT_DIR)
+		return STATS_DIR;
+	if (fe && fe->extent_type == EXTENT_FILEMAP)
+		return STATS_FILEMAP;
+	return STATS_LITERAL;
+}
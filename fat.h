@@ -13,6 +13,7 @@
  * GNU General Public License for more details.
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <vector>
@@ -40,6 +41,8 @@
 #define FAT_END_OF_CHAIN 0x0fffffff
 #define FAT_BAD_CLUSTER  0x0ffffff7
 #define FAT_UNALLOCATED  0
+/* The FSInfo sector's value for an unknown free cluster count */
+#define FAT_FREE_UNKNOWN 0xffffffff
 
 /*
  * The FAT interface has two stages. In the first stage, the target
@@ -51,7 +54,10 @@
 void fat_init(uint32_t data_clusters);
 
 /*
- * These are valid in the construction phase
+ * These are valid in the construction phase, and also after
+ * finalization for live updates. Then the clusters come out of the
+ * space between the directories and the filemaps, and 0 or false
+ * means there was no room left.
  */
 
 /* Reserve a cluster for a new directory and return its number. */
@@ -64,20 +70,58 @@ uint32_t fat_alloc_filemap(int filemap_nr, uint32_t clusters);
  * Return true for success */
 bool fat_extend(uint32_t cluster_nr, uint32_t clusters);
 
+/* After finalization: mark the FAT chain starting at 'cluster_nr'
+ * as unallocated, for a file or directory that was removed. */
+void fat_free(uint32_t cluster_nr);
+
 /* Return the dir number of a directory at this data cluster,
  * or -1 if there is no directory there */
 int fat_dir_index(uint32_t cluster_nr);
 
+/* Return the filemap number of a mapped file at this data cluster,
+ * or -1 if there is no mapped file there */
+int fat_filemap_index(uint32_t cluster_nr);
+
 /* Transition from construction stage to full service. */
 void fat_finalize(uint32_t max_free_clusters);
 
 /*
- * These are valid after construction is finalized
+ * These are for serving the image before it's finalized, while
+ * filemaps are still being added. After fat_close_dirs() no more
+ * directories can be allocated or extended, and the FAT can be read.
+ * Every FAT sector is then either final or pending: the space between
+ * the directories and the filemaps is pending, and the clusters that
+ * share FAT sectors with other parts are marked bad.
+ * Up to 'max_free_clusters' at the start of that space are set aside
+ * as free space, which is final. fat_finalize() should be given the
+ * same number. Filemaps that don't fit in the rest get 0.
+ */
+void fat_close_dirs(uint32_t max_free_clusters);
+
+/* Mark bad the clusters below the last filemap that share its
+ * FAT sector, so that the sector is final. Call this after adding
+ * filemaps after fat_close_dirs(). */
+void fat_pad_filemaps();
+
+/* Return true if any of the 'entries' FAT entries starting from
+ * 'entry_nr' are still pending */
+bool fat_pending(uint32_t entry_nr, uint32_t entries);
+
+/*
+ * These are valid after construction is finalized,
+ * or after fat_close_dirs()
  */
 
 /* Write 'entries' FAT entries to 'vbuf', starting from 'entry_nr' */
 void fat_fill(void *vbuf, uint32_t entry_nr, uint32_t entries);
 
+/* Return the number of unallocated clusters, for the FSInfo sector,
+ * or FAT_FREE_UNKNOWN before fat_close_dirs() or fat_finalize() */
+uint32_t fat_free_clusters();
+
+/* Return the number of bytes used for the FAT bookkeeping */
+size_t fat_mem_usage();
+
 /* Fill all or part of 'buf' with data from the image, starting from
  * byte 'offset' at data cluster 'start_clust'. The length may span
  * multiple clusters, but the function does not have to fill more than
@@ -86,3 +130,7 @@ void fat_fill(void *vbuf, uint32_t entry_nr, uint32_t entries);
  *         and leave the number of bytes in *filled */
 int data_fill(char *buf, uint32_t len, uint32_t start_clust, uint32_t offset,
 	uint32_t *filled);
+
+/* Return the region that data_fill() counts a read of data cluster
+ * 'clust' in: STATS_DIR, STATS_FILEMAP or STATS_LITERAL from stats.h */
+int data_region(uint32_t clust);
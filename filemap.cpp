@@ -15,61 +15,1128 @@
 
 #include "filemap.h"
 
+#include <limits.h>
 #include <string.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <algorithm>
 #include <vector>
 
 #include "vfat.h"
 #include "fat.h"
+#include "dir.h"
+#include "stats.h"
 
 struct filemap_info {
 	uint32_t starting_cluster;
-	const char *path; /* path in real filesystem */
+	int dir_index; /* directory containing the file */
+	uint32_t name_offset; /* name in real filesystem, in filemap_names */
+	uint32_t size; /* file size at scan time */
+	int fd_slot; /* index into fd_slots, or -1 if not open */
+	uint32_t handle_offset; /* in filemap_handles, or NO_HANDLE */
 };
 
 /* filemaps are kept sorted by descending starting_cluster */
 static std::vector<struct filemap_info> filemaps;
 
-uint32_t filemap_add(const char *name, uint32_t size)
+/* The names of all the mapped files, as nul-terminated strings.
+ * The rest of the path comes from the directory. */
+static std::vector<char> filemap_names;
+
+/*
+ * File handles of the mapped files, recorded during the scan.
+ * Opening a file by handle skips the path walk, so it doesn't depend
+ * on the depth of the file, and it still works if the file was renamed.
+ * The handles are stored as struct file_handle, each padded to the
+ * alignment of that struct.
+ * Opening by handle needs CAP_DAC_READ_SEARCH and support from the
+ * filesystem. When either is missing, files are opened by path.
+ */
+#define NO_HANDLE 0xffffffff
+static std::vector<char> filemap_handles;
+static int handle_mount_fd = -1; /* any fd on the target filesystem */
+static int handle_mount_id;
+static bool handles_work; /* atomic, cleared by any reader */
+
+/*
+ * Cache of open file descriptors for the mapped files, so that
+ * streaming a large file doesn't cost a path lookup and an open()
+ * for every request. The slots in use are kept in a doubly linked
+ * list, most recently used first, and the least recently used slot
+ * that has no readers is reused when the cache is full.
+ *
+ * To notice files that were deleted or replaced after the scan,
+ * a cached descriptor is checked with fstat() on every use. Once its
+ * file has no links left, it is opened again by path.
+ */
+
+/*
+ * In mmap mode, files are read through mappings of up to MMAP_WINDOW
+ * bytes. Each cached fd keeps its most recent window. Readers take
+ * a reference on the window they copy from, so that a window can be
+ * replaced while others are still using it.
+ */
+#define MMAP_WINDOW (4 << 20)  /* must be a multiple of the page size */
+
+struct map_window {
+	char *addr;
+	off_t start; /* file offset of addr */
+	size_t len;
+	int refs;
+};
+
+/*
+ * Sparse files, such as preallocated recordings or VM images, may be
+ * mostly holes. Their data segments are learned with SEEK_DATA and
+ * SEEK_HOLE, so that the holes can be zero-filled without reading.
+ * The map is made on the first read through a cached fd and shared by
+ * its readers like the window is. It is made again when the file's
+ * size, mtime or block count no longer match, as when a hole got data.
+ * Files with more than MAX_DATA_SEGMENTS segments are read in full
+ * after the last recorded segment.
+ */
+#define MAX_DATA_SEGMENTS 1024
+
+struct data_segment {
+	off_t start, end;
+};
+
+struct hole_map {
+	int refs;
+	off_t size;
+	struct timespec mtime;
+	blkcnt_t blocks;
+	std::vector<struct data_segment> data; /* sorted */
+};
+
+struct fd_slot {
+	int fmap_index; /* -1 if free or detached from its filemap */
+	int fd; /* -1 if free */
+	int users; /* number of readers currently using fd */
+	int prev, next; /* neighbours in the LRU list, or -1 */
+	struct map_window *window; /* mmap mode only, may be NULL */
+	bool holes_checked; /* if false, holes isn't known yet */
+	struct hole_map *holes; /* NULL if the file has no holes */
+};
+
+static std::vector<struct fd_slot> fd_slots;
+static int lru_first = -1;
+static int lru_last = -1;
+static pthread_mutex_t fd_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define DEFAULT_FD_CACHE_SIZE 16
+static int fd_cache_size = DEFAULT_FD_CACHE_SIZE;
+
+static bool use_mmap;
+
+/*
+ * Files of at least stream_threshold bytes are expected to be copied
+ * off once, such as videos, so there's no point in keeping them in
+ * the page cache where they would push out the data of running apps.
+ * Whenever a read of such a file crosses a STREAM_DROP_CHUNK boundary,
+ * the cached pages of the chunk before the previous one are dropped.
+ * The lag leaves room for the host to reread recent blocks. Dropping
+ * whole aligned chunks matters because the page cache may hold the
+ * file in large folios, which are only dropped if entirely covered.
+ * 0 means don't drop anything.
+ */
+#define STREAM_DROP_CHUNK (4 * 1024 * 1024)
+static uint32_t stream_threshold;
+
+/*
+ * Hosts that browse a folder of photos read the directory and then the
+ * start of every file in it to make thumbnails. The prefetcher guesses
+ * this from the directory reads: the files listed in a directory
+ * cluster are queued for a background thread that opens them (which
+ * also puts them in the fd cache) and asks the kernel to read their
+ * heads. Files are only prefetched once, and the thread stays within
+ * prefetch_budget bytes per second. Files that don't fit in the queue
+ * are skipped.
+ */
+#define PREFETCH_QUEUE 256
+static uint32_t prefetch_head;
+static uint32_t prefetch_budget;
+static std::vector<bool> prefetched; /* by fmap_index, under prefetch_lock */
+static int prefetch_queue[PREFETCH_QUEUE];
+static int prefetch_first, prefetch_count;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static bool prefetch_thread_started;
+
+/* The prefetch thread runs on its own, not on behalf of a read, so
+ * it takes this to look at the filemaps while filemap_add() may be
+ * adding to them in a lazily scanned image. */
+static pthread_rwlock_t filemaps_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* If set, reads in this thread fail with EAGAIN instead of waiting
+ * for the disk: the fd must be cached, and the data must be in the
+ * page cache. This lets the serve loop answer cached reads right away
+ * and pass the rest to a thread that can wait. */
+static __thread bool nowait;
+
+/* Points to the recovery point of a copy from a mapping that is
+ * in progress in this thread, for the SIGBUS handler. */
+static __thread sigjmp_buf *sigbus_jmp;
+
+/* Call with fd_cache_lock held, or with the only reference */
+static void window_unref(struct map_window *win)
+{
+	if (win && --win->refs == 0) {
+		munmap(win->addr, win->len);
+		free(win);
+	}
+}
+
+/* Call with fd_cache_lock held, or with the only reference */
+static void holes_unref(struct hole_map *holes)
+{
+	if (holes && --holes->refs == 0)
+		delete holes;
+}
+
+/* Close the slot's fd and free the slot. Call with fd_cache_lock held. */
+static void fd_slot_close(int s)
+{
+	struct fd_slot *slot = &fd_slots[s];
+
+	close(slot->fd);
+	slot->fd = -1;
+	window_unref(slot->window);
+	slot->window = NULL;
+	holes_unref(slot->holes);
+	slot->holes = NULL;
+}
+
+static void lru_unlink(int s)
+{
+	struct fd_slot *slot = &fd_slots[s];
+
+	if (slot->prev >= 0)
+		fd_slots[slot->prev].next = slot->next;
+	else
+		lru_first = slot->next;
+	if (slot->next >= 0)
+		fd_slots[slot->next].prev = slot->prev;
+	else
+		lru_last = slot->prev;
+	slot->prev = slot->next = -1;
+}
+
+static void lru_push_front(int s)
+{
+	struct fd_slot *slot = &fd_slots[s];
+
+	slot->prev = -1;
+	slot->next = lru_first;
+	if (lru_first >= 0)
+		fd_slots[lru_first].prev = s;
+	else
+		lru_last = s;
+	lru_first = s;
+}
+
+/* Disconnect a slot from its filemap, so that new readers will
+ * open the file again. The last reader closes the fd.
+ * Call with fd_cache_lock held. */
+static void fd_slot_detach(int s)
+{
+	struct fd_slot *slot = &fd_slots[s];
+
+	lru_unlink(s);
+	filemaps[slot->fmap_index].fd_slot = -1;
+	slot->fmap_index = -1;
+	if (slot->users == 0)
+		fd_slot_close(s);
+}
+
+/* Slots that still have readers are left for them to clean up */
+static void fd_cache_clear()
+{
+	pthread_mutex_lock(&fd_cache_lock);
+	while (lru_first >= 0)
+		fd_slot_detach(lru_first);
+	pthread_mutex_unlock(&fd_cache_lock);
+}
+
+void filemap_init()
+{
+	fd_cache_clear();
+	/* the prefetch thread may still be going after a rescan */
+	pthread_rwlock_wrlock(&filemaps_lock);
+	filemaps.clear();
+	filemap_names.clear();
+	filemap_handles.clear();
+	pthread_rwlock_unlock(&filemaps_lock);
+	if (handle_mount_fd >= 0)
+		close(handle_mount_fd);
+	handle_mount_fd = -1;
+	__atomic_store_n(&handles_work, true, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&prefetch_lock);
+	prefetched.clear();
+	prefetch_count = 0;
+	pthread_mutex_unlock(&prefetch_lock);
+}
+
+void filemap_set_fd_cache_size(int max_fds)
+{
+	fd_cache_clear();
+	pthread_mutex_lock(&fd_cache_lock);
+	fd_cache_size = max_fds;
+	pthread_mutex_unlock(&fd_cache_lock);
+}
+
+static void open_mount_fd()
+{
+	char path[PATH_MAX];
+	union {
+		struct file_handle fh;
+		char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+	} h;
+
+	__atomic_store_n(&handles_work, false, __ATOMIC_RELAXED);
+	if (dir_path(0, path, sizeof(path)) < 0)
+		return;
+	handle_mount_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (handle_mount_fd < 0)
+		return;
+	h.fh.handle_bytes = MAX_HANDLE_SZ;
+	if (name_to_handle_at(handle_mount_fd, "", &h.fh,
+			&handle_mount_id, AT_EMPTY_PATH) < 0)
+		return;
+	__atomic_store_n(&handles_work, true, __ATOMIC_RELAXED);
+}
+
+/* Return the offset of the new handle in filemap_handles,
+ * or NO_HANDLE if there is none. */
+static uint32_t record_handle(const char *scan_path)
+{
+	union {
+		struct file_handle fh;
+		char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+	} h;
+	uint32_t offset;
+	size_t len;
+	int mount_id;
+
+	if (__atomic_load_n(&handles_work, __ATOMIC_RELAXED)
+			&& handle_mount_fd < 0)
+		open_mount_fd();
+	if (!__atomic_load_n(&handles_work, __ATOMIC_RELAXED) || !scan_path)
+		return NO_HANDLE;
+
+	h.fh.handle_bytes = MAX_HANDLE_SZ;
+	if (name_to_handle_at(AT_FDCWD, scan_path, &h.fh, &mount_id, 0) < 0) {
+		if (errno == EOPNOTSUPP)  /* filesystem can't do it */
+			__atomic_store_n(&handles_work, false, __ATOMIC_RELAXED);
+		return NO_HANDLE;
+	}
+	/* the handle has to be opened relative to the same mount */
+	if (mount_id != handle_mount_id)
+		return NO_HANDLE;
+
+	offset = filemap_handles.size();
+	len = ALIGN(sizeof(struct file_handle) + h.fh.handle_bytes,
+		__alignof__(struct file_handle));
+	filemap_handles.insert(filemap_handles.end(), h.buf, h.buf + len);
+	return offset;
+}
+
+uint32_t filemap_add(int dir_index, const char *name, uint32_t size,
+	const char *scan_path)
 {
 	uint32_t nr_clust = ALIGN(size, CLUSTER_SIZE) / CLUSTER_SIZE;
 	struct filemap_info fm;
 
+	pthread_rwlock_wrlock(&filemaps_lock);
 	fm.starting_cluster = fat_alloc_filemap(filemaps.size(), nr_clust);
-	fm.path = strdup(name);
+	if (!fm.starting_cluster) {
+		/* no room left in a live update */
+		pthread_rwlock_unlock(&filemaps_lock);
+		return 0;
+	}
+	fm.dir_index = dir_index;
+	fm.name_offset = filemap_names.size();
+	filemap_names.insert(filemap_names.end(), name, name + strlen(name) + 1);
+	fm.size = size;
+	fm.fd_slot = -1;
+	fm.handle_offset = record_handle(scan_path);
 
 	filemaps.push_back(fm);
+	pthread_mutex_lock(&prefetch_lock);
+	prefetched.push_back(false);
+	pthread_mutex_unlock(&prefetch_lock);
+	pthread_rwlock_unlock(&filemaps_lock);
 	return fm.starting_cluster;
 }
 
+int filemap_path(int fmap_index, char *buf, int size)
+{
+	const struct filemap_info *fm = &filemaps[fmap_index];
+	const char *name = &filemap_names[fm->name_offset];
+	int namelen = strlen(name);
+	int len;
+
+	len = dir_path(fm->dir_index, buf, size);
+	if (len < 0 || len + 1 + namelen >= size)
+		return -1;
+	buf[len++] = '/';
+	memcpy(buf + len, name, namelen + 1);
+	return len + namelen;
+}
+
+size_t filemap_mem_usage()
+{
+	return filemaps.capacity() * sizeof(struct filemap_info)
+		+ filemap_names.capacity() + filemap_handles.capacity();
+}
+
+/* Open the mapped file and fstat it into *st.
+ * Result: the fd, or -1 with errno set. */
+static int open_filemap(int fmap_index, struct stat *st)
+{
+	uint32_t handle_offset = filemaps[fmap_index].handle_offset;
+	char path[PATH_MAX];
+	int fd;
+
+	if (handle_offset != NO_HANDLE
+			&& __atomic_load_n(&handles_work, __ATOMIC_RELAXED)) {
+		struct file_handle *fh = (struct file_handle *)
+			&filemap_handles[handle_offset];
+		fd = open_by_handle_at(handle_mount_fd, fh,
+			O_RDONLY | O_NOATIME | O_CLOEXEC);
+		stats_syscall(0);
+		if (fd < 0 && errno == EPERM) {
+			/* Either O_NOATIME isn't allowed, or opening by
+			 * handle isn't. Find out which. */
+			fd = open_by_handle_at(handle_mount_fd, fh,
+				O_RDONLY | O_CLOEXEC);
+			stats_syscall(0);
+			if (fd < 0 && errno == EPERM)
+				__atomic_store_n(&handles_work, false, __ATOMIC_RELAXED);
+		}
+		/* A handle still opens a deleted file that has an fd
+		 * open somewhere, such as in the cache */
+		if (fd >= 0) {
+			stats_syscall(0);
+			if (fstat(fd, st) == 0 && st->st_nlink > 0)
+				return fd;
+			close(fd);
+		}
+		/* Fall back to the path. The file may have been deleted,
+		 * which will give the right error there, or replaced. */
+	}
+
+	if (filemap_path(fmap_index, path, sizeof(path)) < 0) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	/* O_NOATIME is only allowed for the file's owner */
+	fd = open(path, O_RDONLY | O_NOATIME | O_CLOEXEC);
+	stats_syscall(0);
+	if (fd < 0 && errno == EPERM) {
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		stats_syscall(0);
+	}
+	if (fd < 0)
+		return fd;
+	stats_syscall(0);
+	if (fstat(fd, st) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void put_fd(int fd, int s)
+{
+	if (s < 0) {
+		close(fd);
+		stats_syscall(0);
+		return;
+	}
+
+	pthread_mutex_lock(&fd_cache_lock);
+	fd_slots[s].users--;
+	if (fd_slots[s].users == 0 && fd_slots[s].fmap_index < 0)
+		fd_slot_close(s);
+	pthread_mutex_unlock(&fd_cache_lock);
+}
+
+/*
+ * Get an open fd for the mapped file, from the cache if possible,
+ * and fstat it into *st.
+ * The fd must be given back with put_fd() along with *slotp.
+ * Result: the fd, or -1 with errno set.
+ */
+static int get_fd(int fmap_index, int *slotp, struct stat *st)
+{
+	int s;
+	int fd;
+
+	pthread_mutex_lock(&fd_cache_lock);
+	s = filemaps[fmap_index].fd_slot;
+	if (s >= 0) {
+		fd_slots[s].users++;
+		lru_unlink(s);
+		lru_push_front(s);
+		/* fd_slots may be resized once the lock is let go */
+		fd = fd_slots[s].fd;
+		pthread_mutex_unlock(&fd_cache_lock);
+		stats_syscall(0);
+		if (fstat(fd, st) == 0 && st->st_nlink > 0) {
+			*slotp = s;
+			return fd;
+		}
+		/* deleted or replaced */
+		pthread_mutex_lock(&fd_cache_lock);
+		if (filemaps[fmap_index].fd_slot == s)
+			fd_slot_detach(s);
+		pthread_mutex_unlock(&fd_cache_lock);
+		put_fd(fd, s);
+	} else {
+		pthread_mutex_unlock(&fd_cache_lock);
+	}
+	if (nowait) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* Open outside the lock because it may be slow */
+	fd = open_filemap(fmap_index, st);
+	*slotp = -1;
+	if (fd < 0)
+		return fd;
+	if (stream_threshold && filemaps[fmap_index].size >= stream_threshold) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		stats_syscall(0);
+	}
+
+	pthread_mutex_lock(&fd_cache_lock);
+	if (fd_cache_size <= 0 || filemaps[fmap_index].fd_slot >= 0) {
+		/* Either there's no cache, or another reader got there
+		 * first. Just use this fd once. */
+		pthread_mutex_unlock(&fd_cache_lock);
+		return fd;
+	}
+	for (s = 0; s < fd_cache_size; s++) {
+		if (s == (int) fd_slots.size()) {
+			fd_slots.resize(s + 1);
+			break;
+		}
+		if (fd_slots[s].fd < 0)
+			break;
+	}
+	if (s == fd_cache_size) {
+		for (s = lru_last; s >= 0; s = fd_slots[s].prev) {
+			if (fd_slots[s].users == 0)
+				break;
+		}
+		if (s < 0) {  /* everything is busy */
+			pthread_mutex_unlock(&fd_cache_lock);
+			return fd;
+		}
+		fd_slot_detach(s);
+	}
+	fd_slots[s].fmap_index = fmap_index;
+	fd_slots[s].fd = fd;
+	fd_slots[s].users = 1;
+	fd_slots[s].window = NULL;
+	fd_slots[s].holes_checked = false;
+	fd_slots[s].holes = NULL;
+	lru_push_front(s);
+	filemaps[fmap_index].fd_slot = s;
+	pthread_mutex_unlock(&fd_cache_lock);
+	*slotp = s;
+	return fd;
+}
+
+static void sigbus_handler(int sig)
+{
+	if (sigbus_jmp)
+		siglongjmp(*sigbus_jmp, 1);
+	/* not ours; crash the way it would have without this handler */
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+void filemap_set_use_mmap(bool enable)
+{
+	static bool handler_installed;
+	struct sigaction sa;
+
+	if (enable && !handler_installed) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = sigbus_handler;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGBUS, &sa, NULL);
+		handler_installed = true;
+	}
+	fd_cache_clear();
+	use_mmap = enable;
+}
+
+/*
+ * Return a referenced window of the file that contains 'pos'.
+ * The window is shared with the fd's cache slot if there is one.
+ * Result: the window, or NULL with errno set. errno is 0 if
+ * 'pos' is past the end of the file.
+ */
+static struct map_window *get_window(int fd, int s, off_t pos)
+{
+	struct map_window *win;
+	struct map_window *old = NULL;
+	struct stat st;
+	off_t prev_end = -1;
+	void *addr;
+
+	if (s >= 0) {
+		pthread_mutex_lock(&fd_cache_lock);
+		win = fd_slots[s].window;
+		if (win && pos >= win->start
+		    && pos < win->start + (off_t) win->len) {
+			win->refs++;
+			pthread_mutex_unlock(&fd_cache_lock);
+			return win;
+		}
+		if (win)
+			prev_end = win->start + win->len;
+		pthread_mutex_unlock(&fd_cache_lock);
+	}
+
+	/* Mapping past the end of the file would give SIGBUS right away,
+	 * so check the size to clip the window. */
+	stats_syscall(0);
+	if (fstat(fd, &st) < 0)
+		return NULL;
+	if (pos >= st.st_size) {
+		errno = 0;
+		return NULL;
+	}
+
+	win = (struct map_window *) malloc(sizeof(*win));
+	if (!win)
+		return NULL;
+	win->start = pos & ~((off_t) MMAP_WINDOW - 1);
+	win->len = std::min((off_t) MMAP_WINDOW, st.st_size - win->start);
+	win->refs = 1;
+	addr = mmap(NULL, win->len, PROT_READ, MAP_SHARED, fd, win->start);
+	stats_syscall(0);
+	if (addr == MAP_FAILED) {
+		free(win);
+		return NULL;
+	}
+	win->addr = (char *) addr;
+
+	/* A window that continues where the last one ended is most
+	 * likely part of a file being streamed. */
+	if (win->start == prev_end)
+		madvise(addr, win->len, MADV_SEQUENTIAL);
+	else if (win->len < MMAP_WINDOW)
+		madvise(addr, win->len, MADV_WILLNEED);  /* whole small file */
+
+	if (s >= 0) {
+		pthread_mutex_lock(&fd_cache_lock);
+		old = fd_slots[s].window;
+		fd_slots[s].window = win;
+		win->refs++;
+		window_unref(old);
+		pthread_mutex_unlock(&fd_cache_lock);
+	}
+	return win;
+}
+
+static void put_window(struct map_window *win, int s)
+{
+	if (s < 0) {
+		window_unref(win);
+		return;
+	}
+	pthread_mutex_lock(&fd_cache_lock);
+	window_unref(win);
+	pthread_mutex_unlock(&fd_cache_lock);
+}
+
+/* Check if the part of the window at 'pos' is in the page cache */
+static bool window_cached(const struct map_window *win, off_t pos, size_t len)
+{
+	static long page_size = sysconf(_SC_PAGESIZE);
+	unsigned char vec[64];
+	size_t first = (pos - win->start) / page_size;
+	size_t last = (pos - win->start + len - 1) / page_size;
+	size_t n;
+
+	/* vec holds one byte per page, so go a vec at a time */
+	for (; first <= last; first += n) {
+		n = std::min(last - first + 1, sizeof(vec));
+		if (mincore(win->addr + first * page_size,
+				n * page_size, vec) < 0)
+			return false;
+		for (size_t i = 0; i < n; i++) {
+			if (!(vec[i] & 1))
+				return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Copy from the mapping, but fail with EIO instead of crashing
+ * if the file was truncated after it was mapped.
+ */
+static int copy_from_window(char *buf, const char *src, size_t len)
+{
+	sigjmp_buf env;
+
+	if (sigsetjmp(env, 1)) {
+		sigbus_jmp = NULL;
+		return EIO;
+	}
+	sigbus_jmp = &env;
+	memcpy(buf, src, len);
+	sigbus_jmp = NULL;
+	return 0;
+}
+
+static int fill_from_map(char *buf, uint32_t len, int fd, int s,
+	uint32_t offset)
+{
+	struct map_window *win;
+	uint32_t done = 0;
+	off_t pos;
+	size_t n;
+	int ret = 0;
+
+	while (done < len) {
+		pos = (off_t) offset + done;
+		win = get_window(fd, s, pos);
+		if (!win) {
+			ret = errno;
+			break;
+		}
+		n = std::min((off_t) (len - done),
+			win->start + (off_t) win->len - pos);
+		if (nowait && !window_cached(win, pos, n))
+			ret = EAGAIN;
+		else
+			ret = copy_from_window(buf + done,
+				win->addr + (pos - win->start), n);
+		put_window(win, s);
+		if (ret)
+			break;
+		done += n;
+	}
+	if (!ret && done < len)  /* reached end of file */
+		memset(buf + done, 0, len - done);
+	return ret;
+}
+
+void filemap_set_nowait(bool enable)
+{
+	nowait = enable;
+}
+
+bool filemap_get_nowait()
+{
+	return nowait;
+}
+
+void filemap_set_stream_threshold(uint32_t bytes)
+{
+	stream_threshold = bytes;
+}
+
+/* Drop the cached pages that are well behind this read */
+static void drop_behind(int fd, uint32_t offset, uint32_t len)
+{
+	off_t boundary = ALIGN((off_t) offset + 1, STREAM_DROP_CHUNK);
+
+	if ((off_t) offset + len < boundary)
+		return;  /* didn't cross a chunk boundary */
+	if (boundary < 2 * STREAM_DROP_CHUNK)
+		return;  /* nothing far enough behind yet */
+	posix_fadvise(fd, boundary - 2 * STREAM_DROP_CHUNK, STREAM_DROP_CHUNK,
+		POSIX_FADV_DONTNEED);
+	stats_syscall(0);
+}
+
+static ssize_t read_at(int fd, char *buf, size_t len, off_t pos)
+{
+	struct iovec iov;
+	ssize_t nread;
+
+	if (!nowait) {
+		nread = pread(fd, buf, len, pos);
+		stats_syscall(nread > 0 ? nread : 0);
+		return nread;
+	}
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	nread = preadv2(fd, &iov, 1, pos, RWF_NOWAIT);
+	stats_syscall(nread > 0 ? nread : 0);
+	if (nread < 0 && errno == EOPNOTSUPP)
+		errno = EAGAIN;  /* let the caller do a blocking read */
+	return nread;
+}
+
+static int fill_from_read(char *buf, uint32_t len, int fd, uint32_t offset)
+{
+	uint32_t done = 0;
+	ssize_t nread;
+
+	while (done < len) {
+		nread = read_at(fd, buf + done, len - done, (off_t) offset + done);
+		if (nread < 0 && errno == EINTR)
+			continue;
+		if (nread < 0)
+			return errno;
+		if (nread == 0)  /* reached end of file */
+			break;
+		done += nread;
+	}
+	memset(buf + done, 0, len - done);
+	return 0;
+}
+
+/* A file with as many blocks as its size needs has no holes */
+static bool may_have_holes(const struct stat *st)
+{
+	return (off_t) st->st_blocks * 512 < st->st_size;
+}
+
+/*
+ * Learn the data segments of the file.
+ * Result: a referenced map, or NULL if the file has no holes
+ * or the filesystem can't say where they are.
+ */
+static struct hole_map *make_hole_map(int fd, const struct stat *st)
+{
+	struct hole_map *holes;
+	struct data_segment seg;
+	off_t pos = 0;
+
+	if (!may_have_holes(st))
+		return NULL;
+
+	holes = new hole_map;
+	holes->refs = 1;
+	holes->size = st->st_size;
+	holes->mtime = st->st_mtim;
+	holes->blocks = st->st_blocks;
+	while (pos < st->st_size) {
+		seg.start = lseek(fd, pos, SEEK_DATA);
+		stats_syscall(0);
+		if (seg.start < 0 && errno == ENXIO)
+			break;  /* only a hole left */
+		if (seg.start < 0) {
+			delete holes;
+			return NULL;
+		}
+		if (holes->data.size() == MAX_DATA_SEGMENTS - 1) {
+			seg.end = st->st_size;  /* give up on the rest */
+		} else {
+			seg.end = lseek(fd, seg.start, SEEK_HOLE);
+			stats_syscall(0);
+			if (seg.end < 0) {
+				delete holes;
+				return NULL;
+			}
+		}
+		holes->data.push_back(seg);
+		pos = seg.end;
+	}
+	return holes;
+}
+
+/* Return true if the file changed since the map was made */
+static bool holes_stale(const struct hole_map *holes, const struct stat *st)
+{
+	return holes->size != st->st_size || holes->blocks != st->st_blocks
+		|| holes->mtime.tv_sec != st->st_mtim.tv_sec
+		|| holes->mtime.tv_nsec != st->st_mtim.tv_nsec;
+}
+
+/*
+ * Get a referenced hole map of the file in *holesp, shared with the
+ * fd's cache slot if there is one, or NULL if it should be read in full.
+ * 'st' is the fstat of fd.
+ * Result: 0, or EAGAIN in nowait mode if the map still has to be made.
+ */
+static int get_holes(int fd, int s, const struct stat *st,
+	struct hole_map **holesp)
+{
+	struct hole_map *holes;
+
+	if (s >= 0) {
+		pthread_mutex_lock(&fd_cache_lock);
+		holes = fd_slots[s].holes;
+		if (holes && holes_stale(holes, st)) {
+			holes_unref(holes);
+			fd_slots[s].holes = NULL;
+			fd_slots[s].holes_checked = false;
+		}
+		/* A file without holes can be read in full whatever
+		 * happens to it */
+		if (fd_slots[s].holes_checked) {
+			holes = fd_slots[s].holes;
+			if (holes)
+				holes->refs++;
+			pthread_mutex_unlock(&fd_cache_lock);
+			*holesp = holes;
+			return 0;
+		}
+		pthread_mutex_unlock(&fd_cache_lock);
+	}
+
+	/* SEEK_DATA and SEEK_HOLE may have to wait for the disk */
+	if (nowait && may_have_holes(st))
+		return EAGAIN;
+	holes = make_hole_map(fd, st);
+	*holesp = holes;
+	if (s < 0)
+		return 0;
+	pthread_mutex_lock(&fd_cache_lock);
+	if (!fd_slots[s].holes_checked) {
+		fd_slots[s].holes = holes;
+		fd_slots[s].holes_checked = true;
+		if (holes)
+			holes->refs++;  /* the slot's reference */
+	}
+	pthread_mutex_unlock(&fd_cache_lock);
+	return 0;
+}
+
+static void put_holes(struct hole_map *holes, int s)
+{
+	if (s < 0) {
+		holes_unref(holes);
+		return;
+	}
+	pthread_mutex_lock(&fd_cache_lock);
+	holes_unref(holes);
+	pthread_mutex_unlock(&fd_cache_lock);
+}
+
+static int fill_data(char *buf, uint32_t len, int fd, int s, uint32_t offset)
+{
+	if (use_mmap)
+		return fill_from_map(buf, len, fd, s, offset);
+	return fill_from_read(buf, len, fd, offset);
+}
+
+static bool segment_before(const struct data_segment &seg, off_t pos)
+{
+	return seg.end <= pos;
+}
+
+/* Read only the data segments, and zero-fill the holes */
+static int fill_sparse(char *buf, uint32_t len, int fd, int s,
+	uint32_t offset, const struct hole_map *holes)
+{
+	std::vector<struct data_segment>::const_iterator seg;
+	off_t pos = offset;
+	off_t end = (off_t) offset + len;
+	off_t n;
+	int ret;
+
+	seg = std::lower_bound(holes->data.begin(), holes->data.end(),
+		pos, segment_before);
+	while (pos < end) {
+		if (seg == holes->data.end() || seg->start >= end) {
+			memset(buf + (pos - offset), 0, end - pos);
+			break;
+		}
+		if (pos < seg->start) {
+			memset(buf + (pos - offset), 0, seg->start - pos);
+			pos = seg->start;
+		}
+		n = std::min(end, seg->end) - pos;
+		ret = fill_data(buf + (pos - offset), n, fd, s, pos);
+		if (ret)
+			return ret;
+		pos += n;
+		++seg;
+	}
+	return 0;
+}
+
 int filemap_fill(char *buf, uint32_t len, int fmap_index, uint32_t offset)
 {
 	if (fmap_index < 0 || fmap_index >= (int) filemaps.size())
 		return EINVAL;
 
-	const char *path = filemaps[fmap_index].path;
-	int nread;
+	struct hole_map *holes;
+	struct stat st;
+	int slot;
 	int fd;
-	int ret = 0;
+	int ret;
 
-	fd = open(path, O_RDONLY);
+	fd = get_fd(fmap_index, &slot, &st);
 	if (fd < 0)
 		return errno;
 
-	if (lseek(fd, offset, SEEK_SET) == (off_t) -1) {
-		ret = errno;
-	} else {
-		nread = read(fd, buf, len);
-		if (nread < 0) {
-			ret = errno;
-		} else if ((uint32_t) nread < len) { // reached end of file
-			memset(buf + nread, 0, len - nread);
-		}
+	ret = get_holes(fd, slot, &st, &holes);
+	if (ret) {
+		put_fd(fd, slot);
+		return ret;
 	}
-	close(fd);
+	if (holes)
+		ret = fill_sparse(buf, len, fd, slot, offset, holes);
+	else
+		ret = fill_data(buf, len, fd, slot, offset);
+	put_holes(holes, slot);
+
+	if (stream_threshold && filemaps[fmap_index].size >= stream_threshold)
+		drop_behind(fd, offset, len);
+
+	put_fd(fd, slot);
 	return ret;
 }
+
+static double monotonic_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *prefetch_thread(void *)
+{
+	double budget_left = 0;
+	double last = monotonic_now();
+	double now;
+	struct stat st;
+	uint32_t len, budget;
+	int fmap_index;
+	int slot;
+	int fd;
+
+	for (;;) {
+		pthread_mutex_lock(&prefetch_lock);
+		while (prefetch_count == 0)
+			pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+		fmap_index = prefetch_queue[prefetch_first];
+		prefetch_first = (prefetch_first + 1) % PREFETCH_QUEUE;
+		prefetch_count--;
+		/* filemap_set_prefetch() may turn it off at any time */
+		len = prefetch_head;
+		budget = prefetch_budget;
+		pthread_mutex_unlock(&prefetch_lock);
+		if (len == 0 || budget == 0)
+			continue;
+
+		pthread_rwlock_rdlock(&filemaps_lock);
+		if (fmap_index < (int) filemaps.size())
+			len = std::min(len, filemaps[fmap_index].size);
+		else
+			len = 0;  /* queued before a rescan */
+		pthread_rwlock_unlock(&filemaps_lock);
+		if (len == 0)
+			continue;
+
+		/* Allow bursts of up to one second's worth */
+		now = monotonic_now();
+		budget_left = std::min(budget_left + (now - last) * budget,
+			(double) budget);
+		last = now;
+		if (budget_left < len) {
+			usleep((len - budget_left) * 1e6 / budget);
+			budget_left = len;
+			last = monotonic_now();
+		}
+		budget_left -= len;
+
+		pthread_rwlock_rdlock(&filemaps_lock);
+		fd = fmap_index < (int) filemaps.size()
+			? get_fd(fmap_index, &slot, &st) : -1;
+		if (fd >= 0) {
+			posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+			put_fd(fd, slot);
+		}
+		pthread_rwlock_unlock(&filemaps_lock);
+	}
+	return NULL;
+}
+
+void filemap_set_prefetch(uint32_t head_bytes, uint32_t budget)
+{
+	pthread_t thread;
+
+	if (!budget)
+		head_bytes = 0;
+	pthread_mutex_lock(&prefetch_lock);
+	prefetch_budget = budget;
+	prefetch_count = 0;
+	if (head_bytes && !prefetch_thread_started) {
+		if (pthread_create(&thread, NULL, prefetch_thread, NULL) == 0) {
+			pthread_detach(thread);
+			prefetch_thread_started = true;
+		} else {
+			head_bytes = 0;
+		}
+	}
+	/* filemap_prefetch_dir() checks it without the lock */
+	__atomic_store_n(&prefetch_head, head_bytes, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&prefetch_lock);
+}
+
+static bool filemap_after(const struct filemap_info &fm, uint32_t clust)
+{
+	return fm.starting_cluster > clust;
+}
+
+void filemap_prefetch_dir(const char *buf, uint32_t len)
+{
+	std::vector<struct filemap_info>::const_iterator fm;
+	const uint8_t *entry;
+	uint32_t clust;
+	int fmap_index;
+	bool queued = false;
+
+	if (!__atomic_load_n(&prefetch_head, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&prefetch_lock);
+	/* directory entries are 32 bytes */
+	for (uint32_t pos = 0; pos + 32 <= len; pos += 32) {
+		entry = (const uint8_t *) buf + pos;
+		if (entry[0] == 0)
+			break;  /* end of directory */
+		if (entry[0] == 0xe5
+		    || (entry[11] & (FAT_ATTR_LABEL | FAT_ATTR_DIRECTORY)))
+			continue;  /* deleted, long name, dir or label */
+		clust = (entry[20] | entry[21] << 8) << 16
+			| (entry[26] | entry[27] << 8);
+		/* filemaps are sorted by descending starting cluster */
+		fm = std::lower_bound(filemaps.begin(), filemaps.end(),
+			clust, filemap_after);
+		if (fm == filemaps.end() || fm->starting_cluster != clust)
+			continue;
+		fmap_index = fm - filemaps.begin();
+		if (prefetched[fmap_index])
+			continue;
+		if (prefetch_count == PREFETCH_QUEUE)
+			break;
+		prefetched[fmap_index] = true;
+		prefetch_queue[(prefetch_first + prefetch_count) % PREFETCH_QUEUE]
+			= fmap_index;
+		prefetch_count++;
+		queued = true;
+	}
+	if (queued)
+		pthread_cond_signal(&prefetch_cond);
+	pthread_mutex_unlock(&prefetch_lock);
+}
@@ -17,16 +17,61 @@
  * This file is the interface for mapping local files into the FAT image.
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* Call this after fat_init() */
 void filemap_init();
 
-/* Register a filemap and return its starting cluster number. */
-uint32_t filemap_add(const char *name, uint32_t size);
+/* Keep at most 'max_fds' mapped files open between requests.
+ * 0 disables the cache. */
+void filemap_set_fd_cache_size(int max_fds);
+
+/* Read mapped files through mmap() windows instead of pread().
+ * Files that shrink while mapped give EIO instead of SIGBUS. */
+void filemap_set_use_mmap(bool enable);
+
+/* While enabled, filemap_fill() in the calling thread fails with
+ * EAGAIN instead of blocking when the file isn't open already or
+ * the data isn't in the page cache. */
+void filemap_set_nowait(bool enable);
+
+/* Result: whether filemap_set_nowait() is enabled in this thread */
+bool filemap_get_nowait();
+
+/* Don't keep files of at least 'bytes' bytes in the page cache
+ * after they have been read, except for the most recent part.
+ * 0 disables this. */
+void filemap_set_stream_threshold(uint32_t bytes);
+
+/* When a directory cluster is read, read the first 'head_bytes' of
+ * the files listed in it into the page cache in the background,
+ * at most 'budget' bytes per second. 0 head_bytes disables this. */
+void filemap_set_prefetch(uint32_t head_bytes, uint32_t budget);
+
+/* Register a filemap for the file called 'name' in the directory
+ * with index 'dir_index', and return its starting cluster number,
+ * or 0 if the FAT has no room for it.
+ * If 'scan_path' is not NULL, it's where the file can be found right
+ * now relative to the current directory. It's used to record a file
+ * handle, so that the file can be opened without its path later. */
+uint32_t filemap_add(int dir_index, const char *name, uint32_t size,
+	const char *scan_path);
+
+/* Write the path of the mapped file in the real filesystem to 'buf',
+ * which has room for 'size' bytes.
+ * Result: the length of the path, or -1 if it doesn't fit. */
+int filemap_path(int fmap_index, char *buf, int size);
+
+/* Return the number of bytes used for filemap bookkeeping */
+size_t filemap_mem_usage();
 
 /* Fill all or part of 'buf' with data from the mapped file,
  * starting from byte 'offset'. If not all of 'buf' is filled
  * (file is not long enough) then the rest is zeroed.
  * Result: 0 for success or errno for failure. */
 int filemap_fill(char *buf, uint32_t len, int fmap_index, uint32_t offset);
+
+/* Start prefetching the files listed in 'buf', which holds 'len'
+ * bytes of directory entries as served to the host. */
+void filemap_prefetch_dir(const char *buf, uint32_t len);
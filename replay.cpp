@@ -0,0 +1,367 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+*/
+
+/*
+ * Replay a trace recorded with tojblockd --record-trace against an
+ * image of DIRECTORY, which should be the directory the trace was
+ * recorded from, and report the throughput and read latencies.
+ *
+ * By default the reads are made with vfat_fill() one after another.
+ * With --socket they go through the nbd server loop over a socket
+ * pair, with up to --depth of them in flight like the kernel would
+ * have, so that the I/O workers are part of the measurement.
+ * The reads are issued at their recorded times unless --max-speed
+ * is given. Writes aren't replayed; tojblockd refuses them anyway.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <vector>
+
+#include "nbd.h"
+#include "vfat.h"
+#include "serve.h"
+#include "stats.h"
+#include "trace.h"
+
+static int opt_help;
+static int opt_socket;
+static int opt_max_speed;
+static int opt_depth = 32;
+static const char *program_name;
+
+static struct option options[] = {
+	{ "help", no_argument, &opt_help, 1 },
+	{ "socket", no_argument, &opt_socket, 1 },
+	{ "max-speed", no_argument, &opt_max_speed, 1 },
+	{ "depth", required_argument, NULL, 'd' },
+
+	{ 0, 0, 0, 0 }
+};
+
+static void usage(FILE *out)
+{
+	fprintf(out, "Usage: %s [options] TRACE DIRECTORY\n"
+		"  Options:\n"
+		"  --socket     Send the reads through the nbd server loop\n"
+		"      over a socket pair instead of calling vfat_fill\n"
+		"  --depth=N    Keep up to N reads in flight with --socket\n"
+		"      (default 32)\n"
+		"  --max-speed  Issue each read as soon as possible instead\n"
+		"      of at its recorded time\n"
+		, program_name);
+}
+
+/* What the replay measured. Latencies are in microseconds. */
+struct replay_result {
+	struct stats_histogram latency;
+	struct stats_histogram region_latency[STATS_REGIONS];
+	uint64_t reads;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t skipped;  /* requests that aren't reads */
+};
+
+static std::vector<struct trace_record> records;
+static struct replay_result result;
+
+/* Sleep until 'time_us' after 'start' */
+static void wait_until(uint64_t start, uint64_t time_us)
+{
+	uint64_t now = stats_now_us();
+	struct timespec ts;
+
+	if (now >= start + time_us)
+		return;
+	time_us = start + time_us - now;
+	ts.tv_sec = time_us / 1000000;
+	ts.tv_nsec = time_us % 1000000 * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static void count_read(const struct trace_record *rec, int error,
+	uint64_t latency)
+{
+	result.reads++;
+	result.bytes += rec->len;
+	if (error)
+		result.errors++;
+	stats_record(&result.latency, latency);
+	if (rec->region < STATS_REGIONS)
+		stats_record(&result.region_latency[rec->region], latency);
+}
+
+static void replay_direct()
+{
+	std::vector<char> buf;
+	uint64_t start = stats_now_us();
+	uint64_t issued;
+	int err;
+
+	for (size_t i = 0; i < records.size(); i++) {
+		const struct trace_record *rec = &records[i];
+
+		if (rec->type != NBD_CMD_READ) {
+			result.skipped++;
+			continue;
+		}
+		if (!opt_max_speed)
+			wait_until(start, rec->time_us);
+		if (buf.size() < rec->len)
+			buf.resize(rec->len);
+		issued = stats_now_us();
+		err = vfat_fill(&buf[0], rec->from, rec->len);
+		count_read(rec, err, stats_now_us() - issued);
+	}
+}
+
+/*
+ * For --socket: the main thread sends the requests, with the record
+ * index as the handle, and receive_thread reads the replies.
+ * in_flight is guarded by flight_lock.
+ */
+static std::vector<uint64_t> sent_at;
+static int in_flight;
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flight_cond = PTHREAD_COND_INITIALIZER;
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(fd, (char *) buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = write(fd, (const char *) buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+static void *receive_thread(void *arg)
+{
+	int fd = (long) arg;
+	std::vector<char> buf;
+	struct nbd_reply reply;
+	uint64_t index;
+	uint64_t expected = records.size() - result.skipped;
+
+	for (uint64_t n = 0; n < expected; n++) {
+		if (!read_all(fd, &reply, sizeof(reply))
+				|| be32toh(reply.magic) != NBD_REPLY_MAGIC) {
+			fprintf(stderr, "%s: bad reply from server\n",
+				program_name);
+			exit(1);
+		}
+		memcpy(&index, reply.handle, sizeof(index));
+		const struct trace_record *rec = &records[index];
+		if (!reply.error) {
+			if (buf.size() < rec->len)
+				buf.resize(rec->len);
+			if (!read_all(fd, &buf[0], rec->len)) {
+				fprintf(stderr, "%s: short reply from server\n",
+					program_name);
+				exit(1);
+			}
+		}
+		count_read(rec, reply.error, stats_now_us() - sent_at[index]);
+
+		pthread_mutex_lock(&flight_lock);
+		in_flight--;
+		pthread_cond_signal(&flight_cond);
+		pthread_mutex_unlock(&flight_lock);
+	}
+	return NULL;
+}
+
+static void *serve_thread(void *arg)
+{
+	int err = serve((long) arg, 0);
+
+	if (err)
+		fprintf(stderr, "%s: serving failed: %s\n", program_name,
+			strerror(err));
+	return NULL;
+}
+
+static void replay_socket()
+{
+	pthread_t server, receiver;
+	struct nbd_request req;
+	uint64_t start;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		fprintf(stderr, "%s: socketpair: %s\n", program_name,
+			strerror(errno));
+		exit(1);
+	}
+	/* the receiver needs to know how many replies to expect */
+	for (size_t i = 0; i < records.size(); i++) {
+		if (records[i].type != NBD_CMD_READ)
+			result.skipped++;
+	}
+	sent_at.resize(records.size());
+	if (pthread_create(&server, NULL, serve_thread, (void *) (long) sv[1])
+			|| pthread_create(&receiver, NULL, receive_thread,
+				(void *) (long) sv[0])) {
+		fprintf(stderr, "%s: can't start threads\n", program_name);
+		exit(1);
+	}
+
+	start = stats_now_us();
+	for (size_t i = 0; i < records.size(); i++) {
+		const struct trace_record *rec = &records[i];
+		uint64_t index = i;
+
+		if (rec->type != NBD_CMD_READ)
+			continue;
+		pthread_mutex_lock(&flight_lock);
+		while (in_flight >= opt_depth)
+			pthread_cond_wait(&flight_cond, &flight_lock);
+		in_flight++;
+		pthread_mutex_unlock(&flight_lock);
+		if (!opt_max_speed)
+			wait_until(start, rec->time_us);
+
+		req.magic = htobe32(NBD_REQUEST_MAGIC);
+		req.type = htobe32(NBD_CMD_READ);
+		memcpy(req.handle, &index, sizeof(req.handle));
+		req.from = htobe64(rec->from);
+		req.len = htobe32(rec->len);
+		sent_at[i] = stats_now_us();
+		if (!write_all(sv[0], &req, sizeof(req))) {
+			fprintf(stderr, "%s: can't send request: %s\n",
+				program_name, strerror(errno));
+			exit(1);
+		}
+	}
+	pthread_join(receiver, NULL);
+	shutdown(sv[0], SHUT_WR);  /* lets serve() return */
+	pthread_join(server, NULL);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+static void report(double elapsed)
+{
+	static const char *region_names[STATS_REGIONS] = {
+		"reserved", "fat", "dir", "filemap", "literal"
+	};
+	const struct stats_histogram *h;
+
+	printf("%llu reads, %.1f MiB in %.3f s: %.0f reads/s, %.1f MiB/s, "
+		"%llu errors, %llu other requests skipped\n",
+		(unsigned long long) result.reads, result.bytes / 1048576.0,
+		elapsed, result.reads / elapsed,
+		result.bytes / 1048576.0 / elapsed,
+		(unsigned long long) result.errors,
+		(unsigned long long) result.skipped);
+	printf("%-9s %10s %8s %8s %8s %8s\n", "region", "reads",
+		"p50_us", "p90_us", "p99_us", "p999_us");
+	for (int r = -1; r < STATS_REGIONS; r++) {
+		h = r < 0 ? &result.latency : &result.region_latency[r];
+		if (r >= 0 && !stats_count(h, NULL))
+			continue;
+		printf("%-9s %10llu %8lu %8lu %8lu %8lu\n",
+			r < 0 ? "all" : region_names[r],
+			(unsigned long long) stats_count(h, NULL),
+			(unsigned long) stats_percentile(h, NULL, 0.5),
+			(unsigned long) stats_percentile(h, NULL, 0.9),
+			(unsigned long) stats_percentile(h, NULL, 0.99),
+			(unsigned long) stats_percentile(h, NULL, 0.999));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_header hdr;
+	uint64_t start;
+	char *end;
+	int c;
+
+	program_name = argv[0];
+	while ((c = getopt_long(argc, argv, "", options, NULL)) >= 0) {
+		if (c == '?') /* getopt already printed an error msg */
+			exit(2);
+		if (c == 'd') { /* --depth */
+			opt_depth = strtol(optarg, &end, 10);
+			if (*optarg == 0 || *end != 0 || opt_depth < 1) {
+				fprintf(stderr, "%s: bad value for --depth: "
+					"%s\n", program_name, optarg);
+				exit(2);
+			}
+		}
+	}
+	if (opt_help) {
+		usage(stdout);
+		exit(0);
+	}
+	if (argc - optind != 2) {
+		usage(stderr);
+		exit(2);
+	}
+
+	if (!trace_load(argv[optind], &hdr, records)) {
+		fprintf(stderr, "%s: can't load trace %s: %s\n", program_name,
+			argv[optind], strerror(errno));
+		exit(1);
+	}
+	if (!vfat_adjust_size(hdr.sectors, SECTOR_SIZE)) {
+		fprintf(stderr, "%s: bad image size in trace\n", program_name);
+		exit(1);
+	}
+	vfat_init(argv[optind + 1], hdr.free_space, NULL);
+
+	start = stats_now_us();
+	if (opt_socket)
+		replay_socket();
+	else
+		replay_direct();
+	report((stats_now_us() - start) / 1e6);
+	return result.errors != 0;
+}
@@ -27,13 +27,14 @@ Unit tests for %{name}
 %setup -q
 
 %build
-make %{?jobs:-j%jobs} tojblockd
+make %{?jobs:-j%jobs} tojblockd tojblockd-replay
 cd tests
 %qmake5
 make %{?jobs:-j%jobs}
 
 %install
 install -m755 -D tojblockd %{buildroot}/%{_sbindir}/tojblockd
+install -m755 -D tojblockd-replay %{buildroot}/%{_bindir}/tojblockd-replay
 install -m755 -d %{buildroot}/opt/tests/%{name}
 install -m755 tests/*/test-* %{buildroot}/opt/tests/%{name}/
 install -m644 -D tests/tests.xml %{buildroot}/opt/tests/%{name}/test-definition/tests.xml
@@ -42,6 +43,7 @@ install -m644 -D tests/tests.xml %{buildroot}/opt/tests/%{name}/test-definition/
 %defattr(-,root,root,-)
 %doc COPYING
 %{_sbindir}/tojblockd
+%{_bindir}/tojblockd-replay
 
 %files tests
 %defattr(-,root,root,-)
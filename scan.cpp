@@ -0,0 +1,895 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "scan.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#include <linux/io_uring.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+
+/*
+ * Each thread has its own queue of directories to read. A thread
+ * takes work from the back of its own queue, so that it goes depth
+ * first like the sequential walk, and when that is empty it steals
+ * from the front of another thread's queue, where the directories
+ * near the top of the tree are. The subdirectories found in a
+ * directory are queued on the thread that read it.
+ *
+ * scan_lock protects the list of listings and the counters, and
+ * scan_cond is signalled when a listing is done or work is queued.
+ */
+struct scan_thread {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	std::deque<int> todo;
+};
+
+static std::vector<struct scan_dir *> scan_dirs;
+static struct scan_thread *scan_threads;
+static int nr_threads; /* number of queues */
+static int nr_started; /* number of threads to join */
+static dev_t root_dev;
+static bool statx_works = true; /* atomic, set by any scan thread */
+static int ring_entries; /* 0 to look up entries one at a time */
+static bool inode_order = true;
+static bool lazy_files;
+static bool use_cache; /* cache_file is set and can be used */
+static int pending; /* directories queued or being read */
+static int skipped; /* entries left out of the listings */
+static uint64_t stat_calls; /* made directly or through the ring */
+static unsigned long queued_gen; /* bumped when work is queued */
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+
+/* Register a new listing and queue it on thread 't' */
+static int queue_dir(int t, const char *path, int pathlen, const char *name)
+{
+	struct scan_dir *sd = new scan_dir;
+	int namelen = strlen(name);
+	int index;
+
+	sd->path.reserve(pathlen + 1 + namelen + 1);
+	sd->path.insert(sd->path.end(), path, path + pathlen);
+	if (name[0]) {
+		sd->path.push_back('/');
+		sd->path.insert(sd->path.end(), name, name + namelen);
+	}
+	sd->path.push_back(0);
+	sd->done = false;
+	sd->ino = 0;
+	sd->mtime_ns = 0;
+	sd->ctime_ns = 0;
+
+	pthread_mutex_lock(&scan_lock);
+	index = scan_dirs.size();
+	scan_dirs.push_back(sd);
+	pending++;
+	queued_gen++;
+	pthread_mutex_unlock(&scan_lock);
+
+	pthread_mutex_lock(&scan_threads[t].lock);
+	scan_threads[t].todo.push_back(index);
+	pthread_mutex_unlock(&scan_threads[t].lock);
+	return index;
+}
+
+/*
+ * A minimal io_uring, used to have the kernel look up all the entries
+ * of a directory at once instead of one after another. Each scanner
+ * thread has its own. There's no liburing on the target, so this
+ * talks to the kernel directly.
+ */
+struct scan_ring {
+	int fd;
+	unsigned entries;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+};
+
+/* Result: false if io_uring isn't available */
+static bool ring_init(struct scan_ring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return false;
+	ring->entries = p.sq_entries;
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_len = p.cq_off.cqes
+		+ p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = 0;
+	}
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto fail;
+	if (ring->cq_len) {
+		ring->cq_ptr = mmap(NULL, ring->cq_len,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+			goto fail_sq;
+	} else {
+		ring->cq_ptr = ring->sq_ptr;
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_len,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	sq = (char *) ring->sq_ptr;
+	cq = (char *) ring->cq_ptr;
+	ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+	ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return true;
+
+fail_cq:
+	if (ring->cq_len)
+		munmap(ring->cq_ptr, ring->cq_len);
+fail_sq:
+	munmap(ring->sq_ptr, ring->sq_len);
+fail:
+	close(ring->fd);
+	ring->fd = -1;
+	return false;
+}
+
+static void ring_exit(struct scan_ring *ring)
+{
+	if (ring->fd < 0)
+		return;
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_len)
+		munmap(ring->cq_ptr, ring->cq_len);
+	munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+#define STATX_FLAGS (AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT \
+	| AT_STATX_DONT_SYNC)
+#define STATX_FIELDS (STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_ATIME)
+
+/*
+ * statx the 'count' 'names' in 'dirfd' through the ring, at most
+ * ring->entries at a time. The names have to stay put until this
+ * returns. results[i] is 0 or a negative errno for stx[i].
+ * Result: false if the ring stopped working.
+ */
+static bool ring_statx(struct scan_ring *ring, int dirfd,
+	const char * const *names, int count,
+	struct statx *stx, int *results)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned tail, head, idx;
+	int batch, submitted, done;
+	long ret;
+
+	for (int first = 0; first < count; first += batch) {
+		batch = count - first;
+		if ((unsigned) batch > ring->entries)
+			batch = ring->entries;
+		__atomic_fetch_add(&stat_calls, batch, __ATOMIC_RELAXED);
+
+		tail = *ring->sq_tail;
+		for (int i = first; i < first + batch; i++) {
+			idx = tail & *ring->sq_mask;
+			sqe = &ring->sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = dirfd;
+			sqe->addr = (uintptr_t) names[i];
+			sqe->len = STATX_FIELDS;
+			sqe->off = (uintptr_t) &stx[i];
+			sqe->statx_flags = STATX_FLAGS;
+			sqe->user_data = i;
+			ring->sq_array[idx] = idx;
+			tail++;
+		}
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+		/* The kernel can take fewer entries than it's given, and
+		 * then gets the rest from the queue on the next call.
+		 * Only wait for what it has taken. */
+		for (submitted = 0, done = 0; done < batch; ) {
+			ret = syscall(__NR_io_uring_enter, ring->fd,
+				batch - submitted, submitted > done ? 1 : 0,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+			if (ret > 0) {
+				submitted += ret;
+			} else if (ret == 0) {
+				if (submitted == done && submitted < batch)
+					return false;
+			} else if (errno != EINTR && !((errno == EAGAIN
+					|| errno == EBUSY) && submitted > done)) {
+				return false;
+			}
+			head = *ring->cq_head;
+			while (head != __atomic_load_n(ring->cq_tail,
+					__ATOMIC_ACQUIRE)) {
+				cqe = &ring->cqes[head & *ring->cq_mask];
+				results[cqe->user_data] = cqe->res;
+				head++;
+				done++;
+			}
+			__atomic_store_n(ring->cq_head, head,
+				__ATOMIC_RELEASE);
+		}
+	}
+	return true;
+}
+
+/* Result: false if it's not something FAT can represent */
+static bool entry_from_statx(const struct statx *stx, struct scan_entry *se,
+	bool *same_dev)
+{
+	if (S_ISREG(stx->stx_mode))
+		se->type = SCAN_FILE;
+	else if (S_ISDIR(stx->stx_mode))
+		se->type = SCAN_DIR;
+	else
+		return false;
+	se->size = stx->stx_size;
+	se->mtime = stx->stx_mtime.tv_sec;
+	se->atime = stx->stx_atime.tv_sec;
+	*same_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor)
+		== root_dev;
+	return true;
+}
+
+/*
+ * Get the type, size and times of 'name' in the directory 'dirfd'.
+ * statx lets the filesystem skip the fields that aren't asked for,
+ * and not revalidate them with a server.
+ * Result: false if it couldn't be looked up.
+ */
+static bool stat_entry(int dirfd, const char *name, struct scan_entry *se,
+	bool *same_dev)
+{
+	struct statx stx;
+	struct stat st;
+
+	__atomic_fetch_add(&stat_calls, 1, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&statx_works, __ATOMIC_RELAXED)) {
+		if (statx(dirfd, name, STATX_FLAGS, STATX_FIELDS, &stx) == 0)
+			return entry_from_statx(&stx, se, same_dev);
+		if (errno != ENOSYS)
+			return false;
+		/* kernel is older than 4.11 */
+		__atomic_store_n(&statx_works, false, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stat_calls, 1, __ATOMIC_RELAXED);
+	}
+
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		return false;
+	if (S_ISREG(st.st_mode))
+		se->type = SCAN_FILE;
+	else if (S_ISDIR(st.st_mode))
+		se->type = SCAN_DIR;
+	else
+		return false;
+	se->size = st.st_size;
+	se->mtime = st.st_mtime;
+	se->atime = st.st_atime;
+	*same_dev = st.st_dev == root_dev;
+	return true;
+}
+
+/*
+ * The scan cache remembers the listing of every directory together
+ * with the directory's inode number, mtime and ctime. Adding, removing
+ * or renaming an entry changes the mtime and ctime of its directory,
+ * so a directory that still matches can be listed from the cache
+ * without reading it.
+ *
+ * A directory that was changed shortly before or during the scan may
+ * change again without its times moving on filesystems with coarse
+ * timestamps, so those aren't cached.
+ *
+ * Changes to a file's contents don't touch its directory, so the
+ * entries of a cached listing are still looked up, in one ring batch
+ * per directory if there is a ring.
+ */
+struct cached_dir {
+	std::string path;
+	uint64_t ino;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	std::vector<struct scan_entry> entries; /* subdir >= 0 if read */
+	std::vector<char> names;
+};
+
+struct cached_dir_less {
+	bool operator()(const struct cached_dir *a,
+		const std::string &path) const
+	{
+		return a->path < path;
+	}
+	bool operator()(const struct cached_dir *a,
+		const struct cached_dir *b) const
+	{
+		return a->path < b->path;
+	}
+};
+
+static const char *cache_file;
+static int64_t started_ns; /* wall clock time of scan_start */
+static std::vector<struct cached_dir *> cached_dirs; /* sorted by path */
+
+#define CACHE_MAGIC "tojblockd scan cache 1\n"
+
+struct cache_header {
+	char magic[sizeof(CACHE_MAGIC)];
+	uint32_t entry_size; /* sizeof(struct scan_entry) */
+	uint32_t nr_dirs;
+};
+
+struct cache_dir_header {
+	uint64_t ino;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	uint32_t path_len;
+	uint32_t nr_entries;
+	uint32_t names_len;
+};
+
+/* Record the inode number and times of the directory open at 'fd' */
+static void identify_dir(int fd, struct scan_dir *sd)
+{
+	struct statx stx;
+	struct stat st;
+
+	__atomic_fetch_add(&stat_calls, 1, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&statx_works, __ATOMIC_RELAXED)
+			&& statx(fd, "", AT_EMPTY_PATH,
+			STATX_INO | STATX_MTIME | STATX_CTIME, &stx) == 0) {
+		sd->ino = stx.stx_ino;
+		sd->mtime_ns = stx.stx_mtime.tv_sec * 1000000000LL
+			+ stx.stx_mtime.tv_nsec;
+		sd->ctime_ns = stx.stx_ctime.tv_sec * 1000000000LL
+			+ stx.stx_ctime.tv_nsec;
+	} else if (fstat(fd, &st) == 0) {
+		sd->ino = st.st_ino;
+		sd->mtime_ns = st.st_mtim.tv_sec * 1000000000LL
+			+ st.st_mtim.tv_nsec;
+		sd->ctime_ns = st.st_ctim.tv_sec * 1000000000LL
+			+ st.st_ctim.tv_nsec;
+	}
+}
+
+/*
+ * If the directory of 'sd' hasn't changed since it was cached, add the
+ * names of its cached entries to 'names', with their offsets and
+ * d_types, as if they had been read from the directory.
+ * Result: true if it was cached.
+ */
+static bool reuse_cached(const struct scan_dir *sd, std::vector<char> *names,
+	std::vector<uint32_t> *offsets, std::vector<uint8_t> *types)
+{
+	std::vector<struct cached_dir *>::iterator it;
+	const struct cached_dir *cd;
+	const char *name;
+	std::string path(&sd->path[0]);
+
+	if (sd->ino == 0)
+		return false;
+	it = std::lower_bound(cached_dirs.begin(), cached_dirs.end(), path,
+		cached_dir_less());
+	if (it == cached_dirs.end() || (*it)->path != path)
+		return false;
+	cd = *it;
+	if (cd->ino != sd->ino || cd->mtime_ns != sd->mtime_ns
+			|| cd->ctime_ns != sd->ctime_ns)
+		return false;
+
+	for (size_t i = 0; i < cd->entries.size(); i++) {
+		name = &cd->names[cd->entries[i].name_offset];
+		offsets->push_back(names->size());
+		types->push_back(cd->entries[i].type == SCAN_DIR
+			? DT_DIR : DT_REG);
+		names->insert(names->end(), name, name + strlen(name) + 1);
+	}
+	return true;
+}
+
+static void free_cache()
+{
+	for (size_t i = 0; i < cached_dirs.size(); i++)
+		delete cached_dirs[i];
+	cached_dirs.clear();
+}
+
+/* Result: false if the file is missing, unreadable or doesn't
+ * match this build. The cache is left empty then. */
+static bool load_cache(const char *filename)
+{
+	struct cache_header h;
+	struct cache_dir_header dh;
+	struct cached_dir *cd;
+	FILE *f = fopen(filename, "r");
+
+	if (!f)
+		return false;
+	if (fread(&h, sizeof(h), 1, f) != 1
+			|| memcmp(h.magic, CACHE_MAGIC, sizeof(h.magic))
+			|| h.entry_size != sizeof(struct scan_entry))
+		goto fail;
+
+	for (uint32_t i = 0; i < h.nr_dirs; i++) {
+		if (fread(&dh, sizeof(dh), 1, f) != 1
+				|| dh.path_len == 0 || dh.path_len > PATH_MAX)
+			goto fail;
+		cd = new cached_dir;
+		cached_dirs.push_back(cd);
+		cd->ino = dh.ino;
+		cd->mtime_ns = dh.mtime_ns;
+		cd->ctime_ns = dh.ctime_ns;
+		cd->path.resize(dh.path_len);
+		cd->entries.resize(dh.nr_entries);
+		cd->names.resize(dh.names_len);
+		if (fread(&cd->path[0], dh.path_len, 1, f) != 1)
+			goto fail;
+		if (dh.nr_entries && fread(&cd->entries[0],
+				sizeof(struct scan_entry), dh.nr_entries, f)
+				!= dh.nr_entries)
+			goto fail;
+		if (dh.names_len && fread(&cd->names[0], dh.names_len, 1, f)
+				!= 1)
+			goto fail;
+		/* the names have to be in bounds and terminated */
+		if (dh.nr_entries && (dh.names_len == 0
+				|| cd->names[dh.names_len - 1] != 0))
+			goto fail;
+		for (uint32_t e = 0; e < dh.nr_entries; e++) {
+			if (cd->entries[e].name_offset >= dh.names_len)
+				goto fail;
+		}
+	}
+	fclose(f);
+	std::sort(cached_dirs.begin(), cached_dirs.end(), cached_dir_less());
+	return true;
+
+fail:
+	fclose(f);
+	free_cache();
+	return false;
+}
+
+static bool cacheable(const struct scan_dir *sd)
+{
+	int64_t racy_ns = started_ns - 2000000000LL;
+
+	return sd->done && sd->ino && sd->mtime_ns < racy_ns
+		&& sd->ctime_ns < racy_ns;
+}
+
+/* Write all listings to the cache file, replacing it atomically */
+static void save_cache(const char *filename)
+{
+	struct cache_header h;
+	struct cache_dir_header dh;
+	struct scan_dir *sd;
+	std::string tmpname(filename);
+	FILE *f;
+	bool ok;
+
+	tmpname += ".new";
+	f = fopen(tmpname.c_str(), "w");
+	if (!f) {
+		perror(tmpname.c_str());
+		return;
+	}
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+	h.entry_size = sizeof(struct scan_entry);
+	for (size_t i = 0; i < scan_dirs.size(); i++) {
+		if (cacheable(scan_dirs[i]))
+			h.nr_dirs++;
+	}
+	ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+	for (size_t i = 0; ok && i < scan_dirs.size(); i++) {
+		sd = scan_dirs[i];
+		if (!cacheable(sd))
+			continue;
+		memset(&dh, 0, sizeof(dh));
+		dh.ino = sd->ino;
+		dh.mtime_ns = sd->mtime_ns;
+		dh.ctime_ns = sd->ctime_ns;
+		dh.path_len = sd->path.size() - 1;
+		dh.nr_entries = sd->entries.size();
+		dh.names_len = sd->names.size();
+		ok = fwrite(&dh, sizeof(dh), 1, f) == 1
+			&& fwrite(&sd->path[0], dh.path_len, 1, f) == 1;
+		if (ok && dh.nr_entries)
+			ok = fwrite(&sd->entries[0], sizeof(struct scan_entry),
+				dh.nr_entries, f) == dh.nr_entries;
+		if (ok && dh.names_len)
+			ok = fwrite(&sd->names[0], dh.names_len, 1, f) == 1;
+	}
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok || rename(tmpname.c_str(), filename) < 0) {
+		perror(filename);
+		unlink(tmpname.c_str());
+	}
+}
+
+/* The result of looking up one directory entry */
+struct lookup {
+	struct scan_entry se;
+	bool found;
+	bool same_dev;
+};
+
+struct ino_less {
+	const std::vector<ino64_t> &inos;
+	ino_less(const std::vector<ino64_t> &i) : inos(i) { }
+	bool operator()(uint32_t a, uint32_t b) const
+	{
+		return inos[a] < inos[b];
+	}
+};
+
+static void read_dir(int t, int index, struct scan_ring *ring)
+{
+	struct scan_dir *sd;
+	struct scan_entry *se;
+	struct dirent64 *de;
+	char buf[32768];
+	std::vector<char> names;
+	std::vector<uint32_t> offsets;
+	std::vector<ino64_t> inos;
+	std::vector<uint8_t> types; /* d_type */
+	std::vector<uint32_t> order;
+	std::vector<const char *> name_ptrs;
+	std::vector<struct statx> stx;
+	std::vector<int> results;
+	std::vector<struct lookup> lookups;
+	const char *name;
+	ssize_t len;
+	size_t count;
+	int namelen;
+	int nskipped = 0;
+	bool cached = false;
+	int fd;
+
+	pthread_mutex_lock(&scan_lock);
+	sd = scan_dirs[index];
+	pthread_mutex_unlock(&scan_lock);
+
+	/* getdents64 straight into a buffer instead of going through
+	 * readdir, and look up entries relative to the directory's fd
+	 * so that no paths have to be built for them. */
+	fd = open(&sd->path[0], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0 && use_cache) {
+		identify_dir(fd, sd);
+		cached = reuse_cached(sd, &names, &offsets, &types);
+		/* the inode numbers aren't cached */
+		inos.assign(offsets.size(), 0);
+	}
+	while (fd >= 0 && !cached
+			&& (len = getdents64(fd, buf, sizeof(buf))) > 0) {
+		for (ssize_t pos = 0; pos < len; pos += de->d_reclen) {
+			de = (struct dirent64 *) (buf + pos);
+			/* the type in the dirent is enough to skip
+			 * symlinks, devices and the like without
+			 * a lookup */
+			if (!strcmp(de->d_name, ".")
+					|| !strcmp(de->d_name, ".."))
+				continue;
+			if (de->d_type != DT_REG && de->d_type != DT_DIR
+					&& de->d_type != DT_UNKNOWN) {
+				nskipped++;
+				continue;
+			}
+			namelen = strlen(de->d_name);
+			offsets.push_back(names.size());
+			inos.push_back(de->d_ino);
+			types.push_back(de->d_type);
+			names.insert(names.end(), de->d_name,
+				de->d_name + namelen + 1);
+		}
+	}
+	count = offsets.size();
+	lookups.resize(count);
+
+	/* readdir order is hash order on most filesystems, which jumps
+	 * all over the inode table. Looking the entries up in inode
+	 * order lets cold storage read the table front to back. */
+	for (size_t i = 0; i < count; i++) {
+		if (lazy_files && types[i] == DT_REG) {
+			/* listed without a lookup */
+			lookups[i].se.type = SCAN_FILE;
+			lookups[i].se.size = -1;
+			lookups[i].se.mtime = 0;
+			lookups[i].se.atime = 0;
+			lookups[i].found = true;
+			lookups[i].same_dev = true;
+		} else {
+			order.push_back(i);
+		}
+	}
+	if (inode_order)
+		std::stable_sort(order.begin(), order.end(), ino_less(inos));
+
+	/* Look them all up at once if there's a ring, so that slow
+	 * storage gets a full queue. Otherwise look them up one by one.
+	 * stx and results are in lookup order. */
+	results.assign(order.size(), -ENOSYS);
+	if (ring->fd >= 0 && __atomic_load_n(&statx_works, __ATOMIC_RELAXED)
+			&& order.size() > 1) {
+		name_ptrs.resize(order.size());
+		for (size_t k = 0; k < order.size(); k++)
+			name_ptrs[k] = &names[offsets[order[k]]];
+		stx.resize(order.size());
+		if (!ring_statx(ring, fd, &name_ptrs[0], order.size(),
+				&stx[0], &results[0])) {
+			ring_exit(ring);
+			results.assign(order.size(), -ENOSYS);
+		}
+	}
+	for (size_t k = 0; k < order.size(); k++) {
+		struct lookup *l = &lookups[order[k]];
+		name = &names[offsets[order[k]]];
+		if (results[k] == 0)
+			l->found = entry_from_statx(&stx[k], &l->se,
+				&l->same_dev);
+		else if (results[k] == -ENOSYS || results[k] == -EINVAL)
+			/* no ring, or a kernel without IORING_OP_STATX */
+			l->found = stat_entry(fd, name, &l->se, &l->same_dev);
+		else
+			l->found = false;
+	}
+
+	/* add them in readdir order, however they were looked up */
+	for (size_t i = 0; i < count; i++) {
+		if (!lookups[i].found) {
+			nskipped++;
+			continue;
+		}
+		se = &lookups[i].se;
+		name = &names[offsets[i]];
+		namelen = strlen(name);
+		se->name_offset = sd->names.size();
+		sd->names.insert(sd->names.end(), name, name + namelen + 1);
+		se->subdir = -1;
+		if (se->type == SCAN_DIR && lookups[i].same_dev) {
+			se->subdir = queue_dir(t, &sd->path[0],
+				sd->path.size() - 1, name);
+		}
+		sd->entries.push_back(*se);
+	}
+	if (fd >= 0)
+		close(fd);
+
+	pthread_mutex_lock(&scan_lock);
+	sd->done = true;
+	pending--;
+	skipped += nskipped;
+	pthread_cond_broadcast(&scan_cond);
+	pthread_mutex_unlock(&scan_lock);
+}
+
+/* Result: a directory index, or -1 if there's no work anywhere */
+static int next_dir(int t)
+{
+	struct scan_thread *st;
+	int index = -1;
+
+	st = &scan_threads[t];
+	pthread_mutex_lock(&st->lock);
+	if (!st->todo.empty()) {
+		index = st->todo.back();
+		st->todo.pop_back();
+	}
+	pthread_mutex_unlock(&st->lock);
+
+	for (int i = 1; index < 0 && i < nr_threads; i++) {
+		st = &scan_threads[(t + i) % nr_threads];
+		pthread_mutex_lock(&st->lock);
+		if (!st->todo.empty()) {
+			index = st->todo.front();
+			st->todo.pop_front();
+		}
+		pthread_mutex_unlock(&st->lock);
+	}
+	return index;
+}
+
+static void *scan_thread_main(void *arg)
+{
+	int t = (long) arg;
+	struct scan_ring ring;
+	unsigned long gen;
+	int index;
+
+	ring.fd = -1;
+	if (ring_entries > 0)
+		ring_init(&ring, ring_entries);
+
+	for (;;) {
+		pthread_mutex_lock(&scan_lock);
+		gen = queued_gen;
+		pthread_mutex_unlock(&scan_lock);
+
+		index = next_dir(t);
+		if (index >= 0) {
+			read_dir(t, index, &ring);
+			continue;
+		}
+
+		/* Nothing to steal. Wait for more work unless
+		 * everything is done. */
+		pthread_mutex_lock(&scan_lock);
+		while (pending > 0 && gen == queued_gen)
+			pthread_cond_wait(&scan_cond, &scan_lock);
+		if (pending == 0) {
+			pthread_mutex_unlock(&scan_lock);
+			break;
+		}
+		pthread_mutex_unlock(&scan_lock);
+	}
+	ring_exit(&ring);
+	return NULL;
+}
+
+bool scan_start(const char *root, int threads, int batch,
+	struct stat *root_st)
+{
+	__atomic_store_n(&stat_calls, 1, __ATOMIC_RELAXED);
+	if (lstat(root, root_st) < 0 || !S_ISDIR(root_st->st_mode))
+		return false;
+	root_dev = root_st->st_dev;
+
+	nr_threads = threads > 0 ? threads : 1;
+	ring_entries = batch;
+	/* listings without the file sizes can't be cached */
+	use_cache = cache_file && !lazy_files;
+	if (use_cache) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		started_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+		load_cache(cache_file);
+	}
+	scan_threads = new scan_thread[nr_threads];
+	for (int t = 0; t < nr_threads; t++)
+		pthread_mutex_init(&scan_threads[t].lock, NULL);
+	queue_dir(0, root, strlen(root), "");
+
+	for (nr_started = 0; nr_started < nr_threads; nr_started++) {
+		if (pthread_create(&scan_threads[nr_started].thread, NULL,
+				scan_thread_main, (void *) (long) nr_started))
+			break;
+	}
+	/* The threads that did start will steal the work of the others,
+	 * but if there are none then do it here. */
+	if (nr_started == 0)
+		scan_thread_main((void *) 0L);
+	return true;
+}
+
+const struct scan_dir *scan_wait(int index)
+{
+	struct scan_dir *sd;
+
+	pthread_mutex_lock(&scan_lock);
+	sd = scan_dirs[index];
+	while (!sd->done)
+		pthread_cond_wait(&scan_cond, &scan_lock);
+	pthread_mutex_unlock(&scan_lock);
+	return sd;
+}
+
+void scan_release(int index)
+{
+	struct scan_dir *sd;
+
+	/* keep them all for save_cache() */
+	if (use_cache)
+		return;
+	pthread_mutex_lock(&scan_lock);
+	sd = scan_dirs[index];
+	scan_dirs[index] = NULL;
+	pthread_mutex_unlock(&scan_lock);
+	delete sd;
+}
+
+void scan_finish()
+{
+	for (int t = 0; t < nr_started; t++)
+		pthread_join(scan_threads[t].thread, NULL);
+	for (int t = 0; t < nr_threads; t++)
+		pthread_mutex_destroy(&scan_threads[t].lock);
+	delete[] scan_threads;
+	scan_threads = NULL;
+	nr_threads = 0;
+	nr_started = 0;
+	if (use_cache && !scan_dirs.empty())
+		save_cache(cache_file);
+	free_cache();
+	for (size_t i = 0; i < scan_dirs.size(); i++)
+		delete scan_dirs[i];
+	scan_dirs.clear();
+	pending = 0;
+	skipped = 0;
+}
+
+void scan_progress(int *found, int *nskipped)
+{
+	pthread_mutex_lock(&scan_lock);
+	*found = scan_dirs.size();
+	*nskipped = skipped;
+	pthread_mutex_unlock(&scan_lock);
+}
+
+uint64_t scan_stat_calls()
+{
+	return __atomic_load_n(&stat_calls, __ATOMIC_RELAXED);
+}
+
+void scan_set_inode_order(bool on)
+{
+	inode_order = on;
+}
+
+void scan_set_cache(const char *filename)
+{
+	cache_file = filename;
+}
+
+void scan_set_lazy_files(bool on)
+{
+	lazy_files = on;
+}
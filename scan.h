@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * This file is the interface to the parallel directory scanner.
+ * It reads a directory tree with a pool of threads and keeps the
+ * listings, so that the caller can add them to the image in the
+ * same order as a sequential walk would.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/types.h>
+
+#include <vector>
+
+enum scan_type {
+	SCAN_FILE,  /* regular file */
+	SCAN_DIR,
+};
+
+struct scan_entry {
+	uint32_t name_offset; /* in the names of the scan_dir */
+	uint8_t type; /* enum scan_type */
+	off_t size; /* -1 if the file wasn't looked up */
+	time_t mtime;
+	time_t atime;
+	int subdir; /* listing of a SCAN_DIR, or -1 if it wasn't read */
+};
+
+struct scan_dir {
+	std::vector<char> path; /* nul-terminated */
+	/* Regular files and directories, in the order readdir()
+	 * returned them. Everything else is left out. */
+	std::vector<struct scan_entry> entries;
+	std::vector<char> names; /* nul-terminated strings */
+	bool done; /* the listing is complete */
+	/* the directory when it was read, or 0 if it couldn't be */
+	uint64_t ino;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+};
+
+/* Start scanning the tree at 'root' with 'threads' threads.
+ * Each thread has up to 'batch' lookups in flight with io_uring,
+ * or does them one at a time if 'batch' is 0 or io_uring isn't
+ * available. Directories on other filesystems and unreadable
+ * directories are listed as empty. The listing of the root has index 0.
+ * Result: false if 'root' isn't a directory, with *root_st set
+ * otherwise. */
+bool scan_start(const char *root, int threads, int batch,
+	struct stat *root_st);
+
+/* Wait until the listing with 'index' is complete and return it */
+const struct scan_dir *scan_wait(int index);
+
+/* Free a listing that is no longer needed */
+void scan_release(int index);
+
+/* Wait for the threads to finish and free everything */
+void scan_finish();
+
+/* Report how far the scan is: 'found' is the number of directories
+ * found so far, read or not, and 'skipped' the number of entries that
+ * were left out because they are neither files nor directories or
+ * couldn't be looked up. */
+void scan_progress(int *found, int *skipped);
+
+/* Result: the number of stat calls made since scan_start, whether
+ * directly or through io_uring, including the one for the root */
+uint64_t scan_stat_calls();
+
+/* Look up a directory's entries in inode order (the default) or in
+ * readdir order. The listings are in readdir order either way. */
+void scan_set_inode_order(bool on);
+
+/* Keep the listings in 'filename' between runs, and list directories
+ * that haven't changed since from there. NULL (the default) to always
+ * read everything. The file is read by scan_start and written by
+ * scan_finish. */
+void scan_set_cache(const char *filename);
+
+/* List regular files without looking them up, if the directory
+ * says what type they are. Their size is -1 and their times are 0.
+ * This is for lazy scanning. Listings made this way aren't cached. */
+void scan_set_lazy_files(bool on);
@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "serve.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <map>
+
+#include "nbd.h"
+#include "vfat.h"
+#include "filemap.h"
+#include "worker.h"
+#include "stats.h"
+#include "trace.h"
+#include "sd_notify.h"
+
+static bool debug_enabled;
+
+/* Result: 0 for success, -1 at end of file, or errno */
+static int read_buf(int sock_fd, void *buf, size_t size)
+{
+	size_t total = 0;
+	ssize_t nread;
+
+	do {
+		nread = read(sock_fd, (char *) buf + total, size - total);
+		if (nread < 0 && errno == EINTR)
+			continue;
+		if (nread < 0)
+			return errno;
+		if (nread == 0)
+			return -1;
+		total += nread;
+	} while (size > total);
+	return 0;
+}
+
+/* Read and drop 'size' bytes.
+ * Result: 0 for success, -1 at end of file, or errno */
+static int skip_buf(int sock_fd, size_t size)
+{
+	char buf[65536];
+	size_t n;
+	int err;
+
+	while (size > 0) {
+		n = size < sizeof(buf) ? size : sizeof(buf);
+		err = read_buf(sock_fd, buf, n);
+		if (err)
+			return err;
+		size -= n;
+	}
+	return 0;
+}
+
+/* Result: 0 for success or errno */
+static int write_buf(int sock_fd, void *buf, size_t size)
+{
+	size_t total = 0;
+	ssize_t nsent;
+
+	do {
+		nsent = write(sock_fd, (char *) buf + total, size - total);
+		if (nsent < 0 && errno == EINTR)
+			continue;
+		if (nsent < 0)
+			return errno;
+		total += nsent;
+	} while (size > total);
+	return 0;
+}
+
+/* Replies come from both the serve loop and the I/O workers.
+ * After a failed reply the socket is useless, so reply_error stops
+ * the others and tells the serve loop to give up. */
+static pthread_mutex_t reply_lock = PTHREAD_MUTEX_INITIALIZER;
+static int reply_error;
+
+static void send_reply(int sock_fd, const char *handle, int error,
+	void *buf, size_t len)
+{
+	struct nbd_reply reply;
+	int err;
+
+	reply.magic = htobe32(NBD_REPLY_MAGIC);
+	reply.error = htobe32(error);
+	memcpy(reply.handle, handle, sizeof(reply.handle));
+	pthread_mutex_lock(&reply_lock);
+	err = reply_error;
+	if (!err)
+		err = write_buf(sock_fd, &reply, sizeof(reply));
+	if (!err && !error && len)
+		err = write_buf(sock_fd, buf, len);
+	__atomic_store_n(&reply_error, err, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&reply_lock);
+}
+
+/*
+ * Reads are first tried without blocking, which works when the data
+ * is in the page cache. The ones that would have to wait for the disk
+ * are queued for the I/O workers, so that the serve loop can go on
+ * answering cached reads in the meantime. The nbd protocol matches
+ * replies to requests by handle, so they may come back in a different
+ * order.
+ */
+static int reply_fd;
+
+/* Read latencies in microseconds, from request to reply */
+static struct stats_histogram read_latency;
+
+/* When the reads queued for the workers came in, by handle */
+static std::map<uint64_t, uint64_t> queued_since;
+static pthread_mutex_t queued_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t handle_key(const char *handle)
+{
+	uint64_t key;
+
+	memcpy(&key, handle, sizeof(key));
+	return key;
+}
+
+static void worker_reply(const char *handle, int error, void *buf,
+	uint32_t len)
+{
+	std::map<uint64_t, uint64_t>::iterator it;
+	uint64_t start = 0;
+
+	pthread_mutex_lock(&queued_lock);
+	it = queued_since.find(handle_key(handle));
+	if (it != queued_since.end()) {
+		start = it->second;
+		queued_since.erase(it);
+	}
+	pthread_mutex_unlock(&queued_lock);
+	send_reply(reply_fd, handle, error, buf, len);
+	if (start)
+		stats_record(&read_latency, stats_now_us() - start);
+}
+
+/* Reads answered from the page cache, and reads passed to the workers */
+static uint64_t nowait_hits, nowait_misses;
+/* Bytes asked for by all the reads */
+static uint64_t read_bytes;
+
+/* Say how the reads are going, at most once a second. The rates and
+ * the latency are for the time since the last update. The serve loop
+ * calls this after each read and every STATUS_IDLE_MS while idle. */
+#define STATUS_IDLE_MS 1000
+
+static void update_status()
+{
+	static uint64_t last, last_reads, last_bytes;
+	static struct stats_histogram last_latency;
+	uint64_t now = stats_now_us();
+	uint64_t reads = nowait_hits + nowait_misses;
+	double secs;
+
+	if (now < last + 1000000)
+		return;
+	if (!last) {
+		/* start counting from the first read */
+		last = now;
+		return;
+	}
+	secs = (now - last) / 1e6;
+	sd_notifyf(0, "STATUS=ready, %.0f reads/s, %.1f MiB/s, "
+		"p99 latency %lu us, %llu reads from cache, "
+		"%llu waited for disk",
+		(reads - last_reads) / secs,
+		(read_bytes - last_bytes) / secs / (1 << 20),
+		(unsigned long) stats_percentile(&read_latency,
+			&last_latency, 0.99),
+		(unsigned long long) nowait_hits,
+		(unsigned long long) nowait_misses);
+	last = now;
+	last_reads = reads;
+	last_bytes = read_bytes;
+	stats_snapshot(&read_latency, &last_latency);
+}
+
+void serve_set_debug(bool enable)
+{
+	debug_enabled = enable;
+}
+
+int serve(int sock_fd, uint32_t deadline_ms)
+{
+	struct nbd_request req;
+	struct pollfd pfd;
+	uint64_t start;
+	void *buf;
+	int region;
+	int err;
+
+	reply_fd = sock_fd;
+	if (!worker_init(vfat_fill, worker_reply, vfat_path, deadline_ms))
+		return EAGAIN;
+	filemap_set_nowait(true);
+
+	for (;;) {
+		/* keep the status current, and the trace written out,
+		 * while no requests come in */
+		pfd.fd = sock_fd;
+		pfd.events = POLLIN;
+		while (poll(&pfd, 1, STATUS_IDLE_MS) == 0) {
+			update_status();
+			trace_flush();
+		}
+
+		err = read_buf(sock_fd, &req, sizeof(req));
+		if (err)
+			return err < 0 ? 0 : err;
+		req.magic = be32toh(req.magic);
+		req.type = be32toh(req.type);
+		req.from = be64toh(req.from);
+		req.len = be32toh(req.len);
+
+		if (req.magic != NBD_REQUEST_MAGIC) {
+			fprintf(stderr, "bad request magic: 0x%lx\n",
+				(unsigned long) req.magic);
+			return EPROTO;
+		}
+
+		if (trace_recording()) {
+			region = vfat_region(req.from);
+			trace_add(req.type, req.from, req.len, region < 0
+				? TRACE_REGION_UNKNOWN : region);
+		}
+
+		switch (req.type) {
+		case NBD_CMD_READ:
+			if (debug_enabled)
+				fprintf(stderr, "READ %lu bytes starting 0x%llx\n",
+					(unsigned long) req.len,
+					(unsigned long long) req.from);
+			start = stats_now_us();
+			read_bytes += req.len;
+			buf = malloc(req.len);
+			err = buf ? vfat_fill(buf, req.from, req.len) : ENOMEM;
+			if (err == EAGAIN) {
+				nowait_misses++;
+				pthread_mutex_lock(&queued_lock);
+				queued_since[handle_key(req.handle)] = start;
+				pthread_mutex_unlock(&queued_lock);
+				worker_queue(req.handle, req.from, req.len, buf);
+			} else {
+				nowait_hits++;
+				send_reply(sock_fd, req.handle, err, buf, req.len);
+				free(buf);
+				stats_record(&read_latency,
+					stats_now_us() - start);
+			}
+			update_status();
+			break;
+		case NBD_CMD_WRITE:
+			if (debug_enabled)
+				fprintf(stderr, "WRITE %lu bytes starting 0x%llx\n",
+					(unsigned long) req.len,
+					(unsigned long long) req.from);
+			err = skip_buf(sock_fd, req.len);
+			if (err)
+				return err < 0 ? 0 : err;
+			send_reply(sock_fd, req.handle, EROFS, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "COMMAND %u\n", (unsigned) req.type);
+			send_reply(sock_fd, req.handle, EINVAL, NULL, 0);
+			break;
+		}
+		err = __atomic_load_n(&reply_error, __ATOMIC_RELAXED);
+		if (err)
+			return err;
+	}
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * This file is the interface to the nbd server loop, which answers
+ * the requests for the image that come in over a socket. tojblockd
+ * serves the kernel's nbd driver with it, and tojblockd-replay
+ * serves recorded requests.
+ */
+
+#include <stdint.h>
+
+/* Log every request to stderr */
+void serve_set_debug(bool enable);
+
+/* Answer requests from 'sock_fd' until the other end closes it.
+ * Reads that have to wait for storage are passed to the I/O workers,
+ * which fail them with EIO after 'deadline_ms' (0 for no deadline).
+ * If trace_create() was called, the requests are recorded.
+ * Result: 0 when the socket was closed, or an errno value. */
+int serve(int sock_fd, uint32_t deadline_ms);
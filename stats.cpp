@@ -0,0 +1,452 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <vector>
+
+/* Each power of two is split in 1 << SUB_BITS buckets */
+#define SUB_BITS 2
+
+uint64_t stats_now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int stats_bucket(uint32_t value)
+{
+	int msb;
+
+	if (value < (1 << SUB_BITS))
+		return value;
+	msb = 31 - __builtin_clz(value);
+	return ((msb - SUB_BITS + 1) << SUB_BITS)
+		+ ((value >> (msb - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+}
+
+uint32_t stats_bucket_limit(int bucket)
+{
+	int msb = (bucket >> SUB_BITS) + SUB_BITS - 1;
+	int sub = bucket & ((1 << SUB_BITS) - 1);
+	uint64_t first;
+
+	if (bucket < (1 << SUB_BITS))
+		return bucket;
+	first = (uint64_t) ((1 << SUB_BITS) + sub) << (msb - SUB_BITS);
+	return first + ((uint64_t) 1 << (msb - SUB_BITS)) - 1;
+}
+
+void stats_record(struct stats_histogram *h, uint32_t value)
+{
+	__atomic_fetch_add(&h->counts[stats_bucket(value)], 1,
+		__ATOMIC_RELAXED);
+}
+
+void stats_snapshot(const struct stats_histogram *h,
+	struct stats_histogram *out)
+{
+	for (int i = 0; i < STATS_BUCKETS; i++)
+		out->counts[i] = __atomic_load_n(&h->counts[i],
+			__ATOMIC_RELAXED);
+}
+
+/* The count in bucket 'i' of 'h' since 'since' */
+static uint64_t bucket_count(const struct stats_histogram *h,
+	const struct stats_histogram *since, int i)
+{
+	uint64_t count = __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+
+	return since ? count - since->counts[i] : count;
+}
+
+uint64_t stats_count(const struct stats_histogram *h,
+	const struct stats_histogram *since)
+{
+	uint64_t total = 0;
+
+	for (int i = 0; i < STATS_BUCKETS; i++)
+		total += bucket_count(h, since, i);
+	return total;
+}
+
+uint32_t stats_percentile(const struct stats_histogram *h,
+	const struct stats_histogram *since, double fraction)
+{
+	uint64_t counts[STATS_BUCKETS];
+	uint64_t total = 0, seen = 0, wanted;
+
+	/* read each bucket once, so that the total matches */
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		counts[i] = bucket_count(h, since, i);
+		total += counts[i];
+	}
+	if (total == 0)
+		return 0;
+	wanted = (uint64_t) (total * fraction);
+	if (wanted < total * fraction || wanted == 0)
+		wanted++;
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		seen += counts[i];
+		if (seen >= wanted)
+			return stats_bucket_limit(i);
+	}
+	return stats_bucket_limit(STATS_BUCKETS - 1);
+}
+
+/*
+ * Each thread that reads the image counts into a block of its own,
+ * so that counting needs neither locks nor atomic read-modify-write.
+ * The blocks are linked into all_counts, which only ever grows, and
+ * the socket thread adds them up when it is asked. A block stays
+ * after its thread exits, to keep the totals, and goes on free_counts
+ * for the next new thread to count on from there. That way there are
+ * never more blocks than threads that ran at the same time.
+ */
+struct region_counts {
+	uint64_t reads;
+	uint64_t bytes;
+	struct stats_histogram latency;
+};
+
+struct thread_counts {
+	struct region_counts regions[STATS_REGIONS];
+	uint64_t syscalls;
+	uint64_t syscall_bytes;
+	struct thread_counts *next;
+	struct thread_counts *next_free;
+};
+
+static const char *region_names[STATS_REGIONS] = {
+	"reserved", "fat", "dir", "filemap", "literal"
+};
+
+static bool enabled;
+static __thread struct thread_counts *own_counts;
+static struct thread_counts *all_counts;
+static struct thread_counts *free_counts;
+static pthread_mutex_t counts_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Only there for its destructor, which gives the block back */
+static pthread_key_t counts_key;
+static pthread_once_t counts_key_once = PTHREAD_ONCE_INIT;
+
+static void release_counts(void *p)
+{
+	struct thread_counts *tc = (struct thread_counts *) p;
+
+	pthread_mutex_lock(&counts_lock);
+	tc->next_free = free_counts;
+	free_counts = tc;
+	pthread_mutex_unlock(&counts_lock);
+}
+
+static void make_counts_key()
+{
+	pthread_key_create(&counts_key, release_counts);
+}
+
+static struct thread_counts *get_counts()
+{
+	if (own_counts)
+		return own_counts;
+	pthread_once(&counts_key_once, make_counts_key);
+	pthread_mutex_lock(&counts_lock);
+	if (free_counts) {
+		own_counts = free_counts;
+		free_counts = own_counts->next_free;
+	} else {
+		own_counts = (struct thread_counts *)
+			calloc(1, sizeof(*own_counts));
+		if (own_counts) {
+			own_counts->next = all_counts;
+			all_counts = own_counts;
+		}
+	}
+	pthread_mutex_unlock(&counts_lock);
+	if (own_counts)
+		pthread_setspecific(counts_key, own_counts);
+	return own_counts;
+}
+
+/* Only the owning thread changes a counter */
+static void bump(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void stats_enable()
+{
+	__atomic_store_n(&enabled, true, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_region_start()
+{
+	if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED))
+		return 0;
+	return stats_now_us();
+}
+
+void stats_region_done(enum stats_region region, uint64_t start,
+	uint32_t bytes)
+{
+	struct thread_counts *tc;
+	struct region_counts *rc;
+
+	if (!start || !(tc = get_counts()))
+		return;
+	rc = &tc->regions[region];
+	bump(&rc->reads, 1);
+	bump(&rc->bytes, bytes);
+	bump(&rc->latency.counts[stats_bucket(stats_now_us() - start)], 1);
+}
+
+void stats_syscall(uint32_t bytes)
+{
+	struct thread_counts *tc;
+
+	if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)
+			|| !(tc = get_counts()))
+		return;
+	bump(&tc->syscalls, 1);
+	bump(&tc->syscall_bytes, bytes);
+}
+
+static uint64_t load(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* Add up the counts of all the threads */
+static void collect(struct thread_counts *total)
+{
+	struct thread_counts *tc;
+
+	memset(total, 0, sizeof(*total));
+	pthread_mutex_lock(&counts_lock);
+	tc = all_counts;
+	pthread_mutex_unlock(&counts_lock);
+	for (; tc; tc = tc->next) {
+		for (int r = 0; r < STATS_REGIONS; r++) {
+			struct region_counts *rc = &tc->regions[r];
+			struct region_counts *sum = &total->regions[r];
+
+			sum->reads += load(&rc->reads);
+			sum->bytes += load(&rc->bytes);
+			for (int i = 0; i < STATS_BUCKETS; i++)
+				sum->latency.counts[i] +=
+					load(&rc->latency.counts[i]);
+		}
+		total->syscalls += load(&tc->syscalls);
+		total->syscall_bytes += load(&tc->syscall_bytes);
+	}
+}
+
+/* Result: the end of the highest bucket in use, or 0 */
+static uint32_t histogram_max(const struct stats_histogram *h)
+{
+	for (int i = STATS_BUCKETS - 1; i >= 0; i--) {
+		if (h->counts[i])
+			return stats_bucket_limit(i);
+	}
+	return 0;
+}
+
+/* snprintf that appends at *len, and counts what didn't fit */
+static void append(char *buf, int size, int *len, const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+static void append(char *buf, int size, int *len, const char *fmt, ...)
+{
+	va_list va;
+	int n;
+
+	va_start(va, fmt);
+	n = vsnprintf(*len < size ? buf + *len : NULL,
+		*len < size ? size - *len : 0, fmt, va);
+	va_end(va);
+	if (n > 0)
+		*len += n;
+}
+
+int stats_format(char *buf, int size, bool json)
+{
+	struct thread_counts total;
+	const struct region_counts *rc;
+	int len = 0;
+
+	collect(&total);
+	if (size > 0)
+		buf[0] = 0;
+	if (!json)
+		append(buf, size, &len, "%-9s %12s %16s %8s %8s %8s\n",
+			"region", "reads", "bytes", "p50_us", "p99_us",
+			"max_us");
+	else
+		append(buf, size, &len, "{\"regions\": {");
+	for (int r = 0; r < STATS_REGIONS; r++) {
+		rc = &total.regions[r];
+		if (!json) {
+			append(buf, size, &len,
+				"%-9s %12llu %16llu %8lu %8lu %8lu\n",
+				region_names[r],
+				(unsigned long long) rc->reads,
+				(unsigned long long) rc->bytes,
+				(unsigned long) stats_percentile(&rc->latency,
+					NULL, 0.5),
+				(unsigned long) stats_percentile(&rc->latency,
+					NULL, 0.99),
+				(unsigned long) histogram_max(&rc->latency));
+			continue;
+		}
+		append(buf, size, &len, "%s\"%s\": {\"reads\": %llu, "
+			"\"bytes\": %llu, \"p50_us\": %lu, "
+			"\"p99_us\": %lu, \"max_us\": %lu, "
+			"\"latency_us\": [",
+			r ? ", " : "", region_names[r],
+			(unsigned long long) rc->reads,
+			(unsigned long long) rc->bytes,
+			(unsigned long) stats_percentile(&rc->latency,
+				NULL, 0.5),
+			(unsigned long) stats_percentile(&rc->latency,
+				NULL, 0.99),
+			(unsigned long) histogram_max(&rc->latency));
+		/* [limit, count] for the buckets in use */
+		bool first = true;
+		for (int i = 0; i < STATS_BUCKETS; i++) {
+			if (!rc->latency.counts[i])
+				continue;
+			append(buf, size, &len, "%s[%lu, %llu]",
+				first ? "" : ", ",
+				(unsigned long) stats_bucket_limit(i),
+				(unsigned long long) rc->latency.counts[i]);
+			first = false;
+		}
+		append(buf, size, &len, "]}");
+	}
+	if (!json)
+		append(buf, size, &len, "syscalls %llu\nsyscall_bytes %llu\n",
+			(unsigned long long) total.syscalls,
+			(unsigned long long) total.syscall_bytes);
+	else
+		append(buf, size, &len, "}, \"syscalls\": %llu, "
+			"\"syscall_bytes\": %llu}\n",
+			(unsigned long long) total.syscalls,
+			(unsigned long long) total.syscall_bytes);
+	return len;
+}
+
+/* Read the query from a client and send it the counters */
+static void answer(int fd)
+{
+	struct timeval timeout = { 1, 0 };
+	std::vector<char> out(4096);
+	char cmd[16];
+	size_t got = 0;
+	ssize_t n;
+	int len;
+
+	/* don't let a silent client hold up the others */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	while (got < sizeof(cmd) - 1 && !memchr(cmd, '\n', got)) {
+		n = read(fd, cmd + got, sizeof(cmd) - 1 - got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		got += n;
+	}
+	cmd[got] = 0;
+
+	len = stats_format(&out[0], out.size(), !strncmp(cmd, "json", 4));
+	if (len >= (int) out.size()) {
+		out.resize(len + 1);
+		len = stats_format(&out[0], out.size(),
+			!strncmp(cmd, "json", 4));
+		len = std::min(len, (int) out.size() - 1);
+	}
+	for (int done = 0; done < len; done += n) {
+		n = send(fd, &out[done], len - done, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n <= 0)
+			break;
+	}
+}
+
+static void *listen_thread(void *arg)
+{
+	int listen_fd = (long) arg;
+	int fd;
+
+	for (;;) {
+		fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+		answer(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+bool stats_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	pthread_t thread;
+	int fd, err;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	unlink(path);  /* left over from an earlier run */
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+			|| listen(fd, 4) < 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return false;
+	}
+	err = pthread_create(&thread, NULL, listen_thread, (void *) (long) fd);
+	if (err) {
+		close(fd);
+		errno = err;
+		return false;
+	}
+	pthread_detach(thread);
+	stats_enable();
+	return true;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Latency histograms for the serving statistics. Values are counted
+ * in buckets that grow by powers of two, with four buckets to each
+ * power, so that a percentile comes out within 25% of the real one.
+ * Any thread may record into a histogram without locking.
+ *
+ * The image reads are also counted by region, in counters that each
+ * thread keeps for itself, and can be queried over a unix socket.
+ */
+
+#include <stdint.h>
+
+#define STATS_BUCKETS 128
+
+struct stats_histogram {
+	uint64_t counts[STATS_BUCKETS];
+};
+
+/* Result: the current time in microseconds, from the monotonic clock */
+uint64_t stats_now_us();
+
+/* Count one value, usually a latency in microseconds */
+void stats_record(struct stats_histogram *h, uint32_t value);
+
+/* Copy 'h' to 'out' while other threads may be recording into it */
+void stats_snapshot(const struct stats_histogram *h,
+	struct stats_histogram *out);
+
+/* Result: the number of values counted in 'h' since 'since', which is
+ * an earlier snapshot of it, or NULL to count all of them */
+uint64_t stats_count(const struct stats_histogram *h,
+	const struct stats_histogram *since);
+
+/* Result: the value that a 'fraction' of the values counted since
+ * 'since' are at or below, rounded up to the end of its bucket,
+ * or 0 if there are none. */
+uint32_t stats_percentile(const struct stats_histogram *h,
+	const struct stats_histogram *since, double fraction);
+
+/* Result: the bucket that counts 'value', and the largest value
+ * counted in 'bucket' */
+int stats_bucket(uint32_t value);
+uint32_t stats_bucket_limit(int bucket);
+
+/* The kinds of image data that reads are counted by */
+enum stats_region {
+	STATS_RESERVED,  /* boot sector and the rest of the reserved area */
+	STATS_FAT,
+	STATS_DIR,
+	STATS_FILEMAP,
+	STATS_LITERAL,  /* free space and bad clusters */
+	STATS_REGIONS
+};
+
+/* Turn on the region counters. They are off by default so that
+ * reading the image doesn't have to look at the clock. */
+void stats_enable();
+
+/* Result: the start time for stats_region_done(), or 0 if the
+ * counters are off */
+uint64_t stats_region_start();
+
+/* Count a read of 'bytes' bytes from 'region' that started at 'start' */
+void stats_region_done(enum stats_region region, uint64_t start,
+	uint32_t bytes);
+
+/* Count a system call made to serve a read, and the bytes it read */
+void stats_syscall(uint32_t bytes);
+
+/* Start answering queries on a unix socket at 'path'. A client sends
+ * "text" or "json" followed by a newline and gets the counters back in
+ * that format. This also turns on the counters.
+ * Result: false if the socket couldn't be set up, with errno set. */
+bool stats_listen(const char *path);
+
+/* Write the counters as text or as JSON.
+ * Result: the length, which is more than 'size' if it didn't fit. */
+int stats_format(char *buf, int size, bool json);
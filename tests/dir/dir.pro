@@ -4,3 +4,7 @@ include(../tests.pri)
 SOURCES += tst_dir.cpp
 SOURCES += ../../dir.cpp
 SOURCES += ../../fat.cpp
+SOURCES += ../../stats.cpp
+SOURCES += ../../import/ConvertUTF.cpp
+INCLUDEPATH += ../../import
+LIBS += -lpthread
@@ -16,6 +16,7 @@
 #include "dir.h"
 #include "fat.h"
 #include "filemap.h" // for filemap_fill prototype
+#include "ConvertUTF.h"
 
 #include <stdlib.h>
 #include <errno.h>
@@ -24,11 +25,14 @@
 
 #include "../helpers.h"
 
-// stub for linking with fat.cpp
+// stubs for linking with fat.cpp
 int filemap_fill(char *, uint32_t, int, uint32_t) {
     return EINVAL;
 }
 
+void filemap_prefetch_dir(const char *, uint32_t) {
+}
+
 static filename_t expand_name(const char *name) {
     int len = strlen(name) + 1; // include the trailing 0
     filename_t fname;
@@ -100,11 +104,11 @@ static unsigned char short_entry_2_expect[32] = {
     0x37, 0x13, 0x03, 0x10
 };
 
-// LFN for "testname.tst"
+// LFN for "Testname.tst"
 static unsigned char lfn_entry_1_expect[32] = {
     // long name, encoded in one entry
     0x41, // sequence number + start indicator
-    't', 0, 'e', 0, 's', 0, 't', 0, 'n', 0,
+    'T', 0, 'e', 0, 's', 0, 't', 0, 'n', 0,
     0x0f, // attributes for LFN entry
     0,
     0, // checksum of expected short entry, caller must fill
@@ -113,11 +117,11 @@ static unsigned char lfn_entry_1_expect[32] = {
     't', 0, 0, 0
 };
 
-// LFN for "subdir"
+// LFN for "SubDir"
 static unsigned char lfn_entry_2_expect[32] = {
     // long name, encoded in one entry
     0x41, // sequence number + start indicator
-    's', 0, 'u', 0, 'b', 0, 'd', 0, 'i', 0,
+    'S', 0, 'u', 0, 'b', 0, 'D', 0, 'i', 0,
     0x0f, // attributes for LFN entry
     0,
     0, // checksum of expected short entry, caller must fill
@@ -126,6 +130,22 @@ static unsigned char lfn_entry_2_expect[32] = {
     0xff, 0xff, 0xff, 0xff
 };
 
+// Plain short entry for "img_0001.jpg", which needs no LFN entries
+static const unsigned char plain_short_entry_expect[32] = {
+    'I', 'M', 'G', '_', '0', '0', '0', '1', 'J', 'P', 'G',
+    0x01, // read only
+    0x18, // lowercase basename and extension
+    100,
+    0xef, 0x41,
+    0xa8, 0x44,
+    0xaa, 0x44,
+    0x04, 0x20,
+    0xef, 0x41,
+    0xa8, 0x44,
+    0x48, 0x24,
+    0x37, 0x13, 0x03, 0x10
+};
+
 // LFN for "abcdefghijklmnopqrstuvwxyz"
 static unsigned char lfn_entry_3_expect[32 * 3] = {
     // long name, encoded in three entries, last part first
@@ -172,7 +192,7 @@ private slots:
         setenv("TZ", "UTC+1", true); // ensure consistent results from localtime
 
         fat_init(DATA_CLUSTERS);
-        dir_init();
+        dir_init(".");
     }
 
     void cleanup() {
@@ -197,7 +217,7 @@ private slots:
 
     // Try creating one file in the root directory
     void test_dir_entry() {
-        QVERIFY(dir_add_entry(0, test_clust, expand_name("testname.tst"),
+        QVERIFY(dir_add_entry(0, test_clust, expand_name("Testname.tst"),
                 test_file_size, FAT_ATTR_READ_ONLY, test_mtime, test_atime));
         int ret = dir_fill(page, 4096, 0, 0);
         QCOMPARE(ret, 0);
@@ -210,8 +230,8 @@ private slots:
     // Try creating a subdirectory of the root,
     // and then creating a file entry in the subdirectory.
     void test_create_subdir() {
-        uint32_t dir_clust = dir_alloc_new("subdir");
-        QVERIFY(dir_add_entry(0, dir_clust, expand_name("subdir"),
+        uint32_t dir_clust = dir_cluster(dir_alloc_new(0, "SubDir"));
+        QVERIFY(dir_add_entry(0, dir_clust, expand_name("SubDir"),
                 test_file_size, FAT_ATTR_DIRECTORY | FAT_ATTR_READ_ONLY,
                 test_mtime, test_atime));
         int ret = dir_fill(page, 4096, 0, 0);
@@ -226,7 +246,7 @@ private slots:
         VERIFY_ARRAY(page, 64, 4096, (char) 0);
 
         QVERIFY(dir_add_entry(dir_clust, test_clust,
-                expand_name("testname.tst"), test_file_size,
+                expand_name("Testname.tst"), test_file_size,
                 FAT_ATTR_READ_ONLY, test_mtime, test_atime));
         ret = dir_fill(page, 4096, 1, 0);
         QCOMPARE(ret, 0);
@@ -271,7 +291,7 @@ private slots:
 	QCOMPARE(fat_dir_index(3), -1); // still nothing in second data cluster
 
         // this call should expand the directory in the FAT
-        QVERIFY(dir_add_entry(0, test_clust + i++, expand_name("testname.tst"),
+        QVERIFY(dir_add_entry(0, test_clust + i++, expand_name("Testname.tst"),
                 test_file_size, FAT_ATTR_READ_ONLY, test_mtime, test_atime));
 	QCOMPARE(fat_dir_index(2), 0); // root dir in first data cluster
 	QCOMPARE(fat_dir_index(3), 0); // and also in second data cluster
@@ -298,9 +318,282 @@ private slots:
 	QCOMPARE(fat_dir_index(5), -1); // but not in the fourth
     }
 
+    // Names that fit in 8.3 should get just a short entry
+    void test_plain_short_name() {
+        QVERIFY(dir_add_entry(0, test_clust, expand_name("img_0001.jpg"),
+                test_file_size, FAT_ATTR_READ_ONLY, test_mtime, test_atime));
+        int ret = dir_fill(page, 4096, 0, 0);
+        QCOMPARE(ret, 0);
+        COMPARE_ARRAY((unsigned char *) page, plain_short_entry_expect, 32);
+        VERIFY_ARRAY(page, 32, 4096, (char) 0);
+
+        // plain short names should not use up unique short names
+        QVERIFY(dir_add_entry(0, test_clust, expand_name("Testname.tst"),
+                test_file_size, FAT_ATTR_READ_ONLY, test_mtime, test_atime));
+        ret = dir_fill(page, 4096, 0, 0);
+        QCOMPARE(ret, 0);
+        lfn_entry_1_expect[13] = short_1_checksum;
+        COMPARE_ARRAY((unsigned char *) page + 32, lfn_entry_1_expect, 32);
+        COMPARE_ARRAY((unsigned char *) page + 64, short_entry_expect, 32);
+        VERIFY_ARRAY(page, 96, 4096, (char) 0);
+    }
+
+    // The case flags can express all-lowercase basenames and
+    // extensions independently of each other
+    void test_short_name_case() {
+        const char *names[] = { "IMG_0001.JPG", "IMG_0002.jpg",
+                                "img_0003.JPG", "README", "a~1.{}" };
+        const unsigned char flags[] = { 0, 0x10, 0x08, 0, 0x08 };
+        const int count = sizeof(flags) / sizeof(flags[0]);
+
+        for (int i = 0; i < count; i++) {
+            QVERIFY(dir_add_entry(0, test_clust, expand_name(names[i]),
+                    test_file_size, FAT_ATTR_READ_ONLY,
+                    test_mtime, test_atime));
+        }
+        int ret = dir_fill(page, 4096, 0, 0);
+        QCOMPARE(ret, 0);
+        QVERIFY(memcmp(page, "IMG_0001JPG", 11) == 0);
+        QVERIFY(memcmp(page + 32, "IMG_0002JPG", 11) == 0);
+        QVERIFY(memcmp(page + 2 * 32, "IMG_0003JPG", 11) == 0);
+        QVERIFY(memcmp(page + 3 * 32, "README     ", 11) == 0);
+        QVERIFY(memcmp(page + 4 * 32, "A~1     {} ", 11) == 0);
+        for (int i = 0; i < count; i++) {
+            QCOMPARE((unsigned char) page[i * 32 + 11],
+                    (unsigned char) FAT_ATTR_READ_ONLY);
+            QCOMPARE((unsigned char) page[i * 32 + 12], flags[i]);
+        }
+        VERIFY_ARRAY(page, count * 32, 4096, (char) 0);
+    }
+
+    // Names that don't fit in 8.3 or whose case can't be expressed
+    // by the case flags must get LFN entries
+    void test_not_short_names() {
+        const char *names[] = { "Readme.txt", ".profile", "a..b", "foo.",
+                                "abcdefghi.tx", "abc.text", "a b.txt",
+                                "a+b.txt", "a.b.c", "readme.TxT" };
+        const int count = sizeof(names) / sizeof(names[0]);
+
+        for (int i = 0; i < count; i++) {
+            QVERIFY(dir_add_entry(0, test_clust, expand_name(names[i]),
+                    test_file_size, FAT_ATTR_READ_ONLY,
+                    test_mtime, test_atime));
+        }
+        int ret = dir_fill(page, 4096, 0, 0);
+        QCOMPARE(ret, 0);
+        // each of these names fits in one LFN entry,
+        // so the entries alternate
+        for (int i = 0; i < count; i++) {
+            QCOMPARE((unsigned char) page[i * 64 + 11],
+                    (unsigned char) FAT_ATTR_LFN);
+            QCOMPARE((unsigned char) page[i * 64 + 32], (unsigned char) ' ');
+        }
+        VERIFY_ARRAY(page, count * 64, 4096, (char) 0);
+    }
+
+    // Two names that map to the same short name can't both use it
+    void test_short_name_clash() {
+        uint32_t dir_clust = dir_cluster(dir_alloc_new(0, "SubDir"));
+        QVERIFY(dir_add_entry(0, test_clust, expand_name("a.txt"),
+                test_file_size, FAT_ATTR_READ_ONLY, test_mtime, test_atime));
+        QVERIFY(dir_add_entry(0, test_clust, expand_name("A.TXT"),
+                test_file_size, FAT_ATTR_READ_ONLY, test_mtime, test_atime));
+        // but it's fine in another directory
+        QVERIFY(dir_add_entry(dir_clust, test_clust, expand_name("A.TXT"),
+                test_file_size, FAT_ATTR_READ_ONLY, test_mtime, test_atime));
+
+        int ret = dir_fill(page, 4096, 0, 0);
+        QCOMPARE(ret, 0);
+        QVERIFY(memcmp(page, "A       TXT", 11) == 0);
+        QCOMPARE((unsigned char) page[32 + 11], (unsigned char) FAT_ATTR_LFN);
+        QCOMPARE((unsigned char) page[2 * 32], (unsigned char) ' ');
+        VERIFY_ARRAY(page, 3 * 32, 4096, (char) 0);
+
+        ret = dir_fill(page, 4096, 1, 0);
+        QCOMPARE(ret, 0);
+        QVERIFY(memcmp(page, "A       TXT", 11) == 0);
+        QCOMPARE((unsigned char) page[12], (unsigned char) 0);
+        VERIFY_ARRAY(page, 32, 4096, (char) 0);
+    }
+
+    // The dot entries of subdirectories are plain short entries
+    void test_dot_entries() {
+        uint32_t dir_clust = dir_cluster(dir_alloc_new(0, "SubDir"));
+        filename_t dot = expand_name(".");
+        filename_t dotdot = expand_name("..");
+        QVERIFY(dir_add_entry(dir_clust, dir_clust, dot, 0,
+                FAT_ATTR_DIRECTORY, test_mtime, test_atime));
+        QVERIFY(dir_add_entry(dir_clust, 0, dotdot, 0,
+                FAT_ATTR_DIRECTORY, test_mtime, test_atime));
+        int ret = dir_fill(page, 4096, 1, 0);
+        QCOMPARE(ret, 0);
+        QVERIFY(memcmp(page, ".          ", 11) == 0);
+        QVERIFY(memcmp(page + 32, "..         ", 11) == 0);
+        QCOMPARE((unsigned char) page[11],
+                (unsigned char) (FAT_ATTR_DIRECTORY | FAT_ATTR_READ_ONLY));
+        QCOMPARE((unsigned char) page[26], (unsigned char) dir_clust);
+        QCOMPARE((unsigned char) page[32 + 26], (unsigned char) 0);
+        VERIFY_ARRAY(page, 64, 4096, (char) 0);
+    }
+
+    // Paths are put together from the names of the parent dirs
+    void test_dir_path() {
+        char buf[20];
+        int sub = dir_alloc_new(0, "SubDir");
+        int subsub = dir_alloc_new(sub, "x");
+
+        QCOMPARE(dir_path(0, buf, sizeof(buf)), 1);
+        QCOMPARE(QString(buf), QString("."));
+        QCOMPARE(dir_path(subsub, buf, sizeof(buf)), 10);
+        QCOMPARE(QString(buf), QString("./SubDir/x"));
+        // exactly enough room, including the terminator
+        QCOMPARE(dir_path(subsub, buf, 11), 10);
+        // not enough room
+        QCOMPARE(dir_path(subsub, buf, 10), -1);
+        QCOMPARE(dir_path(subsub, buf, 5), -1);
+    }
+
+    // A directory that doesn't fit in a finalized image isn't
+    // registered at all
+    void test_no_room() {
+        fat_init(4);
+        dir_init(".");
+        fat_finalize(4);
+        int count = dir_count();
+        int dir;
+        while ((dir = dir_alloc_new(0, "x")) >= 0)
+            count++;
+        QCOMPARE(dir, -1);
+        QCOMPARE(dir_count(), count);
+    }
+
+    // Freeing a removed directory frees everything under it,
+    // but not what its . and .. entries point to
+    void test_free_tree() {
+        int sub = dir_alloc_new(0, "SubDir");
+        int subsub = dir_alloc_new(sub, "x");
+        uint32_t sub_clust = dir_cluster(sub);
+        uint32_t subsub_clust = dir_cluster(subsub);
+        uint32_t file_clust = fat_alloc_filemap(0, 3);
+        QVERIFY(dir_add_entry_at(0, sub_clust, expand_name("SubDir"), 0,
+                FAT_ATTR_DIRECTORY, test_mtime, test_atime));
+        QVERIFY(dir_add_entry_at(sub, sub_clust, expand_name("."), 0,
+                FAT_ATTR_DIRECTORY, test_mtime, test_atime));
+        QVERIFY(dir_add_entry_at(sub, 0, expand_name(".."), 0,
+                FAT_ATTR_DIRECTORY, test_mtime, test_atime));
+        QVERIFY(dir_add_entry_at(sub, subsub_clust, expand_name("x"), 0,
+                FAT_ATTR_DIRECTORY, test_mtime, test_atime));
+        QVERIFY(dir_add_entry_at(subsub, file_clust,
+                expand_name("a long file name.txt"), 3 * 4096, 0,
+                test_mtime, test_atime));
+        fat_finalize(DATA_CLUSTERS);
+        QCOMPARE(fat_filemap_index(file_clust), 0);
+
+        dir_free_tree(sub);
+        QCOMPARE(dir_cluster(sub), (uint32_t) 0);
+        QCOMPARE(dir_cluster(subsub), (uint32_t) 0);
+        QCOMPARE(dir_size(sub), (uint32_t) 0);
+        QCOMPARE(fat_dir_index(sub_clust), -1);
+        QCOMPARE(fat_dir_index(subsub_clust), -1);
+        QCOMPARE(fat_filemap_index(file_clust), -1);
+        QCOMPARE(fat_filemap_index(file_clust + 2), -1);
+        QCOMPARE(fat_dir_index(dir_cluster(0)), 0);
+    }
+
+    // Entries can be found by name and deleted again
+    void test_find_entry() {
+        uint8_t attrs;
+        uint32_t clust, size;
+
+        QVERIFY(dir_add_entry(0, test_clust, expand_name("img_0001.jpg"),
+                test_file_size, FAT_ATTR_READ_ONLY, test_mtime, test_atime));
+        QVERIFY(dir_add_entry(0, 5, expand_name("abcdefghijklmnopqrstuvwxyz"),
+                0, FAT_ATTR_DIRECTORY, test_mtime, test_atime));
+
+        QCOMPARE(dir_find_entry(0, expand_name("img_0001.jpg"),
+                &attrs, &clust, &size), 0);
+        QCOMPARE(attrs, (uint8_t) FAT_ATTR_READ_ONLY);
+        QCOMPARE(clust, test_clust);
+        QCOMPARE(size, test_file_size);
+
+        QCOMPARE(dir_find_entry(0, expand_name("abcdefghijklmnopqrstuvwxyz"),
+                &attrs, &clust, &size), 32);
+        QCOMPARE(attrs, (uint8_t) (FAT_ATTR_DIRECTORY | FAT_ATTR_READ_ONLY));
+        QCOMPARE(clust, (uint32_t) 5);
+        QCOMPARE(size, (uint32_t) 0);
+
+        QCOMPARE(dir_find_entry(0, expand_name("IMG_0001.JPG"),
+                &attrs, &clust, &size), -1);
+        QCOMPARE(dir_find_entry(0, expand_name("abcdefghijklmnopqrstuvwxy"),
+                &attrs, &clust, &size), -1);
+
+        // The long name and its short entry are all deleted
+        dir_delete_entry(0, 32);
+        int ret = dir_fill(page, 4096, 0, 0);
+        QCOMPARE(ret, 0);
+        QCOMPARE((unsigned char) page[0], (unsigned char) 'I');
+        for (int i = 1; i <= 4; i++)
+            QCOMPARE((unsigned char) page[i * 32], (unsigned char) 0xe5);
+        VERIFY_ARRAY(page, 5 * 32, 4096, (char) 0);
+        QCOMPARE(dir_find_entry(0, expand_name("abcdefghijklmnopqrstuvwxyz"),
+                &attrs, &clust, &size), -1);
+        QCOMPARE(dir_find_entry(0, expand_name("img_0001.jpg"),
+                &attrs, &clust, &size), 0);
+
+        // A deleted short name can be handed out again
+        dir_delete_entry(0, 0);
+        QVERIFY(dir_add_entry(0, test_clust, expand_name("img_0001.jpg"),
+                test_file_size, FAT_ATTR_READ_ONLY, test_mtime, test_atime));
+        QCOMPARE(dir_size(0), (uint32_t) (6 * 32));
+        QCOMPARE(dir_find_entry(0, expand_name("img_0001.jpg"),
+                &attrs, &clust, &size), 5 * 32);
+    }
+
+    // The ASCII fast path has to agree with the full converter
+    void test_convert_name() {
+        static const char *pieces[] = {
+            "a", "Z", "0", ".", " ", "-", "photo_", "IMG_0001.jpg",
+            "\xc3\xa9", "\xe6\x97\xa5", "\xf0\x9f\x98\x80", // é 日 😀
+            "\xff", "\xc3", "\x80", "\xed\xa0\x80", // invalid
+        };
+        const int npieces = sizeof(pieces) / sizeof(pieces[0]);
+        uint32_t seed = 1;
+        char name[300];
+        filename_t fast, slow;
+
+        for (int n = 0; n < 20000; n++) {
+            int len = 0;
+            // mostly ASCII, so that runs are long enough to vectorize
+            while (len < 250) {
+                seed = seed * 1103515245 + 12345;
+                int piece = (seed >> 16) % (npieces * 4);
+                if (piece >= npieces)
+                    piece %= 8;
+                int plen = strlen(pieces[piece]);
+                memcpy(name + len, pieces[piece], plen);
+                len += plen;
+                if ((seed >> 8) % 23 == 0)
+                    break;
+            }
+
+            slow.assign(len + 1, 0);
+            const UTF8 *inp = (const UTF8 *) name;
+            UTF16 *outp = &slow[0];
+            ConversionResult result = ConvertUTF8toUTF16LE(&inp,
+                    inp + len, &outp, outp + len, strictConversion);
+            int ret = dir_convert_name(name, len, fast);
+            QCOMPARE(ret, result == conversionOK ? 0 : -1);
+            if (ret < 0)
+                continue;
+            *outp++ = 0;
+            slow.resize(outp - &slow[0]);
+            QVERIFY(fast == slow);
+        }
+    }
+
     void test_bad_input() {
         // Add entry to nonexistent dir
-        QCOMPARE(dir_add_entry(1, test_clust, expand_name("testname.tst"),
+        QCOMPARE(dir_add_entry(1, test_clust, expand_name("Testname.tst"),
                 test_file_size, FAT_ATTR_READ_ONLY, test_mtime, test_atime),
                 false);
     }
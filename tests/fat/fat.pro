@@ -3,3 +3,5 @@ include(../tests.pri)
 
 SOURCES += tst_fat.cpp
 SOURCES += ../../fat.cpp
+SOURCES += ../../stats.cpp
+LIBS += -lpthread
@@ -68,6 +68,11 @@ int dir_fill(char *buf, uint32_t len, int dir_index, uint32_t offset)
     return 0;
 }
 
+// Mock function
+void filemap_prefetch_dir(const char *, uint32_t)
+{
+}
+
 #define check_fill(buf, _type, _len, _index, _offset) \
     do { \
         struct fill_struct *_f = (struct fill_struct *) (buf); \
@@ -338,6 +343,13 @@ private slots:
         QCOMPARE(ret, 0);
         QCOMPARE(filled, (uint32_t) 4096);
         check_fill(datapage, MOCK_FILEMAP_FILL, 4096, test_filemap, 3 * 4096);
+
+        // Check that the file can be found by its clusters
+        QCOMPARE(fat_filemap_index(expected_entry), test_filemap);
+        QCOMPARE(fat_filemap_index(expected_entry + test_clusters - 1),
+                test_filemap);
+        QCOMPARE(fat_filemap_index(expected_entry - 1), -1);
+        QCOMPARE(fat_dir_index(expected_entry), -1);
     }
 
     // Try allocating two filemaps and try a data_fill that
@@ -399,6 +411,150 @@ private slots:
         QCOMPARE(bad_count, expect_bad);
     }
 
+    // Close the directories and serve the image before finalizing it
+    void test_close_dirs() {
+        const int test_dir_index = 7;
+        const int test_filemap = 8;
+        const int test_clusters = 17;
+        // FAT entries past this share a sector with the end of the FAT
+        const uint32_t last_sector = FAT_ENTRIES / 128 * 128;
+        const uint32_t file_start = last_sector - test_clusters;
+        const uint32_t sector_start = file_start / 128 * 128;
+
+        uint32_t clust_nr = fat_alloc_dir(test_dir_index);
+        QCOMPARE(clust_nr, (uint32_t) 2);
+
+        fat_close_dirs(0);
+        QCOMPARE(fat_extend(clust_nr, 1), false);
+        QCOMPARE(fat_pending(0, 128), false);
+        QCOMPARE(fat_pending(128, 1), true);
+        QCOMPARE(fat_pending(last_sector - 1, 1), true);
+        QCOMPARE(fat_pending(last_sector, FAT_ENTRIES - last_sector), false);
+
+        // The rest of the first FAT sector is marked bad
+        fat_fill(fatpage, 0, 128);
+        QCOMPARE(fatpage[2], (uint32_t) 0x0fffffff); // end of chain marker
+        VERIFY_ARRAY(fatpage, 3, 128, (uint32_t) 0x0ffffff7);
+
+        // Free space isn't handed out yet, so it reads as zeros
+        int ret = data_fill(datapage, 4096, 1000, 0, &filled);
+        QCOMPARE(ret, 0);
+        QCOMPARE(filled, (uint32_t) 4096);
+        VERIFY_ARRAY(datapage, 0, 4096, (char) 0);
+
+        // A filemap added now goes below the padding
+        clust_nr = fat_alloc_filemap(test_filemap, test_clusters);
+        QCOMPARE(clust_nr, file_start);
+        fat_pad_filemaps();
+        QCOMPARE(fat_pending(sector_start, FAT_ENTRIES - sector_start),
+            false);
+        QCOMPARE(fat_pending(sector_start - 1, 1), true);
+        QCOMPARE(fat_filemap_index(file_start), test_filemap);
+
+        fat_fill(fatpage, sector_start, last_sector - sector_start);
+        VERIFY_ARRAY(fatpage, 0, (int) (file_start - sector_start),
+            (uint32_t) 0x0ffffff7);
+        for (uint32_t i = file_start; i < last_sector - 1; i++)
+            QCOMPARE(fatpage[i - sector_start], i + 1);
+        QCOMPARE(fatpage[last_sector - 1 - sector_start],
+            (uint32_t) 0x0fffffff);
+
+        fat_finalize(DATA_CLUSTERS);
+        QCOMPARE(fat_pending(128, 1), false);
+        fat_fill(fatpage, 128, 1);
+        QCOMPARE(fatpage[0], (uint32_t) 0);
+    }
+
+    // Free space set aside when closing the directories is final
+    // right away, and its size is known from then on
+    void test_close_dirs_free() {
+        const uint32_t free_clusters = 1000;
+        // FAT entries past this share a sector with the end of the FAT
+        const uint32_t last_sector = FAT_ENTRIES / 128 * 128;
+
+        QCOMPARE(fat_free_clusters(), (uint32_t) FAT_FREE_UNKNOWN);
+        QCOMPARE(fat_alloc_dir(7), (uint32_t) 2);
+        fat_close_dirs(free_clusters);
+        QCOMPARE(fat_free_clusters(), free_clusters);
+        QCOMPARE(fat_pending(128, free_clusters), false);
+        QCOMPARE(fat_pending(128 + free_clusters, 1), true);
+        fat_fill(fatpage, 128, free_clusters);
+        VERIFY_ARRAY(fatpage, 0, (int) free_clusters, (uint32_t) 0);
+
+        // Filemaps can't take it
+        QCOMPARE(fat_alloc_filemap(8, DATA_CLUSTERS), 0u);
+        QCOMPARE(fat_alloc_filemap(8, 17), last_sector - 17);
+        fat_pad_filemaps();
+
+        // The rest of the gap is marked bad when finalizing
+        fat_finalize(free_clusters);
+        QCOMPARE(fat_free_clusters(), free_clusters);
+        fat_fill(fatpage, 128, free_clusters + 1);
+        VERIFY_ARRAY(fatpage, 0, (int) free_clusters, (uint32_t) 0);
+        QCOMPARE(fatpage[free_clusters], (uint32_t) 0x0ffffff7);
+    }
+
+    // Allocate and free after finalizing, as live updates do
+    void test_alloc_after_finalize() {
+        const int test_dir_index = 7;
+        const int test_filemap = 8;
+        const int test_clusters = 17;
+        // half of the gap is free and the rest is marked bad
+        const uint32_t free_clusters = DATA_CLUSTERS / 2;
+
+        uint32_t dir_clust = fat_alloc_dir(test_dir_index);
+        QCOMPARE(dir_clust, (uint32_t) 2);
+        fat_finalize(free_clusters);
+        QCOMPARE(fat_free_clusters(), free_clusters);
+
+        // Directories come from the start of the gap
+        uint32_t new_dir = fat_alloc_dir(test_dir_index + 1);
+        QCOMPARE(new_dir, (uint32_t) 3);
+        QCOMPARE(fat_extend(dir_clust, 2), true);
+        QCOMPARE(fat_dir_index(4), test_dir_index);
+        QCOMPARE(fat_dir_index(5), test_dir_index);
+        fat_fill(fatpage, 0, 8);
+        QCOMPARE(fatpage[2], (uint32_t) 4);
+        QCOMPARE(fatpage[3], (uint32_t) 0x0fffffff);
+        QCOMPARE(fatpage[4], (uint32_t) 5);
+        QCOMPARE(fatpage[5], (uint32_t) 0x0fffffff);
+        QCOMPARE(fatpage[6], (uint32_t) 0); // still free
+
+        // Filemaps come from the end of it
+        uint32_t clust_nr = fat_alloc_filemap(test_filemap, test_clusters);
+        QCOMPARE(clust_nr, FAT_ENTRIES - test_clusters);
+        QCOMPARE(fat_filemap_index(clust_nr), test_filemap);
+
+        // The host sees as much free space as before
+        uint32_t *buf = (uint32_t *) alloc_guarded(
+                FAT_ENTRIES * sizeof(uint32_t));
+        fat_fill(buf, 0, FAT_ENTRIES);
+        uint32_t free_count = 0;
+        for (uint32_t i = 0; i < FAT_ENTRIES; i++) {
+            if (buf[i] == 0)
+                free_count++;
+        }
+        QCOMPARE(free_count, free_clusters);
+        QCOMPARE(fat_free_clusters(), free_clusters);
+
+        // Freed chains become free space
+        fat_free(dir_clust);
+        fat_free(clust_nr);
+        QCOMPARE(fat_dir_index(dir_clust), -1);
+        QCOMPARE(fat_dir_index(4), -1);
+        QCOMPARE(fat_filemap_index(clust_nr), -1);
+        fat_fill(buf, 0, FAT_ENTRIES);
+        QCOMPARE(buf[2], (uint32_t) 0);
+        QCOMPARE(buf[3], (uint32_t) 0x0fffffff);
+        QCOMPARE(buf[4], (uint32_t) 0);
+        QCOMPARE(buf[FAT_ENTRIES - 1], (uint32_t) 0);
+        QCOMPARE(fat_free_clusters(), free_clusters + 3 + test_clusters);
+        free_guarded(buf);
+
+        // No room for more than the gap
+        QCOMPARE(fat_alloc_filemap(test_filemap + 1, DATA_CLUSTERS), 0u);
+    }
+
     void test_bad_args() {
         QCOMPARE(fat_extend(0, 1), false);
         QCOMPARE(fat_extend(FAT_ENTRIES, 1), false);
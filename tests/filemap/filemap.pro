@@ -0,0 +1,11 @@
+TARGET = test-filemap
+include(../tests.pri)
+
+SOURCES += tst_filemap.cpp
+SOURCES += ../../filemap.cpp
+SOURCES += ../../dir.cpp
+SOURCES += ../../fat.cpp
+SOURCES += ../../stats.cpp
+SOURCES += ../../import/ConvertUTF.cpp
+INCLUDEPATH += ../../import
+LIBS += -lpthread
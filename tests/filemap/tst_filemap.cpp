@@ -0,0 +1,431 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "filemap.h"
+#include "dir.h"
+#include "fat.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <QtTest/QtTest>
+
+#include "../helpers.h"
+
+// Create a file of 'size' bytes in 'dir', where byte i has value
+// (i + seed) % 251. Return false on failure.
+static bool make_file(const char *dir, const char *name, int size, int seed) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return false;
+    for (int i = 0; i < size; i++)
+        fputc((i + seed) % 251, f);
+    return fclose(f) == 0;
+}
+
+// Check if files can be opened by handle, which needs privileges
+// and filesystem support.
+static bool handles_allowed(const char *path) {
+    union {
+        struct file_handle fh;
+        char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+    } h;
+    int mount_id;
+    h.fh.handle_bytes = MAX_HANDLE_SZ;
+    if (name_to_handle_at(AT_FDCWD, path, &h.fh, &mount_id, 0) < 0)
+        return false;
+    int fd = open_by_handle_at(AT_FDCWD, &h.fh, O_RDONLY);
+    if (fd < 0)
+        return false;
+    close(fd);
+    return true;
+}
+
+// Return how many of the 'len' bytes of the file from 'offset' are
+// cached, rounded to pages, or -1 on failure.
+static int cached_bytes(const char *path, int len, off_t offset = 0) {
+    unsigned char vec[64];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || len > 64 * 4096)
+        return -1;
+    void *addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
+    close(fd);
+    if (addr == MAP_FAILED || mincore(addr, len, vec) < 0)
+        return -1;
+    munmap(addr, len);
+    int cached = 0;
+    for (int i = 0; i < (len + 4095) / 4096; i++)
+        cached += (vec[i] & 1) * 4096;
+    return cached;
+}
+
+class TestFilemap : public QObject {
+    Q_OBJECT
+
+    const static uint32_t DATA_CLUSTERS = 1000000;
+
+    char tmpdir[64];
+    char *page;
+
+private slots:
+    void init() {
+        strcpy(tmpdir, "/tmp/tst_filemap.XXXXXX");
+        QVERIFY(mkdtemp(tmpdir) != 0);
+        page = (char *) alloc_guarded(4096);
+
+        filemap_set_fd_cache_size(16);
+        fat_init(DATA_CLUSTERS);
+        dir_init(tmpdir);
+        filemap_init();
+    }
+
+    void cleanup() {
+        char cmd[100];
+        free_guarded(page);
+        filemap_init(); // closes cached fds
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+        system(cmd);
+    }
+
+    void test_path() {
+        char buf[PATH_MAX];
+        int sub = dir_alloc_new(0, "sub");
+        filemap_add(sub, "file.txt", 100, NULL);
+        QCOMPARE(filemap_path(0, buf, sizeof(buf)),
+                (int) strlen(tmpdir) + 13);
+        QCOMPARE(QString(buf + strlen(tmpdir)), QString("/sub/file.txt"));
+        QCOMPARE(filemap_path(0, buf, strlen(tmpdir) + 13), -1);
+    }
+
+    // Reads should return the file's data, with 0-padding at the end
+    void test_read() {
+        QVERIFY(make_file(tmpdir, "a", 5000, 0));
+        filemap_add(0, "a", 5000, NULL);
+
+        QCOMPARE(filemap_fill(page, 4096, 0, 0), 0);
+        for (int i = 0; i < 4096; i++)
+            QCOMPARE((unsigned char) page[i], (unsigned char) (i % 251));
+        QCOMPARE(filemap_fill(page, 4096, 0, 4096), 0);
+        for (int i = 0; i < 5000 - 4096; i++)
+            QCOMPARE((unsigned char) page[i],
+                    (unsigned char) ((i + 4096) % 251));
+        VERIFY_ARRAY(page, 5000 - 4096, 4096, (char) 0);
+
+        QCOMPARE(filemap_fill(page, 4096, 1, 0), EINVAL);
+        QCOMPARE(filemap_fill(page, 4096, -1, 0), EINVAL);
+    }
+
+    // Reading more files than the cache holds should still work
+    void test_many_files() {
+        char name[20];
+        filemap_set_fd_cache_size(3);
+        for (int i = 0; i < 10; i++) {
+            sprintf(name, "f%d", i);
+            QVERIFY(make_file(tmpdir, name, 4096, i));
+            filemap_add(0, name, 4096, NULL);
+        }
+        for (int round = 0; round < 3; round++) {
+            for (int i = 0; i < 10; i++) {
+                QCOMPARE(filemap_fill(page, 4096, i, 0), 0);
+                QCOMPARE((unsigned char) page[0], (unsigned char) i);
+                QCOMPARE((unsigned char) page[100],
+                        (unsigned char) (100 + i));
+            }
+        }
+        // and without a cache
+        filemap_set_fd_cache_size(0);
+        QCOMPARE(filemap_fill(page, 4096, 7, 0), 0);
+        QCOMPARE((unsigned char) page[0], (unsigned char) 7);
+    }
+
+    // Files that disappear after the scan should give read errors,
+    // even if they were read before.
+    void test_deleted_file() {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/a", tmpdir);
+        QVERIFY(make_file(tmpdir, "a", 4096, 0));
+        filemap_add(0, "a", 4096, path);
+        QCOMPARE(filemap_fill(page, 4096, 0, 0), 0);
+
+        QCOMPARE(unlink(path), 0);
+        QCOMPARE(filemap_fill(page, 4096, 0, 0), ENOENT);
+    }
+
+    // Files that are replaced after the scan should be read
+    // from the new file.
+    void test_replaced_file() {
+        char from[PATH_MAX], to[PATH_MAX];
+        snprintf(from, sizeof(from), "%s/b", tmpdir);
+        snprintf(to, sizeof(to), "%s/a", tmpdir);
+        QVERIFY(make_file(tmpdir, "a", 4096, 0));
+        filemap_add(0, "a", 4096, to);
+        QCOMPARE(filemap_fill(page, 4096, 0, 0), 0);
+        QCOMPARE((unsigned char) page[0], (unsigned char) 0);
+
+        QVERIFY(make_file(tmpdir, "b", 4096, 42));
+        QCOMPARE(rename(from, to), 0);
+        QCOMPARE(filemap_fill(page, 4096, 0, 0), 0);
+        QCOMPARE((unsigned char) page[0], (unsigned char) 42);
+    }
+
+    // Files that were renamed after the scan can still be read,
+    // if they can be opened by file handle.
+    void test_renamed_file() {
+        char from[PATH_MAX], to[PATH_MAX];
+        snprintf(from, sizeof(from), "%s/a", tmpdir);
+        snprintf(to, sizeof(to), "%s/b", tmpdir);
+        QVERIFY(make_file(tmpdir, "a", 4096, 42));
+        if (!handles_allowed(from))
+            QSKIP("opening by file handle is not possible here");
+        filemap_add(0, "a", 4096, from);
+        QCOMPARE(filemap_fill(page, 4096, 0, 0), 0);
+
+        QCOMPARE(rename(from, to), 0);
+        QCOMPARE(filemap_fill(page, 4096, 0, 0), 0);
+        QCOMPARE((unsigned char) page[0], (unsigned char) 42);
+    }
+
+    // Holes in sparse files should read as zeroes, both with read()
+    // and with mmap, and should notice when a hole got data while
+    // the file is cached.
+    void test_sparse_file() {
+        char path[PATH_MAX];
+        const int size = 3 * 1024 * 1024;
+        const off_t data_at = 1024 * 1024;
+        char data[4096];
+        for (int i = 0; i < 4096; i++)
+            data[i] = i % 251 + 1;
+        snprintf(path, sizeof(path), "%s/a", tmpdir);
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        QVERIFY(fd >= 0);
+        QCOMPARE(ftruncate(fd, size), 0);
+        QCOMPARE(pwrite(fd, data, 4096, data_at), (ssize_t) 4096);
+        filemap_add(0, "a", size, NULL);
+
+        for (int mmap_mode = 0; mmap_mode < 2; mmap_mode++) {
+            filemap_set_use_mmap(mmap_mode);
+            QCOMPARE(filemap_fill(page, 4096, 0, 0), 0);
+            VERIFY_ARRAY(page, 0, 4096, (char) 0);
+            // half hole, half data
+            QCOMPARE(filemap_fill(page, 4096, 0, data_at - 2048), 0);
+            VERIFY_ARRAY(page, 0, 2048, (char) 0);
+            QVERIFY(memcmp(page + 2048, data, 2048) == 0);
+            // half data, half hole
+            QCOMPARE(filemap_fill(page, 4096, 0, data_at + 2048), 0);
+            QVERIFY(memcmp(page, data + 2048, 2048) == 0);
+            VERIFY_ARRAY(page, 2048, 4096, (char) 0);
+        }
+        filemap_set_use_mmap(false);
+
+        // fill the first hole while the map is cached
+        QCOMPARE(pwrite(fd, data, 4096, 0), (ssize_t) 4096);
+        QCOMPARE(filemap_fill(page, 4096, 0, 0), 0);
+        QVERIFY(memcmp(page, data, 4096) == 0);
+        close(fd);
+    }
+
+    // Reading a directory cluster should bring the heads of the files
+    // listed in it into the page cache, but not other files.
+    void test_prefetch() {
+        char path[PATH_MAX];
+        char name[20];
+        uint32_t clust;
+        for (int i = 0; i < 3; i++) {
+            sprintf(name, "img%d.jpg", i);
+            QVERIFY(make_file(tmpdir, name, 65536, i));
+            snprintf(path, sizeof(path), "%s/%s", tmpdir, name);
+            int fd = open(path, O_RDONLY);
+            QVERIFY(fd >= 0);
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+            if (cached_bytes(path, 65536) != 0)
+                QSKIP("can't drop the test files from the page cache");
+            clust = filemap_add(0, name, 65536, NULL);
+            if (i < 2) {
+                filename_t fname;
+                for (const char *p = name; ; p++) {
+                    fname.push_back(*p);
+                    if (!*p)
+                        break;
+                }
+                QVERIFY(dir_add_entry_at(0, clust, fname, 65536,
+                        FAT_ATTR_NONE, 0, 0));
+            }
+        }
+        filemap_set_prefetch(16384, 1024 * 1024 * 1024);
+        QCOMPARE(dir_fill(page, 4096, 0, 0), 0);
+        filemap_prefetch_dir(page, 4096);
+        for (int tries = 0; tries < 100; tries++) {
+            snprintf(path, sizeof(path), "%s/img1.jpg", tmpdir);
+            if (cached_bytes(path, 16384) == 16384)
+                break;
+            usleep(10 * 1000);
+        }
+        filemap_set_prefetch(0, 0);
+        snprintf(path, sizeof(path), "%s/img0.jpg", tmpdir);
+        QCOMPARE(cached_bytes(path, 16384), 16384);
+        snprintf(path, sizeof(path), "%s/img1.jpg", tmpdir);
+        QCOMPARE(cached_bytes(path, 16384), 16384);
+        snprintf(path, sizeof(path), "%s/img2.jpg", tmpdir);
+        QCOMPARE(cached_bytes(path, 65536), 0);
+    }
+
+    // In nowait mode, reads should only succeed if they don't have
+    // to open the file or wait for the disk
+    void test_nowait() {
+        char path[PATH_MAX];
+        const int size = 5 * 1024 * 1024;
+        const uint32_t uncached = 4 * 1024 * 1024 + 4096;
+        snprintf(path, sizeof(path), "%s/a", tmpdir);
+        QVERIFY(make_file(tmpdir, "a", size, 0));
+        filemap_add(0, "a", size, NULL);
+
+        filemap_set_nowait(true);
+        QCOMPARE(filemap_fill(page, 4096, 0, 0), EAGAIN);
+        filemap_set_nowait(false);
+
+        for (int mmap_mode = 0; mmap_mode < 2; mmap_mode++) {
+            filemap_set_use_mmap(mmap_mode);
+            QCOMPARE(filemap_fill(page, 4096, 0, 0), 0); // opens it
+            filemap_set_nowait(true);
+            QCOMPARE(filemap_fill(page, 4096, 0, 4096), 0);
+            QCOMPARE((unsigned char) page[0], (unsigned char) (4096 % 251));
+
+            // Drop the part after the first mmap window. The part
+            // that's mapped can't be dropped.
+            int fd = open(path, O_RDONLY);
+            QVERIFY(fd >= 0);
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+            if (cached_bytes(path, 4096, uncached) != 0) {
+                filemap_set_nowait(false);
+                QSKIP("can't drop the test file from the page cache");
+            }
+            // RWF_NOWAIT starts readahead, which a fast disk may
+            // finish before the read looks at the page again
+            int ret = filemap_fill(page, 4096, 0, uncached);
+            if (mmap_mode || ret != 0)
+                QCOMPARE(ret, EAGAIN);
+            filemap_set_nowait(false);
+            QCOMPARE(filemap_fill(page, 4096, 0, uncached), 0);
+            QCOMPARE((unsigned char) page[0],
+                    (unsigned char) (uncached % 251));
+        }
+        filemap_set_use_mmap(false);
+    }
+
+    // In nowait mode, a sparse file's data segments are only looked
+    // up if that can't wait, but a file without holes can be read
+    void test_nowait_sparse() {
+        const char *names[] = { "sparse", "full" };
+        const int sizes[] = { 1024 * 1024, 65536 };
+        char path[PATH_MAX];
+        char data[4096];
+        memset(data, 7, sizeof(data));
+        snprintf(path, sizeof(path), "%s/sparse", tmpdir);
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        QVERIFY(fd >= 0);
+        QCOMPARE(ftruncate(fd, sizes[0]), 0);
+        QCOMPARE(pwrite(fd, data, 4096, 65536), (ssize_t) 4096);
+        close(fd);
+        QVERIFY(make_file(tmpdir, "full", sizes[1], 0));
+        for (int i = 0; i < 2; i++) {
+            filename_t fname;
+            for (const char *p = names[i]; ; p++) {
+                fname.push_back(*p);
+                if (!*p)
+                    break;
+            }
+            uint32_t clust = filemap_add(0, names[i], sizes[i], NULL);
+            QVERIFY(dir_add_entry_at(0, clust, fname, sizes[i],
+                    FAT_ATTR_NONE, 0, 0));
+        }
+
+        // Let the prefetch thread open both, in directory order
+        filemap_set_prefetch(16384, 1024 * 1024 * 1024);
+        QCOMPARE(dir_fill(page, 4096, 0, 0), 0);
+        filemap_prefetch_dir(page, 4096);
+        filemap_set_nowait(true);
+        int ret = EAGAIN;
+        for (int tries = 0; tries < 500 && ret == EAGAIN; tries++) {
+            usleep(10 * 1000);
+            ret = filemap_fill(page, 4096, 1, 0);
+        }
+        QCOMPARE(ret, 0);
+        QCOMPARE(filemap_fill(page, 4096, 0, 65536), EAGAIN);
+        filemap_set_nowait(false);
+        filemap_set_prefetch(0, 0);
+
+        QCOMPARE(filemap_fill(page, 4096, 0, 65536), 0);
+        filemap_set_nowait(true);
+        QCOMPARE(filemap_fill(page, 4096, 0, 65536), 0);
+        QCOMPARE((unsigned char) page[0], (unsigned char) 7);
+        QCOMPARE(filemap_fill(page, 4096, 0, 0), 0);
+        VERIFY_ARRAY(page, 0, 4096, (char) 0);
+        filemap_set_nowait(false);
+    }
+
+    // The same reads should work through memory mappings,
+    // including ones that cross a mapping window boundary
+    void test_mmap_read() {
+        const int size = 5 * 1024 * 1024;
+        QVERIFY(make_file(tmpdir, "small", 5000, 3));
+        QVERIFY(make_file(tmpdir, "large", size, 0));
+        filemap_add(0, "small", 5000, NULL);
+        filemap_add(0, "large", size, NULL);
+        filemap_set_use_mmap(true);
+
+        QCOMPARE(filemap_fill(page, 4096, 0, 4096), 0);
+        for (int i = 0; i < 5000 - 4096; i++)
+            QCOMPARE((unsigned char) page[i],
+                    (unsigned char) ((i + 4096 + 3) % 251));
+        VERIFY_ARRAY(page, 5000 - 4096, 4096, (char) 0);
+
+        const uint32_t offset = 4 * 1024 * 1024 - 1000;
+        QCOMPARE(filemap_fill(page, 4096, 1, offset), 0);
+        for (int i = 0; i < 4096; i++)
+            QCOMPARE((unsigned char) page[i],
+                    (unsigned char) ((i + offset) % 251));
+        filemap_set_use_mmap(false);
+    }
+
+    // A file that shrinks while it's mapped should give an I/O error
+    // rather than crashing
+    void test_mmap_truncated() {
+        char path[PATH_MAX];
+        QVERIFY(make_file(tmpdir, "a", 8192, 0));
+        filemap_add(0, "a", 8192, NULL);
+        filemap_set_use_mmap(true);
+        QCOMPARE(filemap_fill(page, 4096, 0, 0), 0);
+
+        snprintf(path, sizeof(path), "%s/a", tmpdir);
+        QCOMPARE(truncate(path, 0), 0);
+        QCOMPARE(filemap_fill(page, 4096, 0, 4096), EIO);
+        filemap_set_use_mmap(false);
+    }
+};
+
+QTEST_APPLESS_MAIN(TestFilemap)
+#include "tst_filemap.moc"
@@ -0,0 +1,6 @@
+TARGET = test-scan
+include(../tests.pri)
+
+SOURCES += tst_scan.cpp
+SOURCES += ../../scan.cpp
+LIBS += -lpthread
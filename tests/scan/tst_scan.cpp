@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "scan.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <QtTest/QtTest>
+
+#include "../helpers.h"
+
+static void make_file(const char *dir, const char *name, int size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    QVERIFY(fd >= 0);
+    QCOMPARE(ftruncate(fd, size), 0);
+    close(fd);
+}
+
+// The names in 'dir' that are regular files or directories,
+// in readdir order
+static QStringList list_dir(const char *dir) {
+    QStringList names;
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    while (d && (de = readdir(d))) {
+        if (de->d_type == DT_REG || de->d_type == DT_DIR)
+            if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+                names << de->d_name;
+    }
+    if (d)
+        closedir(d);
+    return names;
+}
+
+static QStringList listing_names(const struct scan_dir *sd) {
+    QStringList names;
+    for (size_t i = 0; i < sd->entries.size(); i++)
+        names << &sd->names[sd->entries[i].name_offset];
+    return names;
+}
+
+class TestScan : public QObject {
+    Q_OBJECT
+
+    char tmpdir[64];
+    char subdir[100];
+
+private slots:
+    void init() {
+        strcpy(tmpdir, "/tmp/tst_scan.XXXXXX");
+        QVERIFY(mkdtemp(tmpdir) != 0);
+        snprintf(subdir, sizeof(subdir), "%s/sub", tmpdir);
+        QCOMPARE(mkdir(subdir, 0700), 0);
+    }
+
+    void cleanup() {
+        scan_finish();
+        scan_set_cache(NULL);
+        scan_set_lazy_files(false);
+        char cmd[100];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+        system(cmd);
+    }
+
+    void test_not_dir() {
+        struct stat st;
+        make_file(tmpdir, "file", 1);
+        QString path = QString(tmpdir) + "/file";
+        QVERIFY(!scan_start(path.toLocal8Bit().constData(), 2, 0, &st));
+    }
+
+    // Listings should have the entries in readdir order, with
+    // their sizes, and leave out anything FAT can't represent
+    void test_listing_data() {
+        QTest::addColumn<int>("threads");
+        QTest::addColumn<int>("batch");
+        QTest::newRow("1 thread") << 1 << 0;
+        QTest::newRow("4 threads") << 4 << 0;
+        QTest::newRow("1 thread, batched") << 1 << 8;
+        QTest::newRow("4 threads, batched") << 4 << 8;
+    }
+    void test_listing() {
+        QFETCH(int, threads);
+        QFETCH(int, batch);
+        for (int i = 0; i < 50; i++) {
+            char name[20];
+            snprintf(name, sizeof(name), "file%d", i);
+            make_file(tmpdir, name, i);
+            make_file(subdir, name, 100 + i);
+        }
+        QString link = QString(tmpdir) + "/link";
+        QCOMPARE(symlink("file1", link.toLocal8Bit().constData()), 0);
+
+        struct stat st;
+        QVERIFY(scan_start(tmpdir, threads, batch, &st));
+        QVERIFY(S_ISDIR(st.st_mode));
+
+        const struct scan_dir *root = scan_wait(0);
+        QCOMPARE(QString(&root->path[0]), QString(tmpdir));
+        QCOMPARE(listing_names(root), list_dir(tmpdir));
+        int sub_index = -1;
+        for (size_t i = 0; i < root->entries.size(); i++) {
+            const struct scan_entry *se = &root->entries[i];
+            const char *name = &root->names[se->name_offset];
+            if (!strcmp(name, "sub")) {
+                QCOMPARE((int) se->type, (int) SCAN_DIR);
+                sub_index = se->subdir;
+            } else {
+                QCOMPARE((int) se->type, (int) SCAN_FILE);
+                QCOMPARE((int) se->size, atoi(name + 4));
+            }
+        }
+        QVERIFY(sub_index > 0);
+        scan_release(0);
+
+        const struct scan_dir *sub = scan_wait(sub_index);
+        QCOMPARE(QString(&sub->path[0]), QString(subdir));
+        QCOMPARE(listing_names(sub), list_dir(subdir));
+        for (size_t i = 0; i < sub->entries.size(); i++) {
+            const struct scan_entry *se = &sub->entries[i];
+            const char *name = &sub->names[se->name_offset];
+            QCOMPARE((int) se->size, 100 + atoi(name + 4));
+        }
+        scan_release(sub_index);
+    }
+
+    // A deep tree should be read completely no matter which
+    // threads get to which directories
+    void test_deep() {
+        char path[PATH_MAX];
+        strcpy(path, subdir);
+        for (int i = 0; i < 20; i++) {
+            strcat(path, "/d");
+            QCOMPARE(mkdir(path, 0700), 0);
+            make_file(path, "f", i);
+        }
+
+        struct stat st;
+        QVERIFY(scan_start(tmpdir, 8, 4, &st));
+        int index = 0;
+        int depth = 0;
+        while (index >= 0) {
+            const struct scan_dir *sd = scan_wait(index);
+            int next = -1;
+            for (size_t i = 0; i < sd->entries.size(); i++) {
+                if (sd->entries[i].type == SCAN_DIR)
+                    next = sd->entries[i].subdir;
+            }
+            scan_release(index);
+            index = next;
+            depth++;
+        }
+        QCOMPARE(depth, 22);
+    }
+
+    // Every entry should be looked up once, however it was done,
+    // and a lazy scan should only look up the directories
+    void test_lookups_data() {
+        QTest::addColumn<int>("batch");
+        QTest::addColumn<bool>("lazy");
+        QTest::addColumn<int>("expected");
+        QTest::newRow("one by one") << 0 << false << 17;
+        QTest::newRow("batched") << 8 << false << 17;
+        QTest::newRow("lazy") << 8 << true << 2;
+    }
+    void test_lookups() {
+        QFETCH(int, batch);
+        QFETCH(bool, lazy);
+        QFETCH(int, expected);
+        for (int i = 0; i < 10; i++) {
+            char name[20];
+            snprintf(name, sizeof(name), "file%d", i);
+            make_file(tmpdir, name, i);
+            if (i < 5)
+                make_file(subdir, name, i);
+        }
+
+        struct stat st;
+        scan_set_lazy_files(lazy);
+        QVERIFY(scan_start(tmpdir, 2, batch, &st));
+        const struct scan_dir *root = scan_wait(0);
+        int sub_index = -1;
+        for (size_t i = 0; i < root->entries.size(); i++) {
+            if (root->entries[i].type == SCAN_DIR)
+                sub_index = root->entries[i].subdir;
+        }
+        QVERIFY(sub_index > 0);
+        QCOMPARE((int) scan_wait(sub_index)->entries.size(), 5);
+        // the root itself, "sub", and the 15 files unless lazy
+        QCOMPARE((int) scan_stat_calls(), expected);
+    }
+
+    // Unchanged directories should be listed from the scan cache,
+    // and changed ones read again
+    void test_cache() {
+        make_file(subdir, "a", 10);
+        make_file(subdir, "b", 20);
+        sleep(3); // the cache doesn't trust recently changed dirs
+
+        QString cache = QString(tmpdir) + "/cache";
+        QByteArray cache_name = cache.toLocal8Bit();
+        scan_set_cache(cache_name.constData());
+        struct stat st;
+        QVERIFY(scan_start(subdir, 2, 0, &st));
+        QCOMPARE((int) scan_wait(0)->entries.size(), 2);
+        scan_release(0);
+        scan_finish();
+        QCOMPARE(stat(cache_name.constData(), &st), 0);
+
+        // rewriting a file in place doesn't change the directory,
+        // but the cached entries are looked up again
+        make_file(subdir, "a", 30);
+        QVERIFY(scan_start(subdir, 2, 0, &st));
+        const struct scan_dir *sd = scan_wait(0);
+        QCOMPARE(listing_names(sd), list_dir(subdir));
+        for (size_t i = 0; i < sd->entries.size(); i++) {
+            if (!strcmp(&sd->names[sd->entries[i].name_offset], "a"))
+                QCOMPARE((int) sd->entries[i].size, 30);
+        }
+        scan_release(0);
+        scan_finish();
+
+        // adding a file does, so the directory is read again
+        make_file(subdir, "c", 40);
+        QVERIFY(scan_start(subdir, 2, 0, &st));
+        sd = scan_wait(0);
+        QCOMPARE(listing_names(sd), list_dir(subdir));
+        for (size_t i = 0; i < sd->entries.size(); i++) {
+            if (!strcmp(&sd->names[sd->entries[i].name_offset], "a"))
+                QCOMPARE((int) sd->entries[i].size, 30);
+        }
+        scan_release(0);
+    }
+};
+
+QTEST_APPLESS_MAIN(TestScan)
+#include "tst_scan.moc"
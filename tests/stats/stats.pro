@@ -0,0 +1,6 @@
+TARGET = test-stats
+include(../tests.pri)
+
+SOURCES += tst_stats.cpp
+SOURCES += ../../stats.cpp
+LIBS += -lpthread
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <QtTest/QtTest>
+
+static void *count_syscall(void *) {
+    stats_syscall(10);
+    return NULL;
+}
+
+static long syscalls() {
+    char buf[4096];
+    stats_format(buf, sizeof(buf), false);
+    return atol(strstr(buf, "\nsyscalls ") + 10);
+}
+
+class TestStats : public QObject {
+    Q_OBJECT
+
+private slots:
+    // Every value falls in a bucket whose limit is at or above it,
+    // and below the limit of the bucket before it
+    void test_buckets() {
+        QCOMPARE(stats_bucket(0), 0);
+        QCOMPARE(stats_bucket(3), 3);
+        QCOMPARE(stats_bucket(4), 4);
+        QCOMPARE(stats_bucket(0xffffffff), STATS_BUCKETS - 5);
+        QCOMPARE(stats_bucket_limit(STATS_BUCKETS - 5), 0xffffffffU);
+
+        uint32_t values[] = { 0, 1, 5, 8, 9, 10, 100, 1000, 12345,
+            1 << 20, (1 << 20) + 1, 0x7fffffff, 0x80000000, 0xffffffff };
+        for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+            int b = stats_bucket(values[i]);
+            QVERIFY(stats_bucket_limit(b) >= values[i]);
+            if (b > 0)
+                QVERIFY(stats_bucket_limit(b - 1) < values[i]);
+        }
+        // and the buckets are within 25% of their values
+        for (uint32_t v = 4; v < 100000; v++)
+            QVERIFY(stats_bucket_limit(stats_bucket(v)) <= v + v / 4);
+    }
+
+    void test_percentile() {
+        struct stats_histogram h;
+        memset(&h, 0, sizeof(h));
+        QCOMPARE(stats_percentile(&h, NULL, 0.99), 0U);
+
+        for (uint32_t v = 1; v <= 100; v++)
+            stats_record(&h, v);
+        QCOMPARE(stats_count(&h, NULL), (uint64_t) 100);
+        QCOMPARE(stats_percentile(&h, NULL, 0.5),
+                 stats_bucket_limit(stats_bucket(50)));
+        QCOMPARE(stats_percentile(&h, NULL, 0.99),
+                 stats_bucket_limit(stats_bucket(99)));
+        QCOMPARE(stats_percentile(&h, NULL, 1.0),
+                 stats_bucket_limit(stats_bucket(100)));
+        QCOMPARE(stats_percentile(&h, NULL, 0.0), 1U);
+    }
+
+    // Only the values since the snapshot count
+    void test_since() {
+        struct stats_histogram h, before;
+        memset(&h, 0, sizeof(h));
+        for (int i = 0; i < 1000; i++)
+            stats_record(&h, 10);
+        stats_snapshot(&h, &before);
+        for (int i = 0; i < 10; i++)
+            stats_record(&h, 5000);
+        QCOMPARE(stats_count(&h, &before), (uint64_t) 10);
+        QCOMPARE(stats_percentile(&h, &before, 0.5),
+                 stats_bucket_limit(stats_bucket(5000)));
+        QCOMPARE(stats_percentile(&h, NULL, 0.5),
+                 stats_bucket_limit(stats_bucket(10)));
+    }
+
+    void test_format() {
+        char buf[4096];
+        char small[10];
+
+        QCOMPARE(stats_region_start(), (uint64_t) 0);  // still off
+        stats_enable();
+        uint64_t start = stats_region_start();
+        QVERIFY(start != 0);
+        stats_region_done(STATS_DIR, start, 4096);
+        stats_region_done(STATS_DIR, start, 512);
+        stats_syscall(100);
+        stats_syscall(0);
+
+        int len = stats_format(buf, sizeof(buf), false);
+        QCOMPARE(len, (int) strlen(buf));
+        QVERIFY(strstr(buf, "\ndir "));
+        QVERIFY(strstr(buf, "\nsyscalls 2\nsyscall_bytes 100\n"));
+
+        len = stats_format(buf, sizeof(buf), true);
+        QCOMPARE(len, (int) strlen(buf));
+        QVERIFY(strstr(buf, "\"dir\": {\"reads\": 2, \"bytes\": 4608,"));
+        QVERIFY(strstr(buf, "\"fat\": {\"reads\": 0, \"bytes\": 0,"));
+        QVERIFY(strstr(buf, "\"syscalls\": 2, \"syscall_bytes\": 100}"));
+
+        // too small: says how much it needs
+        QCOMPARE(stats_format(small, sizeof(small), true), len);
+        QCOMPARE(strlen(small), sizeof(small) - 1);
+    }
+
+    // Threads that come and go keep their counts in the totals
+    void test_threads() {
+        stats_enable();
+        long before = syscalls();
+        for (int i = 0; i < 100; i++) {
+            pthread_t thread;
+            QCOMPARE(pthread_create(&thread, NULL, count_syscall, NULL), 0);
+            pthread_join(thread, NULL);
+        }
+        QCOMPARE(syscalls(), before + 100);
+    }
+};
+
+QTEST_APPLESS_MAIN(TestStats)
+#include "tst_stats.moc"
@@ -0,0 +1,7 @@
+TARGET = test-trace
+include(../tests.pri)
+
+SOURCES += tst_trace.cpp
+SOURCES += ../../trace.cpp
+SOURCES += ../../stats.cpp
+LIBS += -lpthread
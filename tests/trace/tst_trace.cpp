@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <QtTest/QtTest>
+
+class TestTrace : public QObject {
+    Q_OBJECT
+
+    char filename[64];
+
+private slots:
+    void init() {
+        strcpy(filename, "/tmp/tst_trace.XXXXXX");
+        int fd = mkstemp(filename);
+        QVERIFY(fd >= 0);
+        close(fd);
+    }
+
+    void cleanup() {
+        unlink(filename);
+    }
+
+    // What is recorded comes back, and a record cut short at the end
+    // (from a server that was killed) is left out
+    void test_round_trip() {
+        struct trace_header hdr = { 123456789, 1ULL << 40 };
+        QVERIFY(trace_create(filename, &hdr));
+        QVERIFY(trace_recording());
+        trace_add(0, 0x123456789aULL, 4096, 3);
+        trace_add(1, 512, 1 << 20, TRACE_REGION_UNKNOWN);
+        sleep(1);
+        trace_add(0, 0, 0, 0);  // a second later, so it flushes
+        FILE *f = fopen(filename, "ab");
+        QVERIFY(f != NULL);
+        fputs("partial", f);
+        fclose(f);
+
+        struct trace_header got;
+        std::vector<struct trace_record> records;
+        QVERIFY(trace_load(filename, &got, records));
+        QCOMPARE(got.sectors, hdr.sectors);
+        QCOMPARE(got.free_space, hdr.free_space);
+        QCOMPARE(records.size(), (size_t) 3);
+        QCOMPARE(records[0].from, 0x123456789aULL);
+        QCOMPARE(records[0].len, 4096U);
+        QCOMPARE((int) records[0].type, 0);
+        QCOMPARE((int) records[0].region, 3);
+        QCOMPARE((int) records[1].type, 1);
+        QCOMPARE((int) records[1].region, TRACE_REGION_UNKNOWN);
+        QCOMPARE(records[1].len, 1U << 20);
+        QVERIFY(records[0].time_us <= records[1].time_us);
+        QVERIFY(records[2].time_us >= records[1].time_us + 1000000);
+    }
+
+    // trace_flush writes out what was added, without waiting for
+    // another record
+    void test_flush() {
+        struct trace_header hdr = { 1, 0 };
+        QVERIFY(trace_create(filename, &hdr));
+        trace_add(0, 4096, 512, 0);
+
+        struct trace_header got;
+        std::vector<struct trace_record> records;
+        QVERIFY(trace_load(filename, &got, records));
+        QCOMPARE(records.size(), (size_t) 0);
+        trace_flush();
+        QVERIFY(trace_load(filename, &got, records));
+        QCOMPARE(records.size(), (size_t) 1);
+        QCOMPARE(records[0].from, 4096ULL);
+    }
+
+    void test_not_a_trace() {
+        FILE *f = fopen(filename, "wb");
+        QVERIFY(f != NULL);
+        fputs("this is not a trace file, but it's long enough", f);
+        fclose(f);
+
+        struct trace_header hdr;
+        std::vector<struct trace_record> records;
+        QVERIFY(!trace_load(filename, &hdr, records));
+        QCOMPARE(errno, EINVAL);
+        QVERIFY(!trace_load("/nonexistent/trace", &hdr, records));
+        QCOMPARE(errno, ENOENT);
+    }
+};
+
+QTEST_APPLESS_MAIN(TestTrace)
+#include "tst_trace.moc"
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "worker.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <vector>
+
+#include <QtTest/QtTest>
+
+#include "../helpers.h"
+
+// Reads at SLOW_OFFSET come from a fifo, as a stand-in for a file
+// on wedged storage. They block until the test writes to the fifo.
+static const uint64_t SLOW_OFFSET = 1 << 20;
+static char fifo_path[PATH_MAX];
+
+static int test_fill(void *buf, uint64_t from, uint32_t len) {
+    if (from != SLOW_OFFSET) {
+        memset(buf, (char) from, len);
+        return 0;
+    }
+    int fd = open(fifo_path, O_RDONLY);
+    if (fd < 0)
+        return errno;
+    ssize_t nread = read(fd, buf, len);
+    close(fd);
+    return nread < 0 ? errno : 0;
+}
+
+static int test_describe(uint64_t from, char *buf, int size) {
+    if (from != SLOW_OFFSET)
+        return -1;
+    return snprintf(buf, size, "%s", fifo_path);
+}
+
+struct reply {
+    char handle[8];
+    int error;
+    char first_byte;
+};
+
+static std::vector<reply> replies;
+static pthread_mutex_t replies_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void test_reply(const char *handle, int error, void *buf,
+        uint32_t len) {
+    reply r;
+    memcpy(r.handle, handle, sizeof(r.handle));
+    r.error = error;
+    r.first_byte = len && buf ? *(char *) buf : 0;
+    pthread_mutex_lock(&replies_lock);
+    replies.push_back(r);
+    pthread_mutex_unlock(&replies_lock);
+}
+
+// Wait up to 'ms' milliseconds for at least 'count' replies
+static int wait_replies(int count, int ms) {
+    int n = 0;
+    for (int waited = 0; waited <= ms; waited += 10) {
+        pthread_mutex_lock(&replies_lock);
+        n = replies.size();
+        pthread_mutex_unlock(&replies_lock);
+        if (n >= count)
+            break;
+        usleep(10 * 1000);
+    }
+    return n;
+}
+
+static void queue(const char *handle, uint64_t from) {
+    worker_queue(handle, from, 4096, malloc(4096));
+}
+
+class TestWorker : public QObject {
+    Q_OBJECT
+
+    char tmpdir[64];
+
+private slots:
+    void init() {
+        strcpy(tmpdir, "/tmp/tst_worker.XXXXXX");
+        QVERIFY(mkdtemp(tmpdir) != 0);
+        snprintf(fifo_path, sizeof(fifo_path), "%s/slow", tmpdir);
+        QCOMPARE(mkfifo(fifo_path, 0600), 0);
+        replies.clear();
+    }
+
+    void cleanup() {
+        char cmd[100];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+        system(cmd);
+    }
+
+    // Queued reads should be answered with the data
+    void test_read() {
+        QVERIFY(worker_init(test_fill, test_reply, test_describe, 0));
+        queue("read1...", 1);
+        queue("read2...", 2);
+        QCOMPARE(wait_replies(2, 5000), 2);
+        QVERIFY(memcmp(replies[0].handle, "read1...", 8) == 0);
+        QCOMPARE(replies[0].error, 0);
+        QCOMPARE(replies[0].first_byte, (char) 1);
+        QVERIFY(memcmp(replies[1].handle, "read2...", 8) == 0);
+        QCOMPARE(replies[1].first_byte, (char) 2);
+    }
+
+    // Even without a deadline, a stuck read shouldn't hold up
+    // the reads queued after it
+    void test_overlap() {
+        QVERIFY(worker_init(test_fill, test_reply, test_describe, 0));
+        queue("slow....", SLOW_OFFSET);
+        usleep(50 * 1000); // let a worker get stuck on it
+        queue("fast....", 5);
+        QCOMPARE(wait_replies(1, 5000), 1);
+        QVERIFY(memcmp(replies[0].handle, "fast....", 8) == 0);
+        QCOMPARE(replies[0].first_byte, (char) 5);
+
+        int fd = open(fifo_path, O_WRONLY);
+        QVERIFY(fd >= 0);
+        QCOMPARE(write(fd, "x", 1), (ssize_t) 1);
+        close(fd);
+        QCOMPARE(wait_replies(2, 5000), 2);
+        QVERIFY(memcmp(replies[1].handle, "slow....", 8) == 0);
+        QCOMPARE(replies[1].error, 0);
+        QCOMPARE(replies[1].first_byte, 'x');
+    }
+
+    // A read that's stuck should be answered with EIO after the
+    // deadline, without holding up the reads queued after it,
+    // and its late result should be thrown away.
+    void test_deadline() {
+        QVERIFY(worker_init(test_fill, test_reply, test_describe, 200));
+        queue("slow....", SLOW_OFFSET);
+        usleep(50 * 1000); // let a worker get stuck on it
+        queue("fast....", 3);
+
+        QCOMPARE(wait_replies(2, 5000), 2);
+        QVERIFY(memcmp(replies[0].handle, "fast....", 8) == 0);
+        QCOMPARE(replies[0].error, 0);
+        QVERIFY(memcmp(replies[1].handle, "slow....", 8) == 0);
+        QCOMPARE(replies[1].error, EIO);
+
+        // unstick it
+        int fd = open(fifo_path, O_WRONLY);
+        QVERIFY(fd >= 0);
+        QCOMPARE(write(fd, "x", 1), (ssize_t) 1);
+        close(fd);
+        QCOMPARE(wait_replies(3, 300), 2);
+
+        // and the workers still work
+        queue("after...", 4);
+        QCOMPARE(wait_replies(3, 5000), 3);
+        QVERIFY(memcmp(replies[2].handle, "after...", 8) == 0);
+        QCOMPARE(replies[2].error, 0);
+    }
+};
+
+QTEST_APPLESS_MAIN(TestWorker)
+#include "tst_worker.moc"
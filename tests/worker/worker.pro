@@ -0,0 +1,6 @@
+TARGET = test-worker
+include(../tests.pri)
+
+SOURCES += tst_worker.cpp
+SOURCES += ../../worker.cpp
+LIBS += -lpthread
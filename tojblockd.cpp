@@ -19,13 +19,13 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 
-
 #include <sys/mount.h>  /* BLKROSET */
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -34,6 +34,11 @@
 
 #include "nbd.h"
 #include "vfat.h"
+#include "filemap.h"
+#include "serve.h"
+#include "watch.h"
+#include "stats.h"
+#include "trace.h"
 #include "sd_notify.h"
 
 #ifndef PROGRAM_NAME
@@ -44,12 +49,28 @@
 #define PROGRAM_VERSION "experimental"
 #endif
 
+/* How long --watch waits for changes to settle before applying them */
+#define WATCH_DELAY_MS 500
+
 static int opt_help;
 static int opt_version;
 static int opt_daemonize;
 static int opt_debug;
+static int opt_mmap;
 static const char *opt_device = "/dev/nbd0";
 static const char *opt_label;
+static int opt_fd_cache = 16;
+static int opt_stream_size;
+static int opt_prefetch;
+static int opt_prefetch_budget = 16;
+static int opt_deadline = 10000;
+static int opt_scan_threads = -1; /* use vfat's default */
+static int opt_scan_batch = -1; /* use vfat's default */
+static const char *opt_scan_cache;
+static int opt_lazy_scan;
+static int opt_watch;
+static const char *opt_stats_socket;
+static const char *opt_record_trace;
 static const char *program_name;
 
 static struct option options[] = {
@@ -59,6 +80,19 @@ static struct option options[] = {
 	{ "device", required_argument, NULL, 'd' },
 	{ "label", required_argument, NULL, 'l' },
 	{ "debug", no_argument, &opt_debug, 1 },
+	{ "fd-cache", required_argument, NULL, 'f' },
+	{ "mmap", no_argument, &opt_mmap, 1 },
+	{ "stream-size", required_argument, NULL, 's' },
+	{ "prefetch", required_argument, NULL, 'p' },
+	{ "prefetch-budget", required_argument, NULL, 'b' },
+	{ "deadline", required_argument, NULL, 't' },
+	{ "scan-threads", required_argument, NULL, 'j' },
+	{ "scan-batch", required_argument, NULL, 'B' },
+	{ "scan-cache", required_argument, NULL, 'C' },
+	{ "lazy-scan", no_argument, &opt_lazy_scan, 1 },
+	{ "watch", no_argument, &opt_watch, 1 },
+	{ "stats-socket", required_argument, NULL, 'S' },
+	{ "record-trace", required_argument, NULL, 'T' },
 
 	{ 0, 0, 0, 0 }
 };
@@ -74,6 +108,38 @@ static void usage(FILE *out)
 		"      instead of the default /dev/nbd0\n"
 		"  --label=LABEL  Use the given label as the volume label\n"
 		"  --debug      Print log messages that help with debugging\n"
+		"  --fd-cache=N  Keep up to N files open between reads\n"
+		"      (default 16, 0 to always reopen)\n"
+		"  --mmap       Read files through memory mappings\n"
+		"  --stream-size=MIB  Don't keep files of MIB MiB or more in\n"
+		"      the page cache after serving them (default 0, off)\n"
+		"  --prefetch=KIB  When a directory is read, read ahead the\n"
+		"      first KIB KiB of its files (default 0, off)\n"
+		"  --prefetch-budget=MIB  Prefetch at most MIB MiB per second\n"
+		"      (default 16)\n"
+		"  --deadline=MS  Fail reads that take longer than MS\n"
+		"      milliseconds with an I/O error (default 10000,\n"
+		"      0 to wait forever)\n"
+		"  --scan-threads=N  Read the directory tree with N threads\n"
+		"      (default 4, 0 for a sequential walk)\n"
+		"  --scan-batch=N  Have each scanning thread look up to N\n"
+		"      entries at once with io_uring (default 32, 0 to\n"
+		"      look them up one at a time)\n"
+		"  --scan-cache=FILE  Remember the directory tree in FILE\n"
+		"      and only read directories that changed since the\n"
+		"      last start. Files changed in place keep their old\n"
+		"      size until their directory changes. Not used with\n"
+		"      --scan-threads=0 or --lazy-scan\n"
+		"  --lazy-scan  Start serving once the directories are read\n"
+		"      and look up the files in each directory when the\n"
+		"      host first reads it. Not used with --scan-threads=0\n"
+		"  --watch      Keep the image up to date with files that\n"
+		"      are added, changed or removed while it's served\n"
+		"  --stats-socket=PATH  Count reads by region of the image\n"
+		"      and answer queries for the counts on a unix socket\n"
+		"      at PATH. Send it \"text\" or \"json\" and a newline\n"
+		"  --record-trace=FILE  Record the requests in FILE, to\n"
+		"      replay them with tojblockd-replay\n"
 		"This program will read a directory (and its subdirectories)\n"
 		"and present it as a network block device in FAT32 format.\n"
 		"The network block device can then be mounted normally.\n"
@@ -82,8 +148,9 @@ static void usage(FILE *out)
 		"without interfering with normal use of the directory.\n"
 		"Limitations:\n"
 		"  * Currently read-only\n"
-		"  * Files created while the program runs may not be included\n"
-		"    in the FAT image\n"
+		"  * Files created while the program runs are not included\n"
+		"    in the FAT image, unless --watch is given or the serving\n"
+		"    process gets a SIGHUP to scan the directory again\n"
 		, program_name, program_name, program_name);
 }
 
@@ -169,85 +236,77 @@ static void use_socket(int dev_fd, int sock_fd)
 			strerror(errno));
 }
 
-static void read_buf(int sock_fd, void *buf, size_t size)
+/* Say how far the scan is. vfat_init calls this about once a second. */
+static void scan_status(const struct vfat_progress *p)
 {
-	size_t total = 0;
-	ssize_t nread;
-
-	do {
-		nread = read(sock_fd, (char *) buf + total, size - total);
-		if (nread < 0 && errno == EINTR)
-			continue;
-		if (nread < 0)
-			fatal("read error: %s\n", strerror(errno));
-		total += nread;
-	} while (size > total);
+	char eta[40] = "";
+	double rate = (p->dirs + p->files) / p->elapsed;
+
+	/* More directories turn up as the scan goes on, so this is
+	 * the least time it could take */
+	if (p->dirs_found > p->dirs && p->dirs > 0)
+		snprintf(eta, sizeof(eta), ", at least %.0f s left",
+			p->elapsed * (p->dirs_found - p->dirs) / p->dirs);
+	sd_notifyf(0, "STATUS=scanning directory tree, %lu of %lu "
+		"directories, %lu files, %.0f entries/s%s, skipped "
+		"%lu bad names, %lu too large, %lu for lack of room, "
+		"%lu other",
+		(unsigned long) p->dirs, (unsigned long) p->dirs_found,
+		(unsigned long) p->files, rate, eta,
+		(unsigned long) p->skipped_name,
+		(unsigned long) p->skipped_size,
+		(unsigned long) p->skipped_space,
+		(unsigned long) p->skipped_other);
 }
 
-static void write_buf(int sock_fd, void *buf, size_t size)
+/* Rebuild the image whenever SIGHUP comes in. The signal is blocked
+ * in every thread, so this one picks it up with sigwait(). */
+static void *rescan_thread(void *arg)
 {
-	size_t total = 0;
-	ssize_t nsent;
+	const char *target_dir = (const char *) arg;
+	struct statvfs target_st;
+	sigset_t set;
+	int sig;
 
-	do {
-		nsent = write(sock_fd, (char *) buf + total, size - total);
-		if (nsent < 0 && errno == EINTR)
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	for (;;) {
+		if (sigwait(&set, &sig) != 0)
+			continue;
+		if (statvfs(target_dir, &target_st) < 0) {
+			warning("could not rescan %s: %s\n", target_dir,
+				strerror(errno));
 			continue;
-		if (nsent < 0)
-			fatal("reply error: %s\n", strerror(errno));
-		total += nsent;
-	} while (size > total);
+		}
+		info("rescanning %s\n", target_dir);
+		vfat_rescan((uint64_t) target_st.f_frsize
+			* target_st.f_bavail);
+	}
+	return NULL;
 }
 
-static void send_reply(int sock_fd, const char *handle, int error)
+static void start_rescan_thread(const char *target_dir)
 {
-	struct nbd_reply reply;
+	pthread_t thread;
 
-	reply.magic = htobe32(NBD_REPLY_MAGIC);
-	reply.error = htobe32(error);
-	memcpy(reply.handle, handle, sizeof(reply.handle));
-	write_buf(sock_fd, &reply, sizeof(reply));
+	if (pthread_create(&thread, NULL, rescan_thread,
+			(void *) target_dir) != 0)
+		warning("could not start rescan thread\n");
+	else
+		pthread_detach(thread);
 }
 
-static void serve(int sock_fd)
+static int parse_count(const char *arg, const char *opt)
 {
-	struct nbd_request req;
-	void *buf;
-	int err;
+	char *end;
+	long val = strtol(arg, &end, 10);
 
-	for (;;) {
-		read_buf(sock_fd, &req, sizeof(req));
-		req.magic = be32toh(req.magic);
-		req.type = be32toh(req.type);
-		req.from = be64toh(req.from);
-		req.len = be32toh(req.len);
-
-		if (req.magic != NBD_REQUEST_MAGIC)
-			fatal("bad request magic: 0x%lx\n", req.magic);
-
-		switch (req.type) {
-		case NBD_CMD_READ:
-			debug("READ %lu bytes starting 0x%llx\n", (unsigned long) req.len, (unsigned long long) req.from);
-			buf = malloc(req.len);
-			err = vfat_fill(buf, req.from, req.len);
-			send_reply(sock_fd, req.handle, err);
-			if (!err)
-				write_buf(sock_fd, buf, req.len);
-			free(buf);
-			break;
-		case NBD_CMD_WRITE:
-			debug("WRITE %lu bytes starting 0x%llx\n", (unsigned long) req.len, (unsigned long long) req.from);
-			buf = malloc(req.len);
-			read_buf(sock_fd, buf, req.len);
-			free(buf);
-			send_reply(sock_fd, req.handle, EROFS);
-			break;
-		default:
-			info("COMMAND %u\n", req.type);
-			send_reply(sock_fd, req.handle, EINVAL);
-			break;
-		}
+	if (*arg == 0 || *end != 0 || val < 0 || val > 1000000) {
+		fprintf(stderr, "%s: bad value for %s: %s\n",
+			program_name, opt, arg);
+		exit(2);
 	}
+	return val;
 }
 
 static void parse_opts(int argc, char **argv)
@@ -263,6 +322,27 @@ static void parse_opts(int argc, char **argv)
 			opt_device = optarg;
 		if (c == 'l') /* --label */
 			opt_label = optarg;
+		if (c == 'f') /* --fd-cache */
+			opt_fd_cache = parse_count(optarg, "--fd-cache");
+		if (c == 's') /* --stream-size */
+			opt_stream_size = parse_count(optarg, "--stream-size");
+		if (c == 'p') /* --prefetch */
+			opt_prefetch = parse_count(optarg, "--prefetch");
+		if (c == 'b') /* --prefetch-budget */
+			opt_prefetch_budget = parse_count(optarg,
+				"--prefetch-budget");
+		if (c == 't') /* --deadline */
+			opt_deadline = parse_count(optarg, "--deadline");
+		if (c == 'j') /* --scan-threads */
+			opt_scan_threads = parse_count(optarg, "--scan-threads");
+		if (c == 'B') /* --scan-batch */
+			opt_scan_batch = parse_count(optarg, "--scan-batch");
+		if (c == 'C') /* --scan-cache */
+			opt_scan_cache = optarg;
+		if (c == 'S') /* --stats-socket */
+			opt_stats_socket = optarg;
+		if (c == 'T') /* --record-trace */
+			opt_record_trace = optarg;
 	}
 }
 
@@ -294,8 +374,10 @@ int main(int argc, char **argv)
 	uint64_t image_size = 0;
 	uint64_t free_space = 0;
 	int block_size = SECTOR_SIZE;
+	struct trace_header trace_hdr;
 	int dev_fd = -1;
 	int sv[2];
+	int err;
 
 	parse_opts(argc, argv);
 
@@ -328,6 +410,9 @@ int main(int argc, char **argv)
 
 	set_read_only(dev_fd); /* only read-only is supported, for now */
 	set_block_size(dev_fd, block_size);
+	/* what a replay of the trace needs to lay out the same image */
+	trace_hdr.sectors = (image_size + block_size - 1) / block_size;
+	trace_hdr.free_space = free_space;
 	image_size = set_image_size(dev_fd, image_size, block_size);
 
 	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
@@ -341,15 +426,54 @@ int main(int argc, char **argv)
 	// is simple and could be used by any service launcher.
 	// Just pass in the name of a unix dgram socket in $NOTIFY_SOCKET
 	// and listen for a packet with the line "READY=1".
+	/* SIGHUP asks the serving process for a rescan. The nbd ioctl
+	 * in the parent would give up on a signal, so it ignores it. */
+	signal(SIGHUP, SIG_IGN);
 	if (fork() == 0) {
 		/* child */
+		sigset_t hup;
 
 		close(sv[0]);
+		/* for rescan_thread, which all the other threads leave it to */
+		sigemptyset(&hup);
+		sigaddset(&hup, SIGHUP);
+		pthread_sigmask(SIG_BLOCK, &hup, NULL);
+		signal(SIGHUP, SIG_DFL);
 		// vfat_init could take a while to say what's going on
 		sd_notify(0, "STATUS=scanning directory tree");
+		filemap_set_fd_cache_size(opt_fd_cache);
+		filemap_set_use_mmap(opt_mmap);
+		/* no file can be 4096 MiB or larger in the image anyway */
+		filemap_set_stream_threshold(opt_stream_size < 4096
+			? (uint32_t) opt_stream_size << 20 : 0xffffffff);
+		if (opt_scan_threads >= 0)
+			vfat_set_scan_threads(opt_scan_threads);
+		if (opt_scan_batch >= 0)
+			vfat_set_scan_batch(opt_scan_batch);
+		vfat_set_scan_cache(opt_scan_cache);
+		vfat_set_lazy(opt_lazy_scan);
+		vfat_set_progress(scan_status);
+		filemap_set_prefetch((uint32_t) opt_prefetch << 10,
+			(uint32_t) (opt_prefetch_budget < 4096
+				? opt_prefetch_budget : 4095) << 20);
 		vfat_init(target_dir, free_space, opt_label);
-		sd_notify(1, "READY=1\nSTATUS=ready");
-		serve(sv[1]);
+		if (opt_watch && !watch_start(WATCH_DELAY_MS))
+			warning("can't watch %s for changes: %s\n",
+				target_dir, strerror(errno));
+		start_rescan_thread(target_dir);
+		if (opt_stats_socket && !stats_listen(opt_stats_socket))
+			warning("can't listen on %s: %s\n", opt_stats_socket,
+				strerror(errno));
+		if (opt_record_trace
+				&& !trace_create(opt_record_trace, &trace_hdr))
+			warning("can't record trace in %s: %s\n",
+				opt_record_trace, strerror(errno));
+		serve_set_debug(opt_debug);
+		/* keep NOTIFY_SOCKET for the status updates */
+		sd_notify(0, "READY=1\nSTATUS=ready");
+		err = serve(sv[1], opt_deadline);
+		if (err)
+			fatal("serving failed: %s\n", strerror(err));
 	} else {
 		/* parent */
 		close(sv[1]);
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "stats.h"
+
+#define TRACE_MAGIC "TOJTRACE"
+#define HEADER_SIZE 32
+
+static FILE *trace_file;
+static uint64_t trace_start, last_flush;
+
+static void put_le(uint8_t *p, uint64_t val, int bytes)
+{
+	for (int i = 0; i < bytes; i++, val >>= 8)
+		p[i] = val & 0xff;
+}
+
+static uint64_t get_le(const uint8_t *p, int bytes)
+{
+	uint64_t val = 0;
+
+	while (bytes--)
+		val = val << 8 | p[bytes];
+	return val;
+}
+
+bool trace_create(const char *filename, const struct trace_header *hdr)
+{
+	uint8_t buf[HEADER_SIZE];
+
+	if (trace_file)
+		fclose(trace_file);
+	trace_file = fopen(filename, "wb");
+	if (!trace_file)
+		return false;
+	memcpy(buf, TRACE_MAGIC, 8);
+	put_le(buf + 8, TRACE_VERSION, 4);
+	put_le(buf + 12, TRACE_RECORD_SIZE, 4);
+	put_le(buf + 16, hdr->sectors, 8);
+	put_le(buf + 24, hdr->free_space, 8);
+	if (fwrite(buf, sizeof(buf), 1, trace_file) != 1
+			|| fflush(trace_file) != 0) {
+		int err = errno;
+
+		fclose(trace_file);
+		trace_file = NULL;
+		errno = err;
+		return false;
+	}
+	trace_start = last_flush = stats_now_us();
+	return true;
+}
+
+bool trace_recording()
+{
+	return trace_file != NULL;
+}
+
+void trace_add(uint8_t type, uint64_t from, uint32_t len, uint8_t region)
+{
+	uint8_t buf[TRACE_RECORD_SIZE];
+	uint64_t now;
+
+	if (!trace_file)
+		return;
+	now = stats_now_us();
+	put_le(buf, now - trace_start, 8);
+	put_le(buf + 8, from, 8);
+	put_le(buf + 16, len, 4);
+	buf[20] = type;
+	buf[21] = region;
+	buf[22] = buf[23] = 0;
+	fwrite(buf, sizeof(buf), 1, trace_file);
+	/* the server is usually stopped by a signal, so don't keep
+	 * much in the buffer */
+	if (now >= last_flush + 1000000)
+		trace_flush();
+}
+
+void trace_flush()
+{
+	if (!trace_file)
+		return;
+	fflush(trace_file);
+	last_flush = stats_now_us();
+}
+
+bool trace_load(const char *filename, struct trace_header *hdr,
+	std::vector<struct trace_record> &records)
+{
+	uint8_t buf[HEADER_SIZE];
+	struct trace_record rec;
+	uint32_t record_size;
+	FILE *f = fopen(filename, "rb");
+
+	if (!f)
+		return false;
+	if (fread(buf, sizeof(buf), 1, f) != 1
+			|| memcmp(buf, TRACE_MAGIC, 8)
+			|| get_le(buf + 8, 4) != TRACE_VERSION) {
+		fclose(f);
+		errno = EINVAL;
+		return false;
+	}
+	/* later versions may add fields at the end of each record */
+	record_size = get_le(buf + 12, 4);
+	if (record_size < TRACE_RECORD_SIZE || record_size > sizeof(buf)) {
+		fclose(f);
+		errno = EINVAL;
+		return false;
+	}
+	hdr->sectors = get_le(buf + 16, 8);
+	hdr->free_space = get_le(buf + 24, 8);
+
+	records.clear();
+	/* a partial record at the end is from a server that was
+	 * killed while writing it */
+	while (fread(buf, record_size, 1, f) == 1) {
+		rec.time_us = get_le(buf, 8);
+		rec.from = get_le(buf + 8, 8);
+		rec.len = get_le(buf + 16, 4);
+		rec.type = buf[20];
+		rec.region = buf[21];
+		records.push_back(rec);
+	}
+	fclose(f);
+	return true;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Traces of the requests that the host made, for replaying them
+ * later with tojblockd-replay. A trace file is a header followed by
+ * fixed-size records, all little-endian:
+ *
+ *   header: "TOJTRACE", version (4 bytes), record size (4 bytes),
+ *           image size in sectors (8 bytes), free space in bytes (8)
+ *   record: time in microseconds since the trace started (8 bytes),
+ *           offset (8), length (4), nbd command (1), region (1),
+ *           zero (2)
+ *
+ * The image size and the free space are what vfat_adjust_size() and
+ * vfat_init() were given, so that a replay can build the same layout
+ * from the same directory.
+ */
+
+#include <stdint.h>
+
+#include <vector>
+
+#define TRACE_VERSION 1
+#define TRACE_RECORD_SIZE 24
+/* region of a request whose region couldn't be looked up */
+#define TRACE_REGION_UNKNOWN 0xff
+
+struct trace_header {
+	uint64_t sectors;
+	uint64_t free_space;
+};
+
+struct trace_record {
+	uint64_t time_us;
+	uint64_t from;
+	uint32_t len;
+	uint8_t type;  /* NBD_CMD_READ etc. */
+	uint8_t region;  /* enum stats_region, or TRACE_REGION_UNKNOWN */
+};
+
+/* Start recording to 'filename', replacing it and ending any trace
+ * that was being recorded.
+ * Result: false if it couldn't be created, with errno set. */
+bool trace_create(const char *filename, const struct trace_header *hdr);
+
+/* Result: true if trace_create() was called */
+bool trace_recording();
+
+/* Record a request. The time is filled in here. The records are
+ * written out when the next one comes a second or more after the last
+ * write, or by trace_flush(). Only call this from one thread. */
+void trace_add(uint8_t type, uint64_t from, uint32_t len, uint8_t region);
+
+/* Write out the records added so far. Call it from the thread that
+ * calls trace_add(), for example while it waits for requests. */
+void trace_flush();
+
+/* Read a whole trace file.
+ * Result: false if it can't be read or isn't a trace, with errno set. */
+bool trace_load(const char *filename, struct trace_header *hdr,
+	std::vector<struct trace_record> &records);
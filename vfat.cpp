@@ -26,16 +26,21 @@
 
 #include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <sys/stat.h>
+#include <dirent.h>
 #include <fts.h>
 
-#include "ConvertUTF.h"
-
 #include "fat.h"
 #include "dir.h"
 #include "filemap.h"
+#include "scan.h"
+#include "stats.h"
 
 #define SECTORS_PER_CLUSTER (CLUSTER_SIZE / SECTOR_SIZE)
 #define RESERVED_SECTORS 32  /* before first FAT */
@@ -91,7 +96,58 @@
  * but at least not limiting the types of a or b */
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
-static const char *g_top_dir;
+static const char *g_top_dir;  /* for vfat_rescan() */
+
+/* Threads for scanning the target directory.
+ * 0 means scan with fts in this thread. */
+#define DEFAULT_SCAN_THREADS 4
+static int scan_threads = DEFAULT_SCAN_THREADS;
+/* Lookups each scanning thread keeps in flight */
+#define DEFAULT_SCAN_BATCH 32
+static int scan_batch = DEFAULT_SCAN_BATCH;
+
+/*
+ * With lazy scanning, vfat_init only walks the directories and
+ * leaves the files to be looked up when the host first reads the
+ * directory they are in. Each directory is given clusters for all
+ * its entries up front, so that the directories can be closed and
+ * the image served while filemaps are still being added at the end.
+ * The free space is set aside before that, so that the FSInfo sector
+ * can give the free count and hosts don't count it in the FAT.
+ *
+ * lazy_names has, by dir index, the names of the files that still
+ * have to be added to that directory, each terminated by a NUL.
+ * It and the rest of the image are guarded by image_lock while
+ * lazy_count is nonzero. When the last directory is done, the
+ * image is finalized.
+ *
+ * With live updates, the image stays guarded by image_lock for good.
+ * Otherwise a rescan sets 'rescanning' for as long as it changes the
+ * image, and waits on drain_cond for the readers that went in without
+ * the lock (counted in unlocked_readers) to come out before it takes it.
+ */
+static bool lazy_scan;
+static std::vector<std::vector<char> > lazy_names;
+static int lazy_count;
+static uint64_t lazy_free_space;
+static pthread_rwlock_t image_lock =
+	PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static bool live_updates;
+static bool rescanning;
+static int unlocked_readers;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+/* Changed by vfat_rescan(), under image_lock */
+static int generation;
+
+/* Counted during every scan, but only reported during vfat_init().
+ * progress_lock and progress_cond are for stopping progress_thread. */
+static struct vfat_progress progress;
+static vfat_progress_fn progress_fn;
+static bool progress_reporting;
+static double progress_start;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond;
 
 static uint32_t g_fat_sectors;
 static uint32_t g_data_clusters;
@@ -134,12 +190,13 @@ static uint8_t boot_sector[SECTOR_SIZE] = {
 };
 	
 static uint8_t fsinfo_sector[SECTOR_SIZE];
+#define FSINFO_FREE_COUNT 0x1e8  /* offset in fsinfo_sector */
 
 // These are initialized by vfat_init
 static filename_t dot_name;  // contains "."
 static filename_t dot_dot_name;  // contains ".."
 
-int vfat_fill(void *buf, uint64_t from, uint32_t len)
+static int fill_image(void *buf, uint64_t from, uint32_t len)
 {
 	int ret = 0;
 
@@ -151,19 +208,25 @@ int vfat_fill(void *buf, uint64_t from, uint32_t len)
 	while (len > 0 && ret == 0) {
 		uint32_t maxcopy = 0;
 		uint32_t sector_nr = from / SECTOR_SIZE;
+		uint64_t start = stats_region_start();
 		if (sector_nr < RESERVED_SECTORS) {
 			uint32_t offset = from % SECTOR_SIZE;
 			if (sector_nr == 0) {
 				maxcopy = min(len, SECTOR_SIZE - from);
 				memcpy(buf, &boot_sector[offset], maxcopy);
 			} else if (sector_nr == 1) {
+				uint8_t sector[SECTOR_SIZE];
+				uint32_t free_count = htole32(fat_free_clusters());
+				memcpy(sector, fsinfo_sector, SECTOR_SIZE);
+				memcpy(&sector[FSINFO_FREE_COUNT], &free_count, 4);
 				maxcopy = min(len, 2*SECTOR_SIZE - from);
-				memcpy(buf, &fsinfo_sector[offset], maxcopy);
+				memcpy(buf, &sector[offset], maxcopy);
 			} else {
 				maxcopy = min(len,
 					RESERVED_SECTORS * SECTOR_SIZE - from);
 				memset(buf, 0, maxcopy);
 			}
+			stats_region_done(STATS_RESERVED, start, maxcopy);
 		} else if (sector_nr < RESERVED_SECTORS + g_fat_sectors) {
 			/* FAT sector */
 			uint32_t entry_nr = (from
@@ -181,6 +244,7 @@ int vfat_fill(void *buf, uint64_t from, uint32_t len)
 				maxcopy -= maxcopy % 4;
 				fat_fill(buf, entry_nr, maxcopy / 4);
 			}
+			stats_region_done(STATS_FAT, start, maxcopy);
 		} else if (sector_nr < g_total_sectors) {
 			uint64_t adj = from - (RESERVED_SECTORS + g_fat_sectors)
 				* SECTOR_SIZE;
@@ -203,6 +267,24 @@ int vfat_fill(void *buf, uint64_t from, uint32_t len)
 	return ret;
 }
 
+/* Write the path of the mapped file at image offset 'from' to 'buf'.
+ * Result: the length of the path, or -1 if there is no file there
+ * or the path doesn't fit. */
+static int image_path(uint64_t from, char *buf, int size)
+{
+	uint64_t data_start = (uint64_t) (RESERVED_SECTORS + g_fat_sectors)
+		* SECTOR_SIZE;
+	int fmap_index;
+
+	if (from < data_start || from / SECTOR_SIZE >= g_total_sectors)
+		return -1;
+	fmap_index = fat_filemap_index((from - data_start) / CLUSTER_SIZE
+		+ RESERVED_FAT_ENTRIES);
+	if (fmap_index < 0)
+		return -1;
+	return filemap_path(fmap_index, buf, size);
+}
+
 static void init_boot_sector(const char *label)
 {
 	uint32_t volume_id = time(NULL);
@@ -231,107 +313,176 @@ static void init_boot_sector(const char *label)
 
 static void init_fsinfo_sector(void)
 {
-	/* Nothing really useful here, but it's expected to be present */
 	memcpy(&fsinfo_sector[0], "RRaA", 4);  /* magic */
 	memcpy(&fsinfo_sector[0x1e4], "rrAa", 4);  /* more magic */
-	/* unset values for first free cluster and last allocated cluster */
-	memcpy(&fsinfo_sector[0x1e8], "\xff\xff\xff\xff", 4);
+	/* The free count is filled in when the sector is read. The
+	 * next free cluster hint is left unset. */
+	memcpy(&fsinfo_sector[FSINFO_FREE_COUNT], "\xff\xff\xff\xff", 4);
 	memcpy(&fsinfo_sector[0x1ec], "\xff\xff\xff\xff", 4);
 	memcpy(&fsinfo_sector[0x1fc], "\0\0\x55\xaa", 4);  /* magic here too */
 }
 
-static int convert_name(const char *name8, int namelen, filename_t & name16)
+static double monotonic_now()
 {
-	ConversionResult result;
-	const uint8_t *inp = (const uint8_t *) name8;
-	uint16_t *bufp;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-	/* VFAT filenames have to be in UTF-16. Linux filenames
-	 * aren't in any particular encoding, but nearly all
-	 * systems use UTF-8 these days. */
+/* The counters are only changed by the thread that builds the image,
+ * but progress_thread() reads them while it does */
+static void count_progress(uint32_t *counter)
+{
+	__atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/* Report the progress once a second until progress_reporting is off */
+static void *progress_thread(void *)
+{
+	struct vfat_progress report;
+	struct timespec wakeup;
+	int found, skipped;
 
-	/* name16 is passed in to receive the result. */
-	name16.clear();
-	/* The worst case is that name8 is pure ASCII so each byte
-	 * expands to one 16-bit element, so make enough space for that
-	 * plus a terminating NUL */
-	name16.resize(namelen + 1);
+	clock_gettime(CLOCK_MONOTONIC, &wakeup);
+	pthread_mutex_lock(&progress_lock);
+	for (;;) {
+		wakeup.tv_sec++;
+		while (progress_reporting && pthread_cond_timedwait(
+				&progress_cond, &progress_lock, &wakeup) == 0)
+			;
+		if (!progress_reporting)
+			break;
+		report.dirs = __atomic_load_n(&progress.dirs, __ATOMIC_RELAXED);
+		report.files = __atomic_load_n(&progress.files,
+			__ATOMIC_RELAXED);
+		report.skipped_name = __atomic_load_n(&progress.skipped_name,
+			__ATOMIC_RELAXED);
+		report.skipped_size = __atomic_load_n(&progress.skipped_size,
+			__ATOMIC_RELAXED);
+		report.skipped_space = __atomic_load_n(
+			&progress.skipped_space, __ATOMIC_RELAXED);
+		report.skipped_other = __atomic_load_n(
+			&progress.skipped_other, __ATOMIC_RELAXED);
+		if (scan_threads > 0) {
+			scan_progress(&found, &skipped);
+			report.dirs_found = found - 1;  /* not the root */
+			report.skipped_other += skipped;
+		} else {
+			report.dirs_found = report.dirs;  /* fts can't tell */
+		}
+		report.elapsed = monotonic_now() - progress_start;
+		progress_fn(&report);
+	}
+	pthread_mutex_unlock(&progress_lock);
+	return NULL;
+}
 
-	bufp = &name16[0];
+/*
+ * Add a directory 'name8' to the directory with index 'parent',
+ * with its "." and ".." entries. 'st' is the new directory's stat
+ * and 'parent_st' is its parent's.
+ * Result: the new directory's index, or -1 if its name can't be
+ * represented.
+ */
+static int add_dir(int parent, const char *name8, int namelen,
+	time_t mtime, time_t atime, time_t parent_mtime, time_t parent_atime)
+{
+	uint32_t clust;
+	uint32_t parent_clust;
+	int dir_index;
+	filename_t name;
 
-	result = ConvertUTF8toUTF16LE(&inp, inp + namelen,
-		&bufp, bufp + namelen, strictConversion);
-	if (result != conversionOK)
+	if (dir_convert_name(name8, namelen, name) < 0) {
+		count_progress(&progress.skipped_name);
 		return -1;
+	}
+	dir_index = dir_alloc_new(parent, name8);
+	if (dir_index < 0) {
+		count_progress(&progress.skipped_space);
+		return -1;  /* no room left in a live update */
+	}
+	clust = dir_cluster(dir_index);
+	/* directory entries refer to the root as cluster 0 */
+	parent_clust = parent ? dir_cluster(parent) : 0;
 
-	/* The conversion routine will have set bufp to point just
-	 * past the end of the converted data. Anything past that
-	 * will be junk, so shrink the name to leave that out. */
-	*bufp++ = 0;
-	name16.resize(bufp - &name16[0]);
-	return 0;
+	/* link the new directory into the hierarchy */
+	dir_add_entry_at(dir_index, clust, dot_name, 0,
+		FAT_ATTR_DIRECTORY, mtime, atime);
+	dir_add_entry_at(dir_index, parent_clust, dot_dot_name, 0,
+		FAT_ATTR_DIRECTORY, parent_mtime, parent_atime);
+	dir_add_entry_at(parent, clust, name, 0,
+		FAT_ATTR_DIRECTORY, mtime, atime);
+	count_progress(&progress.dirs);
+	return dir_index;
 }
 
-static void scan_fts(FTS *ftsp, FTSENT *entp)
+/* Add a regular file to the directory with index 'parent' */
+static void add_file(int parent, const char *name8, int namelen, off_t size,
+	time_t mtime, time_t atime, const char *scan_path)
 {
 	uint32_t clust;
-	uint32_t parent;
-	off_t size;
 	filename_t name;
 
+	if ((off_t) (uint32_t) size != size) {
+		count_progress(&progress.skipped_size);
+		return;  /* can't represent size */
+	}
+	if (dir_convert_name(name8, namelen, name) < 0) {
+		count_progress(&progress.skipped_name);
+		return;  /* can't represent name */
+	}
+	if (size > 0) {
+		clust = filemap_add(parent, name8, size, scan_path);
+		if (!clust) {
+			count_progress(&progress.skipped_space);
+			return;  /* no room left after fat_close_dirs() */
+		}
+	} else {
+		clust = 0;
+	}
+	dir_add_entry_at(parent, clust, name, size, FAT_ATTR_NONE,
+		mtime, atime);
+	count_progress(&progress.files);
+}
+
+static void scan_fts(FTS *ftsp, FTSENT *entp)
+{
+	int dir_index;
+
 	/*
 	 * The scan makes use of entp->fts_number, which is a field
-	 * reserved for our use. For directories we store the cluster
-	 * number there, so that we can look it up when scanning the
-	 * directory's children. The field is initialized to 0, so
-	 * 0 means the root directory.
+	 * reserved for our use. For directories we store the dir index
+	 * there, so that the directory's children can be added to it
+	 * directly. The field is initialized to 0, which is also the
+	 * index of the root directory.
 	 */
 	switch (entp->fts_info) {
 		case FTS_D: /* directory, first visit */
 			if (entp->fts_level == 0) /* root dir is already made */
 				break;
-			if (convert_name(entp->fts_name,
-				entp->fts_namelen, name) < 0) {
+			dir_index = add_dir(entp->fts_parent->fts_number,
+				entp->fts_name, entp->fts_namelen,
+				entp->fts_statp->st_mtime,
+				entp->fts_statp->st_atime,
+				entp->fts_parent->fts_statp->st_mtime,
+				entp->fts_parent->fts_statp->st_atime);
+			if (dir_index < 0) {
 				/* directory name couldn't be represented.
 				 * skip it and its children. */
 				fts_set(ftsp, entp, FTS_SKIP);
 				break;
 			}
-			clust = dir_alloc_new(entp->fts_path);
-			parent = entp->fts_parent->fts_number;
-			
-			/* link the new directory into the hierarchy */
-			dir_add_entry(clust, clust, dot_name, 0,
-                                FAT_ATTR_DIRECTORY,
-				entp->fts_statp->st_mtime,
-				entp->fts_statp->st_atime);
-			dir_add_entry(clust, parent, dot_dot_name, 0,
-                                FAT_ATTR_DIRECTORY,
-				entp->fts_parent->fts_statp->st_mtime,
-				entp->fts_parent->fts_statp->st_atime);
-			dir_add_entry(parent, clust, name, 0,
-                                FAT_ATTR_DIRECTORY,
-				entp->fts_statp->st_mtime,
-				entp->fts_statp->st_atime);
-			entp->fts_number = clust;
+			entp->fts_number = dir_index;
 			break;
 
 		case FTS_F: /* normal file */
-			size = entp->fts_statp->st_size;
-			if ((off_t) (uint32_t) size != size)
-				break;  /* can't represent size */
-			if (convert_name(entp->fts_name,
-				entp->fts_namelen, name) < 0)
-				break;  /* can't represent name */
-			parent = entp->fts_parent->fts_number;
-			if (size > 0)
-				clust = filemap_add(entp->fts_path, size);
-			else
-				clust = 0;
-			dir_add_entry(parent, clust, name, size,
-                                FAT_ATTR_NONE,
+			add_file(entp->fts_parent->fts_number,
+				entp->fts_name, entp->fts_namelen,
+				entp->fts_statp->st_size,
 				entp->fts_statp->st_mtime,
-				entp->fts_statp->st_atime);
+				entp->fts_statp->st_atime,
+				entp->fts_accpath);
 			break;
 
 		case FTS_DP: /* directory, second visit (after all children) */
@@ -341,11 +492,12 @@ static void scan_fts(FTS *ftsp, FTSENT *entp)
 			/* Ignore anything else: unstattable files,
 			 * unreadable directories, symbolic links, etc.
 			 * It won't be representable in the FAT anyway. */
+			count_progress(&progress.skipped_other);
 			break;
 	}
 }
 
-static void scan_target_dir(const char *target_dir)
+static void scan_target_dir_fts(const char *target_dir)
 {
 	FTS *ftsp;
 	FTSENT *entp;
@@ -356,21 +508,468 @@ static void scan_target_dir(const char *target_dir)
 	char *path_argv[] = { (char *) target_dir, 0 };
 
 	/* FTS is a glibc helper for scanning directory trees */
-	ftsp = fts_open(path_argv, FTS_PHYSICAL | FTS_XDEV, NULL);
+	/* FTS_NOCHDIR: a rescan runs while other threads open
+	 * relative paths */
+	ftsp = fts_open(path_argv, FTS_PHYSICAL | FTS_XDEV | FTS_NOCHDIR,
+		NULL);
 	while ((entp = fts_read(ftsp)))
 		scan_fts(ftsp, entp);
 
 	fts_close(ftsp);
-	
 }
 
-void vfat_init(const char *target_dir, uint64_t free_space, const char *label)
+/*
+ * Add the listing 'scan_index' to the directory 'dir_index', and
+ * recurse into its subdirectories. This makes the same calls in the
+ * same order as the fts walk, so the image comes out the same.
+ */
+static void add_listing(int scan_index, int dir_index,
+	time_t mtime, time_t atime)
 {
-	init_boot_sector(label);
-	init_fsinfo_sector();
+	const struct scan_dir *sd = scan_wait(scan_index);
+	const struct scan_entry *se;
+	const char *name;
+	static char path[PATH_MAX]; /* not on the stack, this recurses */
+	int pathlen = sd->path.size() - 1;
+	int sub_index;
+
+	for (size_t i = 0; i < sd->entries.size(); i++) {
+		se = &sd->entries[i];
+		name = &sd->names[se->name_offset];
+		if (se->type == SCAN_DIR) {
+			sub_index = add_dir(dir_index, name, strlen(name),
+				se->mtime, se->atime, mtime, atime);
+			/* if the name can't be represented, the listing
+			 * is skipped and scan_finish() frees it */
+			if (sub_index >= 0 && se->subdir >= 0)
+				add_listing(se->subdir, sub_index,
+					se->mtime, se->atime);
+		} else if (pathlen + 1 + strlen(name) < sizeof(path)) {
+			memcpy(path, &sd->path[0], pathlen);
+			path[pathlen] = '/';
+			strcpy(path + pathlen + 1, name);
+			add_file(dir_index, name, strlen(name), se->size,
+				se->mtime, se->atime, path);
+		} else {
+			add_file(dir_index, name, strlen(name), se->size,
+				se->mtime, se->atime, NULL);
+		}
+	}
+	scan_release(scan_index);
+}
+
+/*
+ * Like add_listing, but only add the subdirectories and keep the
+ * names of the files in lazy_names. The directory gets clusters
+ * for the file entries now, since it can't grow later.
+ */
+static void add_listing_lazy(int scan_index, int dir_index,
+	time_t mtime, time_t atime)
+{
+	const struct scan_dir *sd = scan_wait(scan_index);
+	const struct scan_entry *se;
+	const char *name;
+	std::vector<char> files;
+	uint32_t bytes = dir_size(dir_index);
+	filename_t name16;
+	int sub_index;
+
+	for (size_t i = 0; i < sd->entries.size(); i++) {
+		se = &sd->entries[i];
+		name = &sd->names[se->name_offset];
+		if (dir_convert_name(name, strlen(name), name16) < 0) {
+			/* add_dir counts the directories */
+			if (se->type != SCAN_DIR)
+				count_progress(&progress.skipped_name);
+			continue;
+		}
+		bytes += dir_entries_size(name16);
+		/* add_file counts them once they are added */
+		if (se->type != SCAN_DIR)
+			files.insert(files.end(), name, name + strlen(name) + 1);
+	}
+	dir_reserve(dir_index, bytes);
+	if (!files.empty()) {
+		if (lazy_names.size() <= (size_t) dir_index)
+			lazy_names.resize(dir_index + 1);
+		lazy_names[dir_index].swap(files);
+		lazy_count++;
+	}
+
+	for (size_t i = 0; i < sd->entries.size(); i++) {
+		se = &sd->entries[i];
+		if (se->type != SCAN_DIR)
+			continue;
+		name = &sd->names[se->name_offset];
+		sub_index = add_dir(dir_index, name, strlen(name),
+			se->mtime, se->atime, mtime, atime);
+		if (sub_index >= 0 && se->subdir >= 0)
+			add_listing_lazy(se->subdir, sub_index,
+				se->mtime, se->atime);
+	}
+	scan_release(scan_index);
+}
+
+static void report_metadata()
+{
+	fprintf(stderr, "Metadata: %lu bytes dirs, %lu bytes filemaps, "
+		"%lu bytes FAT\n",
+		(unsigned long) dir_mem_usage(),
+		(unsigned long) filemap_mem_usage(),
+		(unsigned long) fat_mem_usage());
+}
+
+/*
+ * Look up the files that are still pending in the directory with
+ * index 'dir_index' and add them. The caller has image_lock for
+ * writing.
+ */
+static void add_lazy_files(int dir_index)
+{
+	std::vector<char> names;
+	char path[PATH_MAX];
+	int pathlen;
+	const char *name;
+	struct stat st;
+	int fd = -1;
+
+	names.swap(lazy_names[dir_index]);
+	pathlen = dir_path(dir_index, path, sizeof(path));
+	if (pathlen >= 0)
+		fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	for (size_t pos = 0; fd >= 0 && pos < names.size();
+			pos += strlen(name) + 1) {
+		name = &names[pos];
+		if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0
+				|| !S_ISREG(st.st_mode))
+			continue;
+		if (pathlen + 1 + strlen(name) < sizeof(path)) {
+			path[pathlen] = '/';
+			strcpy(path + pathlen + 1, name);
+			add_file(dir_index, name, strlen(name), st.st_size,
+				st.st_mtime, st.st_atime, path);
+			path[pathlen] = 0;
+		} else {
+			add_file(dir_index, name, strlen(name), st.st_size,
+				st.st_mtime, st.st_atime, NULL);
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+	fat_pad_filemaps();
+
+	if (lazy_count == 1) {
+		fat_finalize(lazy_free_space / CLUSTER_SIZE);
+		report_metadata();
+	}
+	/* readers check it without the lock */
+	__atomic_store_n(&lazy_count, lazy_count - 1, __ATOMIC_RELEASE);
+}
+
+static void add_all_lazy_files()
+{
+	for (size_t i = 0; lazy_count && i < lazy_names.size(); i++) {
+		if (!lazy_names[i].empty())
+			add_lazy_files(i);
+	}
+}
+
+/*
+ * Return true if reading 'len' bytes at 'from' would see files that
+ * are still pending. If 'add' is set, add them. The pending part of
+ * the FAT is where the files of any directory may go, so reading it
+ * adds everything.
+ */
+static bool lazy_range(uint64_t from, uint32_t len, bool add)
+{
+	uint64_t fat_start = (uint64_t) RESERVED_SECTORS * SECTOR_SIZE;
+	uint64_t data_start = fat_start + (uint64_t) g_fat_sectors * SECTOR_SIZE;
+	uint64_t end = from + len;
+	uint32_t first, last;
+	bool found = false;
+	int dir_index;
+
+	if (from < data_start && end > fat_start) {
+		first = (from > fat_start ? from - fat_start : 0) / 4;
+		last = (min(end, data_start) - fat_start - 1) / 4;
+		if (fat_pending(first, last - first + 1)) {
+			if (add)
+				add_all_lazy_files();
+			return true;
+		}
+	}
+	if (end <= data_start)
+		return false;
+
+	first = (from > data_start ? from - data_start : 0) / CLUSTER_SIZE;
+	last = (end - data_start - 1) / CLUSTER_SIZE;
+	for (uint32_t c = first; c <= last && c < g_data_clusters; c++) {
+		dir_index = fat_dir_index(c + RESERVED_FAT_ENTRIES);
+		if (dir_index < 0 || (size_t) dir_index >= lazy_names.size()
+				|| lazy_names[dir_index].empty())
+			continue;
+		found = true;
+		if (!add)
+			break;
+		add_lazy_files(dir_index);
+	}
+	return found;
+}
+
+/* Return true if the image can change, so that readers need image_lock */
+static bool image_changing()
+{
+	return live_updates || __atomic_load_n(&rescanning, __ATOMIC_SEQ_CST)
+		|| __atomic_load_n(&lazy_count, __ATOMIC_ACQUIRE);
+}
+
+static void leave_unlocked()
+{
+	/* Only the last reader out during a rescan needs to wake it */
+	if (__atomic_sub_fetch(&unlocked_readers, 1, __ATOMIC_SEQ_CST) == 0
+			&& __atomic_load_n(&rescanning, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&drain_lock);
+		pthread_cond_broadcast(&drain_cond);
+		pthread_mutex_unlock(&drain_lock);
+	}
+}
+
+/* Return true if the caller may read the image without image_lock,
+ * in which case it must call leave_unlocked() when done */
+static bool enter_unlocked()
+{
+	__atomic_add_fetch(&unlocked_readers, 1, __ATOMIC_SEQ_CST);
+	if (!image_changing())
+		return true;
+	leave_unlocked();
+	return false;
+}
+
+int vfat_fill(void *buf, uint64_t from, uint32_t len)
+{
+	int ret;
+
+	if (enter_unlocked()) {
+		ret = fill_image(buf, from, len);
+		leave_unlocked();
+		return ret;
+	}
+
+	/* The serving thread mustn't wait for the lock or for
+	 * lookups; a worker thread will do it. */
+	if (filemap_get_nowait()) {
+		if (pthread_rwlock_tryrdlock(&image_lock))
+			return EAGAIN;
+	} else {
+		pthread_rwlock_rdlock(&image_lock);
+	}
+	if (lazy_count && lazy_range(from, len, false)) {
+		pthread_rwlock_unlock(&image_lock);
+		if (filemap_get_nowait())
+			return EAGAIN;
+		pthread_rwlock_wrlock(&image_lock);
+		if (lazy_count)
+			lazy_range(from, len, true);
+		pthread_rwlock_unlock(&image_lock);
+		pthread_rwlock_rdlock(&image_lock);
+	}
+	ret = fill_image(buf, from, len);
+	pthread_rwlock_unlock(&image_lock);
+	return ret;
+}
+
+/* Return the stats region of image offset 'from' */
+static int image_region(uint64_t from)
+{
+	uint32_t sector_nr = from / SECTOR_SIZE;
+	uint64_t adj;
+
+	if (sector_nr < RESERVED_SECTORS)
+		return STATS_RESERVED;
+	if (sector_nr < RESERVED_SECTORS + g_fat_sectors)
+		return STATS_FAT;
+	adj = from - (uint64_t) (RESERVED_SECTORS + g_fat_sectors)
+		* SECTOR_SIZE;
+	return data_region(adj / CLUSTER_SIZE + RESERVED_FAT_ENTRIES);
+}
+
+int vfat_region(uint64_t from)
+{
+	int ret;
+
+	if (enter_unlocked()) {
+		ret = image_region(from);
+		leave_unlocked();
+		return ret;
+	}
+	if (pthread_rwlock_tryrdlock(&image_lock))
+		return -1;
+	ret = image_region(from);
+	pthread_rwlock_unlock(&image_lock);
+	return ret;
+}
+
+int vfat_path(uint64_t from, char *buf, int size)
+{
+	int ret;
+
+	if (enter_unlocked()) {
+		ret = image_path(from, buf, size);
+		leave_unlocked();
+		return ret;
+	}
+	/* this only describes slow reads, don't become one */
+	if (pthread_rwlock_tryrdlock(&image_lock))
+		return -1;
+	ret = image_path(from, buf, size);
+	pthread_rwlock_unlock(&image_lock);
+	return ret;
+}
+
+void vfat_enable_updates()
+{
+	live_updates = true;
+}
+
+void vfat_begin_update()
+{
+	pthread_rwlock_wrlock(&image_lock);
+	/* files can only be added and removed after finalization */
+	if (lazy_count)
+		add_all_lazy_files();
+}
+
+void vfat_end_update()
+{
+	pthread_rwlock_unlock(&image_lock);
+}
+
+void vfat_update_name(int dir_index, const char *name, bool changed)
+{
+	char path[PATH_MAX];
+	struct stat st, dir_st;
+	filename_t name16;
+	uint8_t attrs;
+	uint32_t clust, size;
+	int pathlen;
+	int offset;
+	bool exists;
+
+	/* skip directories that were removed themselves */
+	if (fat_dir_index(dir_cluster(dir_index)) != dir_index)
+		return;
+	if (dir_convert_name(name, strlen(name), name16) < 0)
+		return;
+	pathlen = dir_path(dir_index, path, sizeof(path));
+	if (pathlen < 0 || pathlen + 1 + strlen(name) >= sizeof(path)
+			|| lstat(path, &dir_st) < 0)
+		return;
+	path[pathlen] = '/';
+	strcpy(path + pathlen + 1, name);
+
+	/* Like the scan, only take regular files and directories on
+	 * the same filesystem */
+	exists = lstat(path, &st) == 0 && (S_ISREG(st.st_mode)
+		|| (S_ISDIR(st.st_mode) && st.st_dev == dir_st.st_dev));
 
+	offset = dir_find_entry(dir_index, name16, &attrs, &clust, &size);
+	if (offset >= 0) {
+		if (exists && S_ISDIR(st.st_mode)
+				&& (attrs & FAT_ATTR_DIRECTORY))
+			return;
+		if (exists && S_ISREG(st.st_mode)
+				&& !(attrs & FAT_ATTR_DIRECTORY)
+				&& size == st.st_size && !changed)
+			return;
+		dir_delete_entry(dir_index, offset);
+		if ((attrs & FAT_ATTR_DIRECTORY) && fat_dir_index(clust) > 0)
+			dir_free_tree(fat_dir_index(clust));
+		else if (clust)
+			fat_free(clust);
+	}
+
+	if (!exists)
+		return;
+	if (S_ISDIR(st.st_mode))
+		add_dir(dir_index, name, strlen(name), st.st_mtime, st.st_atime,
+			dir_st.st_mtime, dir_st.st_atime);
+	else
+		add_file(dir_index, name, strlen(name), st.st_size,
+			st.st_mtime, st.st_atime, path);
+}
+
+void vfat_update_dir(int dir_index)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *dirp;
+
+	if (dir_path(dir_index, path, sizeof(path)) < 0)
+		return;
+	dirp = opendir(path);
+	if (!dirp)
+		return;
+	while ((de = readdir(dirp))) {
+		if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+			vfat_update_name(dir_index, de->d_name, false);
+	}
+	closedir(dirp);
+}
+
+static void scan_target_dir(const char *target_dir)
+{
+	struct stat st;
+	int found, skipped;
+
+	if (scan_threads <= 0) {
+		scan_target_dir_fts(target_dir);
+		return;
+	}
+	scan_set_lazy_files(lazy_scan);
+	if (scan_start(target_dir, scan_threads, scan_batch, &st)) {
+		if (lazy_scan)
+			add_listing_lazy(0, 0, st.st_mtime, st.st_atime);
+		else
+			add_listing(0, 0, st.st_mtime, st.st_atime);
+	}
+	scan_progress(&found, &skipped);
+	__atomic_store_n(&progress.skipped_other,
+		progress.skipped_other + skipped, __ATOMIC_RELAXED);
+	scan_finish();
+}
+
+void vfat_set_scan_threads(int threads)
+{
+	scan_threads = threads;
+}
+
+void vfat_set_scan_batch(int batch)
+{
+	scan_batch = batch;
+}
+
+void vfat_set_scan_cache(const char *filename)
+{
+	scan_set_cache(filename);
+}
+
+void vfat_set_lazy(bool enable)
+{
+	lazy_scan = enable;
+}
+
+void vfat_set_progress(vfat_progress_fn report)
+{
+	progress_fn = report;
+}
+
+/* Start over with an empty image of 'target_dir', keeping the boot
+ * sector. The caller scans the directory into it and finalizes it. */
+static void init_image(const char *target_dir)
+{
 	fat_init(g_data_clusters);
-	dir_init();
+	dir_init(target_dir);
+	filemap_init();
 
 	dot_name.clear();
 	dot_name.push_back(htole16('.'));
@@ -381,8 +980,140 @@ void vfat_init(const char *target_dir, uint64_t free_space, const char *label)
 	dot_dot_name.push_back(htole16('.'));
 	dot_dot_name.push_back(0);
 
+	lazy_names.clear();
+	__atomic_store_n(&lazy_count, 0, __ATOMIC_RELEASE);
+	memset(&progress, 0, sizeof(progress));
+}
+
+/* Start progress_thread. The wakeups are on the monotonic clock. */
+static bool start_progress(pthread_t *thread)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&progress_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	progress_reporting = true;
+	return pthread_create(thread, NULL, progress_thread, NULL) == 0;
+}
+
+void vfat_init(const char *target_dir, uint64_t free_space, const char *label)
+{
+	pthread_t reporter;
+
+	init_boot_sector(label);
+	init_fsinfo_sector();
+	g_top_dir = target_dir;
+
+	init_image(target_dir);
+	progress_start = monotonic_now();
+	progress_reporting = progress_fn && start_progress(&reporter);
 	scan_target_dir(target_dir);
+	if (progress_reporting) {
+		pthread_mutex_lock(&progress_lock);
+		progress_reporting = false;
+		pthread_cond_signal(&progress_cond);
+		pthread_mutex_unlock(&progress_lock);
+		pthread_join(reporter, NULL);
+	}
+	fprintf(stderr, "Scan: %lu directories, %lu files in %.1f ms, "
+		"skipped %lu bad names, %lu too large, %lu for lack of room, "
+		"%lu other\n",
+		(unsigned long) progress.dirs, (unsigned long) progress.files,
+		(monotonic_now() - progress_start) * 1e3,
+		(unsigned long) progress.skipped_name,
+		(unsigned long) progress.skipped_size,
+		(unsigned long) progress.skipped_space,
+		(unsigned long) progress.skipped_other);
+	if (lazy_count) {
+		/* finalized by the last add_lazy_files() */
+		lazy_free_space = free_space;
+		fat_close_dirs(free_space / CLUSTER_SIZE);
+		fprintf(stderr, "Lazy scan: %d directories pending\n",
+			lazy_count);
+		return;
+	}
 	fat_finalize(free_space / CLUSTER_SIZE);
+	report_metadata();
+}
+
+/* Wait until the listing 'scan_index' and the ones under it are read */
+static void wait_listings(int scan_index)
+{
+	const struct scan_dir *sd = scan_wait(scan_index);
+
+	for (size_t i = 0; i < sd->entries.size(); i++) {
+		if (sd->entries[i].type == SCAN_DIR
+				&& sd->entries[i].subdir >= 0)
+			wait_listings(sd->entries[i].subdir);
+	}
+}
+
+/* Return the peak resident set size in kB, or -1 if unknown */
+static long peak_rss_kb()
+{
+	char line[100];
+	long kb = -1;
+	FILE *f = fopen("/proc/self/status", "r");
+
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+			break;
+	}
+	fclose(f);
+	return kb;
+}
+
+void vfat_rescan(uint64_t free_space)
+{
+	struct stat st;
+	bool scanned = false;
+	double start = monotonic_now();
+	double locked, unlocked;
+
+	/* Read the whole tree before taking the lock, so that readers
+	 * only wait while the image is built from the listings. The fts
+	 * walk can't do that, so a rescan uses one scan thread even when
+	 * scan_threads is 0. */
+	scan_set_lazy_files(false);
+	scanned = scan_start(g_top_dir, scan_threads, scan_batch, &st);
+	if (scanned)
+		wait_listings(0);
+	/* An empty image is worse than an old one */
+	if (!scanned) {
+		fprintf(stderr, "Rescan: can't read %s, keeping the old image\n",
+			g_top_dir);
+		return;
+	}
+
+	locked = monotonic_now();
+	__atomic_store_n(&rescanning, true, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&drain_lock);
+	while (__atomic_load_n(&unlocked_readers, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&drain_cond, &drain_lock);
+	pthread_mutex_unlock(&drain_lock);
+	pthread_rwlock_wrlock(&image_lock);
+	init_image(g_top_dir);
+	add_listing(0, 0, st.st_mtime, st.st_atime);
+	fat_finalize(free_space / CLUSTER_SIZE);
+	generation++;
+	pthread_rwlock_unlock(&image_lock);
+	__atomic_store_n(&rescanning, false, __ATOMIC_RELEASE);
+	unlocked = monotonic_now();
+
+	scan_finish();
+	fprintf(stderr, "Rescan: %.1f ms reading, image locked for %.1f ms, "
+		"peak RSS %ld kB\n", (locked - start) * 1e3,
+		(unlocked - locked) * 1e3, peak_rss_kb());
+	report_metadata();
+}
+
+int vfat_generation()
+{
+	return generation;
 }
 
 /* TODO: do something about the hidden coupling between this function
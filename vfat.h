@@ -7,6 +7,57 @@
 
 #define ALIGN(x, sz) (((x) + (sz) - 1) & ~((typeof(x))(sz) - 1))
 
+void vfat_set_scan_threads(int threads);
+void vfat_set_scan_batch(int batch);
+void vfat_set_scan_cache(const char *filename);
+void vfat_set_lazy(bool enable);
+
+/* How far vfat_init() is with scanning the target directory */
+struct vfat_progress {
+	uint32_t dirs;  /* directories added so far */
+	uint32_t dirs_found;  /* directories found, added or not */
+	uint32_t files;  /* files added so far; a lazy scan adds them later */
+	uint32_t skipped_name;  /* names that can't be represented */
+	uint32_t skipped_size;  /* files of 4 GiB or more */
+	uint32_t skipped_space;  /* no room left in the image */
+	uint32_t skipped_other;  /* special or unreadable entries */
+	double elapsed;  /* seconds since the scan started */
+};
+typedef void (*vfat_progress_fn)(const struct vfat_progress *progress);
+/* Have vfat_init() call 'report' once a second while it scans, from
+ * a thread of its own. NULL (the default) for no reports. */
+void vfat_set_progress(vfat_progress_fn report);
 void vfat_init(const char *target_dir, uint64_t free_space, const char *label);
 int vfat_fill(void *buf, uint64_t from, uint32_t len);
+int vfat_path(uint64_t from, char *buf, int size);
+/* Return the region (an enum stats_region) of the image at offset
+ * 'from', or -1 if it can't be looked up without waiting */
+int vfat_region(uint64_t from);
+
+/*
+ * Live updates. Call vfat_enable_updates() before serving starts if
+ * the image is going to change with these. Then make changes between
+ * vfat_begin_update() and vfat_end_update(); each such batch is atomic
+ * for readers. vfat_rescan() replaces the whole image,
+ * and doesn't need vfat_enable_updates().
+ */
+void vfat_enable_updates();
+void vfat_begin_update();
+void vfat_end_update();
+/* Bring the entry 'name' in the directory with index 'dir_index' up
+ * to date with the real filesystem. A regular file is added again
+ * if its size changed, or always if 'changed' is set. New directories
+ * are added empty; see vfat_update_dir(). */
+void vfat_update_name(int dir_index, const char *name, bool changed);
+/* Bring all the entries in the real directory of 'dir_index' up to
+ * date, for a directory that was just added */
+void vfat_update_dir(int dir_index);
+/* Scan the target directory again and swap the new image in for the
+ * old one. With scan threads, readers only wait while the image is
+ * built from the listings, not while the directories are read. */
+void vfat_rescan(uint64_t free_space);
+/* Return a number that changes whenever vfat_rescan() replaced the
+ * image, which gives the directories new indexes. Call it between
+ * vfat_begin_update() and vfat_end_update(). */
+int vfat_generation();
 uint32_t vfat_adjust_size(uint32_t blocks, uint32_t block_size);
@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "watch.h"
+
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "vfat.h"
+#include "dir.h"
+
+/*
+ * Every directory in the image gets an inotify watch. Events only
+ * say which names to look at again: the batch collects them, and
+ * applying it brings each name up to date with what's in the real
+ * directory by then. That way it doesn't matter if events were
+ * merged or came in an odd order, and a file that is written for a
+ * while is only added again once it's closed.
+ *
+ * The whole batch is applied under the image's write lock, so the
+ * host sees either none or all of it.
+ *
+ * If inotify's queue overflowed, there's no telling what was missed,
+ * so the process is sent a SIGHUP to scan everything again. The
+ * directories are watched again as soon as the new image is in.
+ */
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+	| IN_CLOSE_WRITE | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+/* Apply a batch early when it gets this big, or when it's been
+ * this many delays since its first event */
+#define MAX_BATCH 4096
+#define MAX_BATCH_WAIT 4
+
+static int inotify_fd = -1;
+static uint32_t batch_delay_ms;
+/* watch descriptor -> dir index */
+static std::map<int, int> watched;
+
+/* The image generation that 'watched' is for */
+static int watched_generation;
+
+/* A rescan was asked for and 'watched' isn't for it yet */
+static bool rescan_pending;
+
+/* (watch descriptor, name) -> whether the file was written.
+ * Watch descriptors stay the same when a rescan renumbers the
+ * directories, so a batch can span a rescan. */
+typedef std::map<std::pair<int, std::string>, bool> batch_t;
+
+static double monotonic_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Result: the watch descriptor, or -1 */
+static int add_watch(int dir_index)
+{
+	char path[PATH_MAX];
+	int wd;
+
+	/* removed directories keep their index, without a cluster */
+	if (!dir_cluster(dir_index)
+			|| dir_path(dir_index, path, sizeof(path)) < 0)
+		return -1;
+	wd = inotify_add_watch(inotify_fd, path, WATCH_EVENTS);
+	if (wd < 0) {
+		fprintf(stderr, "Can't watch %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	/* a directory that was moved gets a new index */
+	watched[wd] = dir_index;
+	return wd;
+}
+
+/* After a rescan: watch the new image's directories, and stop
+ * watching the ones that are gone. A directory that is still there
+ * keeps its watch descriptor. One that wasn't watched yet may have
+ * changed since the rescan read it, so it's brought up to date. */
+static void rewatch()
+{
+	std::map<int, int> old;
+	std::map<int, int>::iterator it;
+	int dirs = dir_count();
+	int wd;
+
+	old.swap(watched);
+	for (int i = 0; i < dirs; i++) {
+		wd = add_watch(i);
+		if (wd >= 0 && !old.count(wd))
+			vfat_update_dir(i);
+	}
+	for (it = old.begin(); it != old.end(); ++it) {
+		if (!watched.count(it->first))
+			inotify_rm_watch(inotify_fd, it->first);
+	}
+	watched_generation = vfat_generation();
+	rescan_pending = false;
+}
+
+static void apply_batch(const batch_t &batch)
+{
+	batch_t::const_iterator it;
+	std::map<int, int>::iterator w;
+	int first_new, next_new;
+
+	vfat_begin_update();
+	first_new = dir_count();
+	if (vfat_generation() != watched_generation)
+		rewatch();
+	for (it = batch.begin(); it != batch.end(); ++it) {
+		w = watched.find(it->first.first);
+		if (w != watched.end())
+			vfat_update_name(w->second, it->first.second.c_str(),
+				it->second);
+	}
+	/* Fill in the new directories, which may add more. They are
+	 * watched first so that nothing created in them is missed. */
+	for (; first_new < dir_count(); first_new = next_new) {
+		next_new = dir_count();
+		for (int i = first_new; i < next_new; i++) {
+			add_watch(i);
+			vfat_update_dir(i);
+		}
+	}
+	/* Stop watching the directories that were removed from the
+	 * image. One that was moved within it has its watch already. */
+	for (w = watched.begin(); w != watched.end(); ) {
+		if (!dir_cluster(w->second)) {
+			inotify_rm_watch(inotify_fd, w->first);
+			watched.erase(w++);
+		} else {
+			++w;
+		}
+	}
+	vfat_end_update();
+}
+
+static void *watch_thread(void *)
+{
+	/* aligned for struct inotify_event */
+	static uint64_t buf[4096];
+	const struct inotify_event *ev;
+	batch_t batch;
+	double first_event = 0, last_event = 0;
+	struct pollfd pfd;
+	int timeout;
+	ssize_t len;
+
+	pfd.fd = inotify_fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		timeout = -1;
+		if (!batch.empty()) {
+			double due = std::min(last_event + batch_delay_ms / 1e3,
+				first_event + MAX_BATCH_WAIT * batch_delay_ms / 1e3);
+			timeout = (due - monotonic_now()) * 1e3;
+			if (timeout < 0)
+				timeout = 0;
+		}
+		/* look for the new image now and then */
+		if (rescan_pending && (timeout < 0
+				|| timeout > (int) batch_delay_ms))
+			timeout = batch_delay_ms;
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+			break;
+		if (!(pfd.revents & POLLIN)) {
+			if ((!batch.empty() || rescan_pending)
+					&& timeout >= 0) {
+				apply_batch(batch);
+				batch.clear();
+			}
+			continue;
+		}
+
+		len = read(inotify_fd, buf, sizeof(buf));
+		if (len <= 0)
+			continue;
+		last_event = monotonic_now();
+		if (batch.empty())
+			first_event = last_event;
+		for (char *p = (char *) buf; p < (char *) buf + len;
+				p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				fprintf(stderr, "Too many changes at once, "
+					"scanning everything again\n");
+				rescan_pending = true;
+				kill(getpid(), SIGHUP);
+				continue;
+			}
+			if (ev->mask & IN_IGNORED) {
+				watched.erase(ev->wd);
+				continue;
+			}
+			if (!ev->len)
+				continue;
+			batch[std::make_pair(ev->wd, std::string(ev->name))]
+				|= (ev->mask & IN_CLOSE_WRITE) != 0;
+		}
+		if (batch.size() >= MAX_BATCH) {
+			apply_batch(batch);
+			batch.clear();
+		}
+	}
+	return NULL;
+}
+
+bool watch_start(uint32_t delay_ms)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	int dirs = dir_count();
+
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd < 0)
+		return false;
+	batch_delay_ms = delay_ms;
+	for (int i = 0; i < dirs; i++)
+		add_watch(i);
+	watched_generation = vfat_generation();
+
+	vfat_enable_updates();
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, watch_thread, NULL) != 0) {
+		pthread_attr_destroy(&attr);
+		return false;
+	}
+	pthread_attr_destroy(&attr);
+	return true;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * This file is the interface to the watcher thread, which keeps the
+ * image up to date with changes to the target directory while it's
+ * being served.
+ */
+
+#include <stdint.h>
+
+/* Watch all the directories in the image with inotify, and apply
+ * the changes in a batch once there have been none for 'delay_ms'
+ * milliseconds, or four times that after the first one at the latest.
+ * Call this after vfat_init() and before serving starts. If inotify
+ * lost events, the process is sent a SIGHUP, which should make it
+ * call vfat_rescan().
+ * Result: false if the watcher couldn't be started. */
+bool watch_start(uint32_t delay_ms);
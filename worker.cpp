@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "worker.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+/*
+ * Reads are queued in order of arrival and picked up by the worker
+ * threads. If the deadline is set, a watchdog thread answers reads
+ * that take longer than that with EIO, so that a file on wedged
+ * storage doesn't hold up the host until its nbd timeout tears down
+ * the device. The stuck read is left to finish in the background and
+ * its result is thrown away, but the data it brings into the page
+ * cache will help if the host retries.
+ *
+ * So that independent reads overlap instead of waiting behind a slow
+ * one, a new worker is started whenever a read is queued and no worker
+ * is idle, up to MAX_WORKERS. Extra workers exit when they find the
+ * queue empty and another worker idle.
+ */
+#define MAX_WORKERS 8
+
+struct request {
+	char handle[8];
+	uint64_t from;
+	uint32_t len;
+	void *buf;
+	double received; /* CLOCK_MONOTONIC seconds */
+	bool answered; /* the reply has been sent or is being sent */
+	struct request *next;
+};
+
+static struct request *queue_first, *queue_last;
+static std::vector<struct request *> running;
+static int nr_workers;
+static int nr_idle; /* workers waiting for a request */
+static int nr_queued; /* requests waiting for a worker */
+static bool watchdog_started;
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+
+static worker_fill_fn fill_fn;
+static worker_reply_fn reply_fn;
+static worker_describe_fn describe_fn;
+static double deadline; /* in seconds, 0 if none */
+
+static double monotonic_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void log_slow(const struct request *rr, const char *what)
+{
+	char desc[PATH_MAX];
+
+	if (!describe_fn || describe_fn(rr->from, desc, sizeof(desc)) < 0)
+		strcpy(desc, "no file");
+	fprintf(stderr, "Read of %lu bytes at 0x%llx (%s) %s after %.1f s\n",
+		(unsigned long) rr->len, (unsigned long long) rr->from, desc,
+		what, monotonic_now() - rr->received);
+}
+
+static void *worker_thread(void *)
+{
+	struct request *rr;
+	bool late;
+	bool leave = false;
+	int err;
+
+	while (!leave) {
+		pthread_mutex_lock(&worker_lock);
+		nr_idle++;
+		while (!queue_first)
+			pthread_cond_wait(&worker_cond, &worker_lock);
+		nr_idle--;
+		rr = queue_first;
+		queue_first = rr->next;
+		if (!queue_first)
+			queue_last = NULL;
+		nr_queued--;
+		running.push_back(rr);
+		pthread_mutex_unlock(&worker_lock);
+
+		err = fill_fn(rr->buf, rr->from, rr->len);
+
+		pthread_mutex_lock(&worker_lock);
+		running.erase(std::find(running.begin(), running.end(), rr));
+		late = rr->answered;
+		rr->answered = true;
+		/* leave if another worker is idle */
+		if (!queue_first && nr_workers - 1 > (int) running.size()) {
+			nr_workers--;
+			leave = true;
+		}
+		pthread_mutex_unlock(&worker_lock);
+
+		if (late)
+			log_slow(rr, "finished");
+		else
+			reply_fn(rr->handle, err, rr->buf, rr->len);
+		free(rr->buf);
+		free(rr);
+	}
+	return NULL;
+}
+
+/* Call with worker_lock held */
+static bool start_worker()
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, worker_thread, NULL) != 0)
+		return false;
+	pthread_detach(thread);
+	nr_workers++;
+	return true;
+}
+
+static void *watchdog_thread(void *)
+{
+	/* copies, because running requests are freed by their workers */
+	std::vector<struct request> expired;
+	std::vector<struct request *> dropped;
+	struct request **rrp;
+	struct request *rr;
+	double now;
+
+	for (;;) {
+		usleep(std::max(deadline / 4, 0.01) * 1e6);
+		if (!deadline)
+			continue;
+
+		now = monotonic_now();
+		pthread_mutex_lock(&worker_lock);
+		for (size_t i = 0; i < running.size(); i++) {
+			rr = running[i];
+			if (!rr->answered && now - rr->received > deadline) {
+				rr->answered = true;
+				expired.push_back(*rr);
+			}
+		}
+		/* Queued requests only expire if all the workers are busy */
+		queue_last = NULL;
+		for (rrp = &queue_first; *rrp; ) {
+			rr = *rrp;
+			if (now - rr->received > deadline) {
+				*rrp = rr->next;
+				nr_queued--;
+				expired.push_back(*rr);
+				dropped.push_back(rr);
+			} else {
+				queue_last = rr;
+				rrp = &rr->next;
+			}
+		}
+		pthread_mutex_unlock(&worker_lock);
+
+		for (size_t i = 0; i < expired.size(); i++) {
+			log_slow(&expired[i], "timed out");
+			reply_fn(expired[i].handle, EIO, NULL, 0);
+		}
+		for (size_t i = 0; i < dropped.size(); i++) {
+			free(dropped[i]->buf);
+			free(dropped[i]);
+		}
+		expired.clear();
+		dropped.clear();
+	}
+	return NULL;
+}
+
+bool worker_init(worker_fill_fn fill, worker_reply_fn reply,
+	worker_describe_fn describe, uint32_t deadline_ms)
+{
+	pthread_t thread;
+	bool ok = true;
+
+	pthread_mutex_lock(&worker_lock);
+	fill_fn = fill;
+	reply_fn = reply;
+	describe_fn = describe;
+	deadline = deadline_ms / 1000.0;
+	if (nr_workers == 0)
+		ok = start_worker();
+	if (ok && deadline && !watchdog_started) {
+		ok = pthread_create(&thread, NULL, watchdog_thread, NULL) == 0;
+		if (ok) {
+			pthread_detach(thread);
+			watchdog_started = true;
+		}
+	}
+	pthread_mutex_unlock(&worker_lock);
+	return ok;
+}
+
+void worker_queue(const char *handle, uint64_t from, uint32_t len, void *buf)
+{
+	struct request *rr;
+
+	rr = (struct request *) malloc(sizeof(*rr));
+	if (!rr) {
+		free(buf);
+		reply_fn(handle, ENOMEM, NULL, 0);
+		return;
+	}
+	memcpy(rr->handle, handle, sizeof(rr->handle));
+	rr->from = from;
+	rr->len = len;
+	rr->buf = buf;
+	rr->received = monotonic_now();
+	rr->answered = false;
+	rr->next = NULL;
+
+	pthread_mutex_lock(&worker_lock);
+	if (queue_last)
+		queue_last->next = rr;
+	else
+		queue_first = rr;
+	queue_last = rr;
+	nr_queued++;
+	/* a failed start leaves the read to the workers there are */
+	if (nr_queued > nr_idle && nr_workers < MAX_WORKERS)
+		start_worker();
+	pthread_cond_signal(&worker_cond);
+	pthread_mutex_unlock(&worker_lock);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ * Contact: Richard Braakman <richard.braakman@jollamobile.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * This file is the interface to the I/O worker threads, which do
+ * the reads that may have to wait for storage, so that the serve
+ * loop doesn't have to.
+ */
+
+#include <stdint.h>
+
+/* Fill 'buf' with 'len' bytes of the image from offset 'from'.
+ * Result: 0 for success or errno for failure. */
+typedef int (*worker_fill_fn)(void *buf, uint64_t from, uint32_t len);
+
+/* Send the result of a request. 'buf' is only valid during the call. */
+typedef void (*worker_reply_fn)(const char *handle, int error,
+	void *buf, uint32_t len);
+
+/* Write a description of what's at image offset 'from', such as
+ * a file path, to 'buf'. Result: its length, or -1 if there is none. */
+typedef int (*worker_describe_fn)(uint64_t from, char *buf, int size);
+
+/* Start the first worker thread. Requests that aren't done within
+ * 'deadline_ms' milliseconds are answered with EIO, and the read is
+ * left to finish in the background. 0 means no deadline.
+ * Result: false if no thread could be started. */
+bool worker_init(worker_fill_fn fill, worker_reply_fn reply,
+	worker_describe_fn describe, uint32_t deadline_ms);
+
+/* Queue a read. The worker takes over 'buf', which must have been
+ * allocated with malloc(), and answers the request with 'handle'. */
+void worker_queue(const char *handle, uint64_t from, uint32_t len, void *buf);